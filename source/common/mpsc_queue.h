@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "common/nocopyormove.h"
+
+/**
+* Bounded lock-free queue, many producers and a single consumer
+* Based on D. Vyukov bounded queue: every slot has a sequence number
+* that tells if it is free for the producer at that position, or
+* ready for the consumer. Capacity is rounded up to a power of 2
+*
+* Slots are reused, push/pop give access to the slot in place, so
+* the stored objects keep their resources (ie: string capacity)
+*/
+template <class T>
+class MpscQueue : private NoCopyOrMove {
+    struct Slot {
+        std::atomic<size_t> mSeq;
+        T mData;
+    };
+    std::unique_ptr<Slot[]> mSlots;
+    size_t mMask;
+
+    alignas(64) std::atomic<size_t> mHead = 0; // Next position for producers
+    alignas(64) std::atomic<size_t> mTail = 0; // Next position for the consumer
+
+public:
+    explicit MpscQueue(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        mMask = size - 1;
+        mSlots = std::make_unique<Slot[]>(size);
+        for (size_t i = 0; i < size; i++)
+            mSlots[i].mSeq.store(i, std::memory_order_relaxed);
+    }
+
+    // Any thread, fill(T&) is called with the reserved slot
+    // Returns false without calling fill() if the queue is full
+    template <class F>
+    bool tryPush(F&& fill) {
+        auto pos = mHead.load(std::memory_order_relaxed);
+        while (true) {
+            auto& slot = mSlots[pos & mMask];
+            auto seq = slot.mSeq.load(std::memory_order_acquire);
+            auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (mHead.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    fill(slot.mData);
+                    slot.mSeq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = mHead.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Consumer thread only, consume(T&) is called with the oldest element
+    // Returns false if there was nothing ready to consume
+    template <class F>
+    bool tryPop(F&& consume) {
+        auto pos = mTail.load(std::memory_order_relaxed);
+        auto& slot = mSlots[pos & mMask];
+        auto seq = slot.mSeq.load(std::memory_order_acquire);
+        if (static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1) < 0)
+            return false;
+        consume(slot.mData);
+        slot.mSeq.store(pos + mMask + 1, std::memory_order_release);
+        mTail.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t capacity() const {return mMask + 1;}
+    // Positions claimed by producers / released by the consumer
+    //  produced() >= consumed(), the difference are the elements in flight
+    size_t produced() const {return mHead.load(std::memory_order_acquire);}
+    size_t consumed() const {return mTail.load(std::memory_order_acquire);}
+    bool empty() const {return consumed() == produced();}
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include "common/nocopyormove.h"
+
+/**
+* Read-copy-update holder of an immutable T
+* Readers never lock, they register in one of two counters and take the
+* current pointer. Writers are serialized, they publish a modified copy and
+* wait until no reader can see the old one before deleting it.
+*
+* Updating from inside a read section would wait for itself, it is
+* rejected (any Rcu<T> of the same T counts)
+*/
+template <class T>
+class Rcu : private NoCopyOrMove {
+    std::atomic<const T*> mPtr;
+    std::atomic<size_t> mEpoch = 0;
+    alignas(64) std::atomic<size_t> mReaders[2] = {};
+    std::mutex mWriteMutex;
+    // Read sections open in this thread
+    static inline thread_local size_t tReading = 0;
+
+    // Waits for all readers that could have seen the previous pointer
+    //  flipping the epoch first, so new readers do not delay us
+    void synchronize() {
+        for (int i = 0; i < 2; i++) {
+            auto idx = mEpoch.fetch_add(1) & 1;
+            while (mReaders[idx].load() != 0)
+                std::this_thread::yield();
+        }
+    }
+
+public:
+    class Reader : private NoCopyOrMove {
+        std::atomic<size_t>& mCounter;
+        const T* mPtr;
+    public:
+        Reader(Rcu& rcu) : mCounter(rcu.mReaders[rcu.mEpoch.load() & 1]) {
+            tReading++;
+            mCounter.fetch_add(1);
+            mPtr = rcu.mPtr.load();
+        }
+        ~Reader() {
+            mCounter.fetch_sub(1, std::memory_order_release);
+            tReading--;
+        }
+
+        const T& operator*() const {return *mPtr;}
+        const T* operator->() const {return mPtr;}
+    };
+
+    explicit Rcu(T initial) : mPtr(new T(std::move(initial))) {}
+    ~Rcu() {delete mPtr.load();}
+
+    Reader read() {return Reader(*this);}
+    // True inside a read section, where update() is rejected
+    static bool reading() {return tReading > 0;}
+
+    // f(T&) modifies a copy, that is then published. False if called from
+    //  a read section, nothing is changed
+    template <class F>
+    bool update(F&& f) {
+        if (reading())
+            return false;
+        std::unique_lock<std::mutex> lock(mWriteMutex);
+        auto old = mPtr.load();
+        auto copy = new T(*old);
+        f(*copy);
+        mPtr.store(copy);
+        synchronize();
+        delete old;
+        return true;
+    }
+};
@@ -1,27 +1,94 @@
+#include <time.h>
+
+#include <condition_variable>
+#include <deque>
 #include <iostream>
+#include <set>
 #include <fmt/color.h>
 
 #include "core/log.h"
+#include "core/log_binary.h"
 
 std::mutex Log::mMutex;
-std::atomic<bool> Log::mStdout = true;
-std::atomic<bool> Log::mColored = true;
-std::atomic<Log::Level> Log::mVerboseLevel = Log::kDefaultVerboseLevel;
+Log::Setting<bool> Log::mStdout = true;
+Log::Setting<bool> Log::mColored = true;
+Log::Setting<Log::Level> Log::mVerboseLevel = Log::kDefaultVerboseLevel;
+std::atomic<bool> Log::mPrintTime = false;
+std::atomic<bool> Log::Clock::mPrecise = false;
+std::atomic<Log::Clock::rep> Log::Clock::mLastPrecise = 0;
+
+std::atomic<Log::Overflow> Log::mOverflow = Log::Overflow::DROP;
+std::atomic<uint64_t> Log::mDropped = 0;
+
+std::mutex Log::mFlusherControlMutex;
+std::thread Log::mFlusher;
+bool Log::mFlusherExited = false;
+std::atomic<bool> Log::mFlusherStop = false;
+std::atomic<bool> Log::mFlusherSleeping = false;
+std::atomic<uint32_t> Log::mFlusherWakeup = 0;
+std::mutex Log::mFlusherMutex;
+std::condition_variable Log::mFlusherCv;
+std::condition_variable Log::mFlushedCv;
+std::shared_ptr<Log::Queue> Log::mFlusherQueue;
+uint64_t Log::mFlushRequested = 0;
+uint64_t Log::mFlushDone = 0;
+
+namespace {
+    thread_local const Log::Record* tCurrent = nullptr;
+    // Scratch records, deque so they do not move when growing
+    thread_local std::deque<Log::Record> tScratch;
+    thread_local size_t tScratchUsed = 0;
+    thread_local bool tFlusher = false;
+
+    // All the call site limits alive
+    std::mutex sLimitsMutex;
+    std::set<Log::Limit*> sLimits;
+    // Reports them periodically, started by the first suppressed record
+    //  and joined at exit
+    std::mutex sReporterMutex;
+    std::condition_variable sReporterCv;
+    std::thread sReporter;
+    std::atomic<bool> sReporterStarted = false;
+    bool sReporterStop = false; // With sReporterMutex, set at exit
+
+    void reporterLoop() {
+        std::unique_lock<std::mutex> lock(sReporterMutex);
+        while (!sReporterStop) {
+            // Changes to the interval are seen at the next wake up
+            auto interval = Log::Limit::mReportInterval.load();
+            sReporterCv.wait_for(lock, interval.count() > 0 ? interval : std::chrono::seconds(1));
+            if (sReporterStop || Log::Limit::mReportInterval.load().count() == 0)
+                continue;
+            lock.unlock();
+            Log::reportSuppressed();
+            lock.lock();
+        }
+    }
+
+    void startReporter() {
+        std::unique_lock<std::mutex> lock(sReporterMutex);
+        if (sReporterStarted || sReporterStop)
+            return;
+        sReporter = std::thread(reporterLoop);
+        sReporterStarted = true;
+    }
+
+    uint64_t coarseSeconds() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return ts.tv_sec;
+    }
+};
 
 using namespace fmt;
 
-std::map<int, std::pair<Log::filterFunction, Log::callbackFunction>> Log::mCallbacks = {
+Rcu<Log::Sinks> Log::mSinks(Sinks{{
     // Uncolored
     {0,
       {
         [](Type, Level level) {return Log::mStdout && !Log::mColored && level >= mVerboseLevel;},
-        [](Type t, Level l, const std::string& str) {
-          auto tid = std::hash<std::thread::id>{}(std::this_thread::get_id()) % 0x1000000;
-          fmt::print("{:4x} {:3} {:c} {}\n",
-              tid,
-              magic_enum::enum_name(t),
-              magic_enum::enum_name(l)[0],
-              str);
+        [](Type, Level, std::string_view) {
+          Log::print(Log::current(), false);
         }
       }
     },
@@ -29,49 +96,635 @@ std::map<int, std::pair<Log::filterFunction, Log::callbackFunction>> Log::mCallb
     {1,
       {
         [](Type, Level level) {return Log::mStdout && Log::mColored && level >= mVerboseLevel;},
-        [](Type t, Level l, const std::string& str) {
-          auto tid = std::hash<std::thread::id>{}(std::this_thread::get_id()) % 0x1000000;
-          static auto lColors = std::vector<text_style>{
-            fg(color::light_green),
-            fg(color::cyan),
-            fg(color::white),
-            fg(color::yellow),
-            fg(color::red),
-          };
-          static auto tColors = std::vector<text_style>{
-            fg(color::red),
-            fg(color::yellow),
-            fg(color::cyan),
-            fg(color::magenta),
-            fg(color::green),
-            fg(color::light_green),
-          };
-          auto iLevel = *magic_enum::enum_index(l);
-          auto iType = *magic_enum::enum_index(t);
-
-          fmt::print(fg(color(tid)), "{:6x}", tid);
-          fmt::print(tColors[iType], " {:3}", magic_enum::enum_name(t));
-          fmt::print(lColors[iLevel], " {:c}", magic_enum::enum_name(l)[0]);
-          fmt::print(" {}\n", str);
+        [](Type, Level, std::string_view) {
+          Log::print(Log::current(), true);
         }
       }
     }
+  },
+  nullptr // Synchronous until startAsync()
+});
+std::atomic<int> Log::mID = 1;
+std::atomic<uint64_t> Log::mTextMask = Log::computeMask();
+std::atomic<uint64_t> Log::mBinaryMask = 0;
+std::atomic<uint64_t> Log::mMask = Log::mTextMask.load();
+Log::filterFunction Log::mBinaryFilter;
+
+namespace {
+    // Buffers the records of a batch sink, the logging threads fill it up
+    //  and only the flusher thread delivers it, so the batches are in
+    //  order without holding a lock while calling back
+    class Batcher : private NoCopyOrMove {
+        typedef std::chrono::steady_clock Clock;
+        Log::batchFunction mCallback;
+        const size_t mMaxRecords;
+        const std::chrono::milliseconds mMaxDelay;
+
+        std::mutex mMutex;
+        std::condition_variable mCv; // Signals mClosed
+        // Records keep their text capacity between batches
+        std::vector<Log::Record> mPending;
+        size_t mUsed = 0;
+        Clock::time_point mOldest;
+        bool mClosing = false; // Removed, the rest is delivered
+        bool mClosed = false;
+        // Only used by the delivering thread
+        std::vector<Log::Record> mDelivering;
+
+    public:
+        Batcher(Log::batchFunction callback, size_t maxRecords, std::chrono::milliseconds maxDelay)
+            : mCallback(std::move(callback)), mMaxRecords(std::max<size_t>(maxRecords, 1)), mMaxDelay(maxDelay) {}
+
+        // True if the flusher has to look at it, the first record sets
+        //  the deadline, or it is full
+        bool push(const Log::Record& record) {
+            auto now = Clock::now();
+            std::unique_lock<std::mutex> lock(mMutex);
+            if (mUsed == mPending.size())
+                mPending.emplace_back();
+            auto& r = mPending[mUsed++];
+            r.type = record.type;
+            r.level = record.level;
+            r.thread = record.thread;
+            r.text.assign(record.text);
+            r.time = record.time;
+            if (mUsed == 1)
+                mOldest = now;
+            return mUsed == 1 || mUsed == mMaxRecords;
+        }
+
+        // Delivers the full batches, and the last partial one if old,
+        //  closing or all is set, false if it did not deliver anything.
+        //  next is lowered to the deadline of what is left
+        bool deliver(bool all, Clock::time_point& next) {
+            std::unique_lock<std::mutex> lock(mMutex);
+            if (mUsed == 0)
+                return false;
+            auto deadline = mOldest + mMaxDelay;
+            auto count = mUsed;
+            if (!all && !mClosing && Clock::now() < deadline)
+                count -= mUsed % mMaxRecords;
+            if (count == 0) {
+                next = std::min(next, deadline);
+                return false;
+            }
+            std::swap(mPending, mDelivering);
+            // The partial batch stays pending, its deadline unchanged
+            mUsed -= count;
+            for (size_t i = 0; i < mUsed; i++) {
+                if (i == mPending.size())
+                    mPending.emplace_back();
+                std::swap(mPending[i], mDelivering[count + i]);
+            }
+            if (mUsed)
+                next = std::min(next, deadline);
+            lock.unlock();
+            for (size_t i = 0; i < count; i += mMaxRecords) {
+                mCallback(std::span<const Log::Record>(mDelivering.data() + i,
+                    std::min(mMaxRecords, count - i)));
+            }
+            return true;
+        }
+
+        // Nothing is pushed once closing
+        void close() {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mClosing = true;
+        }
+        // True once closing and all delivered
+        bool finish() {
+            std::unique_lock<std::mutex> lock(mMutex);
+            if (!mClosing || mUsed)
+                return false;
+            mClosed = true;
+            mCv.notify_all();
+            return true;
+        }
+        void waitClosed() {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCv.wait(lock, [&](){return mClosed;});
+        }
+    };
+
+    std::mutex sBatchersMutex;
+    std::vector<std::shared_ptr<Batcher>> sBatchers;
+
+    // From the flusher thread, false if nothing was delivered
+    bool deliverBatches(bool all, std::chrono::steady_clock::time_point& next) {
+        // Delivered without the lock, a callback can log into a batch sink
+        static std::vector<std::shared_ptr<Batcher>> batchers;
+        {
+            std::unique_lock<std::mutex> lock(sBatchersMutex);
+            batchers.assign(sBatchers.begin(), sBatchers.end());
+        }
+        bool any = false;
+        for (auto& batcher : batchers) {
+            if (batcher->deliver(all, next)) {
+                any = true;
+            } else if (batcher->finish()) {
+                std::unique_lock<std::mutex> lock(sBatchersMutex);
+                std::erase(sBatchers, batcher);
+            }
+        }
+        batchers.clear();
+        return any;
+    }
 };
-std::atomic<int> Log::mID = mCallbacks.size();
+
+// Destroyed before the callbacks, so pending async records and batches
+//  are flushed
+Lazy Log::mFlusherExit([](){
+    stopAsync();
+    std::unique_lock<std::mutex> lock(mFlusherControlMutex);
+    mFlusherExited = true;
+    if (mFlusher.joinable()) {
+        mFlusherStop = true;
+        wakeFlusher();
+        mFlusher.join();
+    }
+});
+// Destroyed before the flusher stops, its last reports are flushed too
+static Lazy sReporterJoin([](){
+    std::unique_lock<std::mutex> lock(sReporterMutex);
+    sReporterStop = true;
+    lock.unlock();
+    sReporterCv.notify_one();
+    if (sReporter.joinable())
+        sReporter.join();
+});
 
 Log::Log(Type type) {
     mType = type;
 }
 
+Lazy Log::addBatch(batchFunction callback, filterFunction filter, size_t maxRecords, std::chrono::milliseconds maxDelay) {
+    if (mSinks.reading() || tFlusher)
+        return Lazy([](){}); // From a callback, see add()
+    auto batcher = std::make_shared<Batcher>(std::move(callback), maxRecords, maxDelay);
+    {
+        std::unique_lock<std::mutex> lock(mFlusherControlMutex);
+        {
+            std::unique_lock<std::mutex> batchersLock(sBatchersMutex);
+            sBatchers.push_back(batcher);
+        }
+        updateFlusher();
+    }
+    auto remove = std::shared_ptr<Lazy>(new Lazy(add([batcher](Type, Level, std::string_view){
+        if (batcher->push(current()))
+            wakeFlusher();
+    }, filter)));
+    return Lazy([batcher, remove]() mutable {
+        // Once removed nobody pushes, the flusher delivers the rest
+        remove->wait();
+        batcher->close();
+        if (tFlusher)
+            return; // From a batch callback, it finishes it later
+        std::unique_lock<std::mutex> lock(mFlusherControlMutex);
+        if (mFlusher.joinable()) {
+            wakeFlusher();
+            batcher->waitClosed();
+        } else {
+            // Stopped at exit, delivered here
+            auto next = std::chrono::steady_clock::time_point::max();
+            batcher->deliver(true, next);
+            std::unique_lock<std::mutex> batchersLock(sBatchersMutex);
+            std::erase(sBatchers, batcher);
+        }
+        updateFlusher();
+    });
+}
+
 Lazy Log::add(callbackFunction callback, filterFunction filter) {
+    // Rejected from a callback, the update would wait for the callback
+    //  itself, and a writer holding mMutex may be waiting for it too
+    if (mSinks.reading())
+        return Lazy([](){});
     std::unique_lock<std::mutex> lock(mMutex);
     int id = ++mID;
-    mCallbacks[id] = {filter, callback};
-    return Lazy([&,id](){
+    mSinks.update([&](Sinks& sinks){
+        sinks.mCallbacks[id] = {filter, callback};
+    });
+    refreshMask();
+    return Lazy([id](){
+        if (mSinks.reading())
+            return;
+        // Once removed, no thread is still running the callback
         std::unique_lock<std::mutex> lock(mMutex);
-        auto it = mCallbacks.find(id);
-        if (it != mCallbacks.end()) {
-            mCallbacks.erase(it);
+        mSinks.update([&](Sinks& sinks){
+            sinks.mCallbacks.erase(id);
+        });
+        refreshMask();
+    });
+}
+
+size_t Log::threadId() {
+    static thread_local size_t id = std::hash<std::thread::id>{}(std::this_thread::get_id()) % 0x1000000;
+    return id;
+}
+
+const Log::Record& Log::current() {
+    return *tCurrent;
+}
+
+int64_t Log::wallOffset() {
+    static const int64_t offset = [](){
+        struct timespec mono, wall;
+        clock_gettime(CLOCK_MONOTONIC, &mono);
+        clock_gettime(CLOCK_REALTIME, &wall);
+        return (wall.tv_sec - mono.tv_sec) * 1000000000LL + (wall.tv_nsec - mono.tv_nsec);
+    }();
+    return offset;
+}
+
+std::chrono::system_clock::time_point Log::wallTime(Clock::time_point time) {
+    auto ns = std::chrono::nanoseconds(time.time_since_epoch().count() + wallOffset());
+    return std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(ns));
+}
+
+Log::Scratch::Scratch() : mRecord(tScratchUsed < tScratch.size() ? tScratch[tScratchUsed] : tScratch.emplace_back()) {
+    tScratchUsed++;
+    mRecord.text.clear();
+}
+
+Log::Scratch::~Scratch() {
+    tScratchUsed--;
+}
+
+uint64_t Log::computeMask(const filterFunction& filter) {
+    uint64_t mask = 0;
+    for (auto type : magic_enum::enum_values<Type>()) {
+        for (auto level : magic_enum::enum_values<Level>()) {
+            if (filter(type, level))
+                mask |= bit(type, level);
         }
+    }
+    return mask;
+}
+
+uint64_t Log::computeMask() {
+    // mMutex is held by the caller (or static init)
+    uint64_t mask = 0;
+    auto sinks = mSinks.read();
+    for (auto& [id, callback] : sinks->mCallbacks)
+        mask |= computeMask(callback.first);
+    return mask;
+}
+
+void Log::refreshMask() {
+    // mMutex is held by the caller
+    mTextMask = computeMask();
+    mBinaryMask = mBinaryFilter ? computeMask(mBinaryFilter) : 0;
+    mMask = mTextMask | mBinaryMask;
+}
+
+void Log::updateMask() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    refreshMask();
+}
+
+void Log::dispatch(const Sinks& sinks, const Record& record) {
+    auto prev = tCurrent;
+    tCurrent = &record;
+    for (auto& [id, callback] : sinks.mCallbacks) {
+        auto& [filter, call] = callback;
+        if (filter(record.type, record.level))
+            call(record.type, record.level, record.text);
+    }
+    tCurrent = prev;
+}
+
+void Log::enqueue(Queue& queue, const Record& record) {
+    // Copy in the slot, its text keeps the capacity of previous records
+    auto fill = [&](Record& r){
+        r.type = record.type;
+        r.level = record.level;
+        r.thread = record.thread;
+        r.text.assign(record.text);
+        r.time = record.time;
+    };
+    while (!queue.tryPush(fill)) {
+        if (mOverflow != Overflow::BLOCK) {
+            mDropped++;
+            return;
+        }
+        wakeFlusher();
+        std::this_thread::yield();
+    }
+    // Pair with the fence in the flusher, either we see it sleeping
+    //  or it sees our record before going to sleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (mFlusherSleeping.load(std::memory_order_relaxed))
+        wakeFlusher();
+}
+
+void Log::wakeFlusher() {
+    mFlusherWakeup.fetch_add(1, std::memory_order_release);
+    // Through the lock, so it is not lost between its check and its wait
+    { std::unique_lock<std::mutex> lock(mFlusherMutex); }
+    mFlusherCv.notify_one();
+}
+
+void Log::flusherLoop() {
+    tFlusher = true;
+    uint64_t reported = mDropped;
+    while (true) {
+        auto wakeup = mFlusherWakeup.load(std::memory_order_acquire);
+        std::shared_ptr<Queue> queue;
+        uint64_t flushRequested;
+        {
+            std::unique_lock<std::mutex> lock(mFlusherMutex);
+            queue = mFlusherQueue;
+            flushRequested = mFlushRequested;
+        }
+        bool any = false;
+        if (queue) {
+            while (queue->tryPop([](Record& r){
+                dispatch(*mSinks.read(), r);
+            })) {
+                any = true;
+            }
+            // Report lost records (only on COUNT policy)
+            uint64_t dropped = mDropped;
+            if (dropped != reported && mOverflow == Overflow::COUNT) {
+                Record r{Type::CORE, Level::WARN, threadId(),
+                    fmt::format("Log queue full, dropped {} records", dropped - reported), Clock::now()};
+                if (enabled(r.type, r.level))
+                    dispatch(*mSinks.read(), r);
+            }
+            reported = dropped;
+        }
+        // Everything when flushing or stopping, otherwise the due ones
+        bool all = flushRequested != mFlushDone || mFlusherStop;
+        auto next = std::chrono::steady_clock::time_point::max();
+        if (deliverBatches(all, next))
+            any = true;
+        if (flushRequested != mFlushDone) {
+            // The records pushed before the request were all delivered
+            std::unique_lock<std::mutex> lock(mFlusherMutex);
+            mFlushDone = flushRequested;
+            mFlushedCv.notify_all();
+        }
+        if (any)
+            continue;
+
+        // Nothing pending, exit or go to sleep until woken or the
+        //  next batch is due. When stopping, the queue is gone already
+        if (mFlusherStop)
+            break;
+        mFlusherSleeping = true;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!queue || queue->empty()) {
+            std::unique_lock<std::mutex> lock(mFlusherMutex);
+            auto woken = [&](){return mFlusherWakeup.load(std::memory_order_acquire) != wakeup;};
+            if (next == std::chrono::steady_clock::time_point::max())
+                mFlusherCv.wait(lock, woken);
+            else
+                mFlusherCv.wait_until(lock, next, woken);
+        }
+        mFlusherSleeping = false;
+    }
+}
+
+void Log::updateFlusher() {
+    bool needed;
+    {
+        std::unique_lock<std::mutex> lock(mFlusherMutex);
+        needed = mFlusherQueue != nullptr;
+    }
+    if (!needed) {
+        std::unique_lock<std::mutex> lock(sBatchersMutex);
+        needed = !sBatchers.empty();
+    }
+    if (needed && !mFlusher.joinable() && !mFlusherExited) {
+        mFlusherStop = false;
+        mFlusher = std::thread(&Log::flusherLoop);
+    } else if (!needed && mFlusher.joinable()) {
+        mFlusherStop = true;
+        wakeFlusher();
+        mFlusher.join();
+    }
+}
+
+bool Log::startAsync(size_t queueSize, Overflow overflow) {
+    if (mSinks.reading() || tFlusher)
+        return false; // From a callback, see add()
+    std::unique_lock<std::mutex> lock(mMutex);
+    mOverflow = overflow;
+    if (mSinks.read()->mQueue)
+        return true; // Already running
+    auto queue = std::make_shared<Queue>(queueSize);
+    {
+        std::unique_lock<std::mutex> controlLock(mFlusherControlMutex);
+        if (mFlusherExited)
+            return false;
+        {
+            std::unique_lock<std::mutex> flusherLock(mFlusherMutex);
+            mFlusherQueue = queue;
+        }
+        updateFlusher();
+        wakeFlusher();
+    }
+    mSinks.update([&](Sinks& sinks){
+        sinks.mQueue = queue;
+    });
+    return true;
+}
+
+void Log::stopAsync() {
+    if (mSinks.reading() || tFlusher)
+        return; // From a callback, see add()
+    std::unique_lock<std::mutex> lock(mMutex);
+    auto queue = mSinks.read()->mQueue;
+    if (!queue)
+        return;
+    // New records go sync from now on, once the update returns
+    //  no producer is using the queue, the flusher drains it
+    mSinks.update([&](Sinks& sinks){
+        sinks.mQueue.reset();
+    });
+    while (!queue->empty()) {
+        wakeFlusher();
+        std::this_thread::yield();
+    }
+    std::unique_lock<std::mutex> controlLock(mFlusherControlMutex);
+    {
+        std::unique_lock<std::mutex> flusherLock(mFlusherMutex);
+        mFlusherQueue.reset();
+    }
+    updateFlusher();
+}
+
+bool Log::isAsync() {
+    return mSinks.read()->mQueue != nullptr;
+}
+
+void Log::flush() {
+    // From a callback it would wait for itself
+    if (mSinks.reading() || tFlusher)
+        return;
+    auto queue = mSinks.read()->mQueue;
+    if (queue) {
+        auto target = queue->produced();
+        while (queue->consumed() < target) {
+            wakeFlusher();
+            std::this_thread::yield();
+        }
+    }
+    // Then everything the batch sinks have
+    std::unique_lock<std::mutex> controlLock(mFlusherControlMutex);
+    if (!mFlusher.joinable())
+        return;
+    std::unique_lock<std::mutex> lock(mFlusherMutex);
+    auto ticket = ++mFlushRequested;
+    lock.unlock();
+    wakeFlusher();
+    lock.lock();
+    mFlushedCv.wait(lock, [&](){return mFlushDone >= ticket;});
+}
+
+void Log::print(const Record& r, bool colored) {
+    static auto lColors = std::vector<text_style>{
+      fg(color::light_green),
+      fg(color::cyan),
+      fg(color::white),
+      fg(color::yellow),
+      fg(color::red),
+    };
+    static auto tColors = std::vector<text_style>{
+      fg(color::red),
+      fg(color::yellow),
+      fg(color::cyan),
+      fg(color::magenta),
+      fg(color::green),
+      fg(color::light_green),
+    };
+    // Reused between calls, the thread prefix only changes when
+    //  printing records of another thread (async flusher)
+    thread_local memory_buffer line;
+    thread_local memory_buffer prefix;
+    thread_local std::pair<size_t, bool> prefixOf = {~size_t(0), false};
+    if (prefixOf != std::make_pair(r.thread, colored)) {
+        prefixOf = {r.thread, colored};
+        prefix.clear();
+        if (colored)
+            format_to(std::back_inserter(prefix), fg(color(r.thread)), "{:6x}", r.thread);
+        else
+            format_to(std::back_inserter(prefix), "{:4x}", r.thread);
+    }
+
+    // Callbacks run concurrently, write the whole line at once
+    line.clear();
+    if (mPrintTime) {
+        auto wall = wallTime(r.time);
+        auto seconds = std::chrono::system_clock::to_time_t(wall);
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(wall.time_since_epoch()).count() % 1000;
+        struct tm tm;
+        localtime_r(&seconds, &tm);
+        format_to(std::back_inserter(line), "{:02}:{:02}:{:02}.{:03} ", tm.tm_hour, tm.tm_min, tm.tm_sec, ms);
+    }
+    line.append(prefix);
+    auto out = std::back_inserter(line);
+    if (colored) {
+        auto iLevel = *magic_enum::enum_index(r.level);
+        auto iType = *magic_enum::enum_index(r.type);
+        format_to(out, tColors[iType], " {:3}", magic_enum::enum_name(r.type));
+        format_to(out, lColors[iLevel], " {:c}", magic_enum::enum_name(r.level)[0]);
+    } else {
+        format_to(out, " {:3} {:c}", magic_enum::enum_name(r.type), magic_enum::enum_name(r.level)[0]);
+    }
+    format_to(out, " {}\n", r.text);
+    fwrite(line.data(), 1, line.size(), stdout);
+}
+
+std::atomic<std::chrono::milliseconds> Log::Limit::mReportInterval{std::chrono::seconds(1)};
+
+Log::Limit::Limit(uint32_t perSecond, uint32_t oneIn)
+    : mPerSecond(perSecond), mOneIn(std::max<uint32_t>(oneIn, 1)) {
+    std::unique_lock<std::mutex> lock(sLimitsMutex);
+    sLimits.insert(this);
+}
+
+Log::Limit::~Limit() {
+    std::unique_lock<std::mutex> lock(sLimitsMutex);
+    sLimits.erase(this);
+}
+
+bool Log::Limit::allow(Type type, Level level, fmt::string_view format) {
+    mType.store(type, std::memory_order_relaxed);
+    mLevel.store(level, std::memory_order_relaxed);
+    mFormatSize.store(format.size(), std::memory_order_relaxed);
+    mFormat.store(format.data(), std::memory_order_relaxed);
+
+    // First call in a new second, reset the budget and report
+    auto now = coarseSeconds();
+    auto second = mSecond.load(std::memory_order_relaxed);
+    if (now != second && mSecond.compare_exchange_strong(second, now, std::memory_order_relaxed)) {
+        mInSecond = 0;
+        report();
+    }
+    if (mCalls.fetch_add(1, std::memory_order_relaxed) % mOneIn != 0 ||
+        (mPerSecond && mInSecond.fetch_add(1, std::memory_order_relaxed) >= mPerSecond)) {
+        mSuppressed.fetch_add(1, std::memory_order_relaxed);
+        if (!sReporterStarted.load(std::memory_order_relaxed))
+            startReporter();
+        return false;
+    }
+    return true;
+}
+
+Log::Limit::Summary Log::Limit::takeSummary() {
+    return {mType.load(std::memory_order_relaxed), mLevel.load(std::memory_order_relaxed),
+        mSuppressed.exchange(0, std::memory_order_relaxed),
+        std::string_view(mFormat.load(std::memory_order_relaxed), mFormatSize.load(std::memory_order_relaxed))};
+}
+
+void Log::Limit::log(const Summary& summary) {
+    if (!summary.mSuppressed)
+        return;
+    Log::log(summary.mType, summary.mLevel, "Suppressed {} records like \"{}\"", summary.mSuppressed, summary.mFormat);
+}
+
+void Log::Limit::report() {
+    log(takeSummary());
+}
+
+void Log::reportSuppressed() {
+    // Logged without the lock, a sink can create or destroy limits
+    std::vector<Limit::Summary> summaries;
+    {
+        std::unique_lock<std::mutex> lock(sLimitsMutex);
+        for (auto limit : sLimits)
+            summaries.push_back(limit->takeSummary());
+    }
+    for (auto& summary : summaries)
+        Limit::log(summary);
+}
+
+bool Log::openBinary(const std::string& path, filterFunction filter) {
+    closeBinary();
+    if (!BinaryLog::open(path, wallOffset()))
+        return false;
+    std::unique_lock<std::mutex> lock(mMutex);
+    mBinaryFilter = filter;
+    refreshMask();
+    return true;
+}
+
+void Log::closeBinary() {
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mBinaryFilter = nullptr;
+        refreshMask();
+    }
+    BinaryLog::close();
+}
+
+bool Log::decodeBinary(const std::string& path, std::function<void(const Record&)> callback) {
+    return BinaryLog::decode(path, [&](uint8_t type, uint8_t level, uint32_t thread, int64_t wallTime, const std::string& text){
+        auto t = magic_enum::enum_cast<Type>(type);
+        auto l = magic_enum::enum_cast<Level>(level);
+        // To our clock, so wallTime() gives back the original one
+        auto time = Clock::time_point(Clock::duration(wallTime - wallOffset()));
+        callback({t.value_or(Type::UNKW), l.value_or(Level::ERROR), thread, text, time});
     });
 }
@@ -1,19 +1,46 @@
 #pragma once
 
+#include <time.h>
+
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <span>
+#include <string_view>
+#include <thread>
 
 #include <magic_enum.hpp>
 #include <fmt/core.h>
 #include <fmt/format.h>
 
 #include "common/lazy.h"
+#include "common/mpsc_queue.h"
+#include "common/nocopyormove.h"
+#include "common/rcu.h"
+#include "core/log_binary.h"
+
+#ifndef FREEDOMDB_LOG_MIN_LEVEL
+#define FREEDOMDB_LOG_MIN_LEVEL TRACE
+#endif
 
 /**
-* The log class is a global singleton mutex protected
+* The log class is a global singleton
 * But you can instantiate one for easy call
 * a given Type of Log
+*
+* The callbacks are an immutable snapshot (RCU), logging never locks and
+* adding or removing callbacks does not block the threads logging.
+* By default callbacks are called by the thread logging, so they can run
+* concurrently. In async mode the record is formatted by the caller and
+* pushed to a lock-free queue, then a flusher thread calls the callbacks.
+*
+* Format strings are checked at compile time, and formatted into a thread
+* local record reused between calls, so logging does not allocate once
+* warm. The text given to the callbacks is only valid during the call.
 */
 
 class Log {
@@ -35,72 +62,346 @@ public:
     };
 
     static const Level kDefaultVerboseLevel = Level::INFO;
-    typedef std::function<void(Type, Level, const std::string &)> callbackFunction;
+    // Calls below this level are removed at compile time (CMake LOG_MIN_LEVEL)
+    static constexpr Level kMinLevel = Level::FREEDOMDB_LOG_MIN_LEVEL;
+    typedef std::function<void(Type, Level, std::string_view)> callbackFunction;
     typedef std::function<bool(Type, Level)> filterFunction;
 
+    // What to do when the async queue is full
+    enum class Overflow {
+        DROP, // Discard the record
+        COUNT, // Discard the record, and log how many were discarded
+        BLOCK, // Wait until the flusher makes room
+    };
+    static constexpr size_t kDefaultQueueSize = 4096;
+
+    // Monotonic clock of the records, read once per record (vDSO, no
+    //  syscall). Coarse by default (ms resolution), or precise (ns).
+    //  The coarse one lags up to a tick, so after switching back it is
+    //  clamped to the last precise time, it never goes backwards
+    struct Clock {
+        typedef std::chrono::nanoseconds duration;
+        typedef duration::rep rep;
+        typedef duration::period period;
+        typedef std::chrono::time_point<Clock> time_point;
+        static constexpr bool is_steady = true;
+        static std::atomic<bool> mPrecise;
+        // Only written in precise mode, the coarse one just reads it
+        static std::atomic<rep> mLastPrecise;
+
+        static time_point now() {
+            struct timespec ts;
+            bool precise = mPrecise.load(std::memory_order_relaxed);
+            clock_gettime(precise ? CLOCK_MONOTONIC : CLOCK_MONOTONIC_COARSE, &ts);
+            rep t = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+            auto last = mLastPrecise.load(std::memory_order_relaxed);
+            if (!precise)
+                return time_point(duration(std::max(t, last)));
+            while (t > last && !mLastPrecise.compare_exchange_weak(last, t, std::memory_order_relaxed)) {}
+            return time_point(duration(t));
+        }
+    };
+    // Wall time of a record, only computed by the sinks that need it
+    static std::chrono::system_clock::time_point wallTime(Clock::time_point time);
+    // Nanoseconds from Clock to the wall time, stored in the log files
+    static int64_t wallOffset();
+
+    struct Record {
+        Type type;
+        Level level;
+        size_t thread;
+        std::string text;
+        Clock::time_point time; // Creation
+    };
+    typedef MpscQueue<Record> Queue;
+
+    // Batch sinks get the records in bulk, only valid during the call
+    typedef std::function<void(std::span<const Record>)> batchFunction;
+    static constexpr size_t kDefaultBatchSize = 256;
+    static constexpr auto kDefaultBatchDelay = std::chrono::milliseconds(100);
+
+    typedef std::map<int, std::pair<filterFunction, callbackFunction>> Callbacks;
+
 private:
-    static std::map<int, std::pair<filterFunction, callbackFunction>> mCallbacks;
+    // Everything the logging threads need, replaced as a whole
+    struct Sinks {
+        Callbacks mCallbacks;
+        std::shared_ptr<Queue> mQueue; // Set in async mode
+    };
+    static Rcu<Sinks> mSinks;
+    // Serializes the writers (add/remove, masks, async start/stop)
     static std::mutex mMutex;
     static std::atomic<int> mID;
+
+    // One bit per Type x Level, set if any callback wants it
+    //  computed from the filters every time the callbacks or settings change
+    //  mMask is the union of the text (callbacks) and the binary log ones
+    static std::atomic<uint64_t> mMask;
+    static std::atomic<uint64_t> mTextMask;
+    static std::atomic<uint64_t> mBinaryMask;
+    static filterFunction mBinaryFilter;
+    static constexpr auto kNumLevels = magic_enum::enum_count<Level>();
+    static_assert(magic_enum::enum_count<Type>() * kNumLevels <= 64);
+    static constexpr uint64_t bit(Type type, Level level) {
+        return uint64_t(1) << (static_cast<int>(type) * kNumLevels + static_cast<int>(level));
+    }
+    static uint64_t computeMask(const filterFunction& filter);
+    static uint64_t computeMask();
+    static void refreshMask();
+
+    // Async mode
+    static std::atomic<Overflow> mOverflow;
+    static std::atomic<uint64_t> mDropped;
+
+    // The flusher thread dispatches the async queue and delivers the batch
+    //  sinks, it runs while either is in use
+    static std::mutex mFlusherControlMutex; // Starting and stopping it
+    static std::thread mFlusher;
+    static bool mFlusherExited; // At exit, it is not started again
+    static std::atomic<bool> mFlusherStop;
+    static std::atomic<bool> mFlusherSleeping;
+    static std::atomic<uint32_t> mFlusherWakeup;
+    static std::mutex mFlusherMutex;
+    static std::condition_variable mFlusherCv;
+    static std::condition_variable mFlushedCv;
+    static std::shared_ptr<Queue> mFlusherQueue; // With mFlusherMutex
+    static uint64_t mFlushRequested; // With mFlusherMutex
+    static uint64_t mFlushDone; // With mFlusherMutex
+    static Lazy mFlusherExit;
+
+    static void dispatch(const Sinks& sinks, const Record& record);
+    static void enqueue(Queue& queue, const Record& record);
+    static void wakeFlusher();
+    static void flusherLoop();
+    // With mFlusherControlMutex, starts or stops it as needed
+    static void updateFlusher();
+
+    // Thread local record to format into, one per nesting level
+    //  (a callback that logs), its text keeps the capacity between calls
+    class Scratch {
+        Record& mRecord;
+    public:
+        Scratch();
+        ~Scratch();
+        Record& operator*() {return mRecord;}
+    };
 public:
+    // Atomic value that filters depend on, writing it refreshes the mask
+    template <class T>
+    class Setting {
+        std::atomic<T> mValue;
+    public:
+        Setting(T value) : mValue(value) {}
+        Setting& operator=(T value) {
+            mValue = value;
+            updateMask();
+            return *this;
+        }
+        operator T() const {return mValue;}
+    };
+
     // There is a special print to STDOUT with its own Level
     // It is handled by a callback[0], but it refers to these switches
-    static std::atomic<bool> mStdout;
-    static std::atomic<bool> mColored;
-    static std::atomic<Level> mVerboseLevel;
+    static Setting<bool> mStdout;
+    static Setting<bool> mColored;
+    static Setting<Level> mVerboseLevel;
+    // Prefix the printed records with their wall time
+    static std::atomic<bool> mPrintTime;
+
+    // Filters are evaluated once per Type x Level when callbacks are added
+    //  or removed, if they depend on anything else than the Settings call
+    //  this after changing it
+    static void updateMask();
+    // Single atomic load, true if any callback wants this record
+    static bool enabled(Type type, Level level) {
+        return level >= kMinLevel && (mMask.load(std::memory_order_relaxed) & bit(type, level));
+    }
 
-    static const auto& getCallbacks() {return mCallbacks;}
+    static Callbacks getCallbacks() {return mSinks.read()->mCallbacks;}
+    // Callbacks are called by all the logging threads at the same time
+    //  (only by the flusher in async mode), they have to be thread-safe.
+    //  Adding or removing callbacks, or starting and stopping async mode,
+    //  from inside a callback is rejected: nothing is added or removed
     static Lazy add(callbackFunction callback, filterFunction filter = [](Type, Level){return true;});
+    // The records are buffered, and delivered in order by the flusher thread
+    //  when there are maxRecords or the oldest is maxDelay old. Removing it
+    //  delivers the rest. The batch callbacks can log, and add callbacks,
+    //  but not add or remove batch sinks or start or stop async mode
+    static Lazy addBatch(batchFunction callback, filterFunction filter = [](Type, Level){return true;},
+        size_t maxRecords = kDefaultBatchSize, std::chrono::milliseconds maxDelay = kDefaultBatchDelay);
+
+    // Async mode control, stopping (or destruction) flushes all pending records
+    //  False if called from a callback
+    static bool startAsync(size_t queueSize = kDefaultQueueSize, Overflow overflow = Overflow::DROP);
+    static void stopAsync();
+    static bool isAsync();
+    // Wait until all the records pushed so far are dispatched, and
+    //  delivered to the batch sinks. Returns at once from a callback
+    static void flush();
+    static uint64_t getDropped() {return mDropped;}
+
+    // Short id of the calling thread, as printed in the logs
+    static size_t threadId();
+    // Record being dispatched, only valid inside a callback
+    static const Record& current();
+    // Prints a record to stdout, same layout as the default callbacks
+    static void print(const Record& record, bool colored);
+
+    // Binary mode, records passing the filter are stored in a file
+    //  without formatting, see core/log_binary.h
+    static bool openBinary(const std::string& path, filterFunction filter = [](Type, Level){return true;});
+    static void closeBinary();
+    static bool decodeBinary(const std::string& path, std::function<void(const Record&)> callback);
+
+    // Rate limit and sampling of a call site, declare it static there:
+    //   static Log::Limit limit(10);      // At most 10 records per second
+    //   static Log::Limit limit(0, 100);  // 1 in 100 records
+    //   mLog.i(limit, "Got a connection (fd {})", fd);
+    // The suppressed records are counted, and a summary is logged by the
+    //  first record of the site in a later second, by a background thread
+    //  every mReportInterval (started by the first suppressed record), or
+    //  by reportSuppressed()
+    class Limit : private NoCopyOrMove {
+        const uint32_t mPerSecond; // 0 is unlimited
+        const uint32_t mOneIn;
+        std::atomic<uint64_t> mCalls = 0;
+        std::atomic<uint64_t> mSecond = 0;
+        std::atomic<uint32_t> mInSecond = 0;
+        std::atomic<uint64_t> mSuppressed = 0;
+        // Of the last call, for the summary
+        std::atomic<Type> mType = Type::UNKW;
+        std::atomic<Level> mLevel = Level::TRACE;
+        std::atomic<const char*> mFormat = nullptr;
+        std::atomic<size_t> mFormatSize = 0;
+
+        // Taken from the limit, and logged once no lock is held
+        struct Summary {
+            Type mType;
+            Level mLevel;
+            uint64_t mSuppressed;
+            std::string_view mFormat;
+        };
+        Summary takeSummary();
+        static void log(const Summary& summary);
+        friend class Log;
+    public:
+        // 0 disables the periodic summaries
+        static std::atomic<std::chrono::milliseconds> mReportInterval;
+
+        Limit(uint32_t perSecond, uint32_t oneIn = 1);
+        ~Limit();
+
+        // Counts the call, false if it has to be suppressed
+        bool allow(Type type, Level level, fmt::string_view format);
+        // Logs the summary if any record was suppressed
+        void report();
+        uint64_t getSuppressed() const {return mSuppressed;}
+    };
+    // Logs the summary of all the call sites with suppressed records
+    static void reportSuppressed();
 
     // Templates and wrappers
     template <typename... Args>
-    static void log(Level level, Type type, Args&&... args)
+    static void log(Level level, Type type, fmt::format_string<Args...> format, Args&&... args)
     {
-        log(type, level, std::forward<Args>(args)...);
+        log(type, level, format, std::forward<Args>(args)...);
     }
     template <typename... Args>
-    static void log(Type type, Level level, Args&&... args)
+    static void log(Type type, Level level, fmt::format_string<Args...> format, Args&&... args)
     {
-        // Go through all Callbacks and if we have any to call
-        //  then lazy evaluate the format and call it
-        std::string str;
-        bool done = false;
-        std::unique_lock<std::mutex> lock(mMutex);
-        for (auto& [id, callback] : mCallbacks) {
-            auto& [filter, call] = callback;
-            if (filter(type, level)) {
-                if (!done)
-                    str = fmt::format(std::forward<Args>(args)...);
-                done = true;
-                call(type, level, str);
-            }
+        // Check if any callback is interested, and only then
+        //  lazy evaluate the format and call them
+        if (!enabled(type, level))
+            return;
+        auto time = Clock::now();
+        if (mBinaryMask.load(std::memory_order_relaxed) & bit(type, level)) {
+            BinaryLog::write(static_cast<uint8_t>(type), static_cast<uint8_t>(level),
+                threadId(), time.time_since_epoch().count(), fmt::string_view(format), args...);
+        }
+        if (!(mTextMask.load(std::memory_order_relaxed) & bit(type, level)))
+            return;
+        Scratch scratch;
+        auto& record = *scratch;
+        record.type = type;
+        record.level = level;
+        record.thread = threadId();
+        record.time = time;
+        fmt::format_to(std::back_inserter(record.text), format, std::forward<Args>(args)...);
+        auto sinks = mSinks.read();
+        if (sinks->mQueue) {
+            // Async, the flusher thread does the calls
+            enqueue(*sinks->mQueue, record);
+            return;
         }
+        dispatch(*sinks, record);
+    }
+    template <typename... Args>
+    static void log(Type type, Level level, Limit& limit, fmt::format_string<Args...> format, Args&&... args)
+    {
+        // Disabled records are not counted
+        if (enabled(type, level) && limit.allow(type, level, format))
+            log(type, level, format, std::forward<Args>(args)...);
     }
 
     template <typename... Args>
-    static void t(Type type, Args&&... args)
+    static void t(Type type, fmt::format_string<Args...> format, Args&&... args)
+    {
+        if constexpr (Level::TRACE >= kMinLevel)
+            log(type, Level::TRACE, format, std::forward<Args>(args)...);
+    }
+    template <typename... Args>
+    static void t(Type type, Limit& limit, fmt::format_string<Args...> format, Args&&... args)
+    {
+        if constexpr (Level::TRACE >= kMinLevel)
+            log(type, Level::TRACE, limit, format, std::forward<Args>(args)...);
+    }
+    template <typename... Args>
+    static void d(Type type, fmt::format_string<Args...> format, Args&&... args)
     {
-        log(type, Level::TRACE, std::forward<Args>(args)...);
+        if constexpr (Level::DEBUG >= kMinLevel)
+            log(type, Level::DEBUG, format, std::forward<Args>(args)...);
     }
     template <typename... Args>
-    static void d(Type type, Args&&... args)
+    static void d(Type type, Limit& limit, fmt::format_string<Args...> format, Args&&... args)
     {
-        log(type, Level::DEBUG, std::forward<Args>(args)...);
+        if constexpr (Level::DEBUG >= kMinLevel)
+            log(type, Level::DEBUG, limit, format, std::forward<Args>(args)...);
     }
     template <typename... Args>
-    static void i(Type type, Args&&... args)
+    static void i(Type type, fmt::format_string<Args...> format, Args&&... args)
     {
-        log(type, Level::INFO, std::forward<Args>(args)...);
+        if constexpr (Level::INFO >= kMinLevel)
+            log(type, Level::INFO, format, std::forward<Args>(args)...);
     }
     template <typename... Args>
-    static void w(Type type, Args&&... args)
+    static void i(Type type, Limit& limit, fmt::format_string<Args...> format, Args&&... args)
     {
-        log(type, Level::WARN, std::forward<Args>(args)...);
+        if constexpr (Level::INFO >= kMinLevel)
+            log(type, Level::INFO, limit, format, std::forward<Args>(args)...);
     }
     template <typename... Args>
-    static void e(Type type, Args&&... args)
+    static void w(Type type, fmt::format_string<Args...> format, Args&&... args)
     {
-        log(type, Level::ERROR, std::forward<Args>(args)...);
+        if constexpr (Level::WARN >= kMinLevel)
+            log(type, Level::WARN, format, std::forward<Args>(args)...);
+    }
+    template <typename... Args>
+    static void w(Type type, Limit& limit, fmt::format_string<Args...> format, Args&&... args)
+    {
+        if constexpr (Level::WARN >= kMinLevel)
+            log(type, Level::WARN, limit, format, std::forward<Args>(args)...);
+    }
+    template <typename... Args>
+    static void e(Type type, fmt::format_string<Args...> format, Args&&... args)
+    {
+        if constexpr (Level::ERROR >= kMinLevel)
+            log(type, Level::ERROR, format, std::forward<Args>(args)...);
+    }
+    template <typename... Args>
+    static void e(Type type, Limit& limit, fmt::format_string<Args...> format, Args&&... args)
+    {
+        if constexpr (Level::ERROR >= kMinLevel)
+            log(type, Level::ERROR, limit, format, std::forward<Args>(args)...);
     }
 
     // Same but when you instantiate an object, you use the object defaults
@@ -108,28 +409,63 @@ public:
     Type mType;
 
     template <typename... Args>
-    void t(Args&&... args)
+    void t(fmt::format_string<Args...> format, Args&&... args)
+    {
+        if constexpr (Level::TRACE >= kMinLevel)
+            log(mType, Level::TRACE, format, std::forward<Args>(args)...);
+    }
+    template <typename... Args>
+    void t(Limit& limit, fmt::format_string<Args...> format, Args&&... args)
+    {
+        if constexpr (Level::TRACE >= kMinLevel)
+            log(mType, Level::TRACE, limit, format, std::forward<Args>(args)...);
+    }
+    template <typename... Args>
+    void d(fmt::format_string<Args...> format, Args&&... args)
+    {
+        if constexpr (Level::DEBUG >= kMinLevel)
+            log(mType, Level::DEBUG, format, std::forward<Args>(args)...);
+    }
+    template <typename... Args>
+    void d(Limit& limit, fmt::format_string<Args...> format, Args&&... args)
+    {
+        if constexpr (Level::DEBUG >= kMinLevel)
+            log(mType, Level::DEBUG, limit, format, std::forward<Args>(args)...);
+    }
+    template <typename... Args>
+    void i(fmt::format_string<Args...> format, Args&&... args)
+    {
+        if constexpr (Level::INFO >= kMinLevel)
+            log(mType, Level::INFO, format, std::forward<Args>(args)...);
+    }
+    template <typename... Args>
+    void i(Limit& limit, fmt::format_string<Args...> format, Args&&... args)
     {
-        log(mType, Level::TRACE, std::forward<Args>(args)...);
+        if constexpr (Level::INFO >= kMinLevel)
+            log(mType, Level::INFO, limit, format, std::forward<Args>(args)...);
     }
     template <typename... Args>
-    void d(Args&&... args)
+    void w(fmt::format_string<Args...> format, Args&&... args)
     {
-        log(mType, Level::DEBUG, std::forward<Args>(args)...);
+        if constexpr (Level::WARN >= kMinLevel)
+            log(mType, Level::WARN, format, std::forward<Args>(args)...);
     }
     template <typename... Args>
-    void i(Args&&... args)
+    void w(Limit& limit, fmt::format_string<Args...> format, Args&&... args)
     {
-        log(mType, Level::INFO, std::forward<Args>(args)...);
+        if constexpr (Level::WARN >= kMinLevel)
+            log(mType, Level::WARN, limit, format, std::forward<Args>(args)...);
     }
     template <typename... Args>
-    void w(Args&&... args)
+    void e(fmt::format_string<Args...> format, Args&&... args)
     {
-        log(mType, Level::WARN, std::forward<Args>(args)...);
+        if constexpr (Level::ERROR >= kMinLevel)
+            log(mType, Level::ERROR, format, std::forward<Args>(args)...);
     }
     template <typename... Args>
-    void e(Args&&... args)
+    void e(Limit& limit, fmt::format_string<Args...> format, Args&&... args)
     {
-        log(mType, Level::ERROR, std::forward<Args>(args)...);
+        if constexpr (Level::ERROR >= kMinLevel)
+            log(mType, Level::ERROR, limit, format, std::forward<Args>(args)...);
     }
 };
@@ -0,0 +1,202 @@
+#include <fstream>
+#include <iterator>
+#include <set>
+
+#include <fmt/args.h>
+
+#include "core/log_binary.h"
+
+std::mutex BinaryLog::mMutex;
+FILE* BinaryLog::mFile = nullptr;
+std::atomic<uint32_t> BinaryLog::mGeneration = 1;
+BinaryLog::FormatMap BinaryLog::mFormats;
+
+namespace {
+    // All the thread buffers alive, protected by BinaryLog::mMutex
+    std::set<BinaryLog::Buffer*> sBuffers;
+    // Swapped with the buffer being written, keeps the capacity of both
+    std::vector<char> sScratch;
+};
+
+BinaryLog::Buffer::Buffer() {
+    std::unique_lock<std::mutex> lock(BinaryLog::mMutex);
+    sBuffers.insert(this);
+}
+
+BinaryLog::Buffer::~Buffer() {
+    std::unique_lock<std::mutex> lock(BinaryLog::mMutex);
+    sBuffers.erase(this);
+    std::unique_lock<std::mutex> bufLock(mMutex);
+    if (mFile && mGeneration == BinaryLog::mGeneration)
+        fwrite(mData.data(), 1, mData.size(), mFile);
+}
+
+BinaryLog::Buffer& BinaryLog::buffer() {
+    static thread_local Buffer buf;
+    return buf;
+}
+
+bool BinaryLog::open(const std::string& path, int64_t wallOffset) {
+    close();
+    std::unique_lock<std::mutex> lock(mMutex);
+    mFile = fopen(path.c_str(), "wb");
+    if (!mFile)
+        return false;
+    std::vector<char> out;
+    out.push_back('W');
+    put<int64_t>(out, wallOffset);
+    fwrite(out.data(), 1, out.size(), mFile);
+    return true;
+}
+
+void BinaryLog::close() {
+    flush();
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (mFile)
+        fclose(mFile);
+    mFile = nullptr;
+    // Invalidates all the data and format ids cached by the threads
+    mGeneration++;
+    mFormats.clear();
+}
+
+void BinaryLog::flush() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    for (auto buf : sBuffers)
+        writeBuffer(*buf);
+    if (mFile)
+        fflush(mFile);
+}
+
+void BinaryLog::flush(Buffer& buf) {
+    std::unique_lock<std::mutex> lock(mMutex);
+    writeBuffer(buf);
+}
+
+void BinaryLog::writeBuffer(Buffer& buf) {
+    // mMutex is held by the caller, the thread only waits for the swap
+    std::unique_lock<std::mutex> bufLock(buf.mMutex);
+    if (buf.mGeneration == mGeneration)
+        sScratch.swap(buf.mData);
+    buf.mData.clear();
+    bufLock.unlock();
+    if (mFile)
+        fwrite(sScratch.data(), 1, sScratch.size(), mFile);
+    sScratch.clear();
+}
+
+BinaryLog::FormatId BinaryLog::registerFormat(std::string_view format) {
+    // The definition is written straight to the file, so it is always
+    //  before any record using it, that is still in a thread buffer
+    std::unique_lock<std::mutex> lock(mMutex);
+    auto it = mFormats.find(format);
+    if (it != mFormats.end())
+        return {it->second, mGeneration};
+    uint32_t id = mFormats.size() + 1;
+    mFormats.emplace(format, id);
+    if (mFile) {
+        std::vector<char> out;
+        out.push_back('F');
+        put<uint32_t>(out, id);
+        put<uint32_t>(out, format.size());
+        out.insert(out.end(), format.begin(), format.end());
+        fwrite(out.data(), 1, out.size(), mFile);
+    }
+    return {id, mGeneration};
+}
+
+namespace {
+    class Reader {
+        const std::vector<char>& mData;
+        size_t mPos = 0;
+    public:
+        Reader(const std::vector<char>& data) : mData(data) {}
+        bool done() const {return mPos >= mData.size();}
+        bool has(size_t size) const {return mPos + size <= mData.size();}
+
+        template <class T>
+        bool get(T& value) {
+            if (!has(sizeof(T)))
+                return false;
+            memcpy(&value, mData.data() + mPos, sizeof(T));
+            mPos += sizeof(T);
+            return true;
+        }
+        bool get(std::string& str) {
+            uint32_t size;
+            if (!get(size) || !has(size))
+                return false;
+            str.assign(mData.data() + mPos, size);
+            mPos += size;
+            return true;
+        }
+    };
+
+    bool readArg(Reader& in, fmt::dynamic_format_arg_store<fmt::format_context>& store) {
+        char tag;
+        if (!in.get(tag))
+            return false;
+        switch (tag) {
+            case 'i': {int64_t v; if (!in.get(v)) return false; store.push_back(v); break;}
+            case 'u': {uint64_t v; if (!in.get(v)) return false; store.push_back(v); break;}
+            case 'd': {double v; if (!in.get(v)) return false; store.push_back(v); break;}
+            case 'b': {uint8_t v; if (!in.get(v)) return false; store.push_back(v != 0); break;}
+            case 'c': {char v; if (!in.get(v)) return false; store.push_back(v); break;}
+            case 's': {std::string v; if (!in.get(v)) return false; store.push_back(std::move(v)); break;}
+            default: return false;
+        }
+        return true;
+    }
+};
+
+bool BinaryLog::decode(const std::string& path, decodeFunction callback) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return false;
+    std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    Reader in(data);
+    std::unordered_map<uint32_t, std::string> formats;
+    int64_t wallOffset = 0;
+    while (!in.done()) {
+        char entry;
+        if (!in.get(entry))
+            return false;
+        if (entry == 'W') {
+            if (!in.get(wallOffset))
+                return false;
+        } else if (entry == 'F') {
+            uint32_t id;
+            std::string format;
+            if (!in.get(id) || !in.get(format))
+                return false;
+            formats[id] = std::move(format);
+        } else if (entry == 'R') {
+            uint8_t type, level, nargs;
+            uint32_t thread, id;
+            int64_t time;
+            if (!in.get(type) || !in.get(level) || !in.get(thread) || !in.get(time) || !in.get(id) || !in.get(nargs))
+                return false;
+            fmt::dynamic_format_arg_store<fmt::format_context> store;
+            for (int i = 0; i < nargs; i++) {
+                if (!readArg(in, store))
+                    return false;
+            }
+            auto it = formats.find(id);
+            std::string text;
+            if (it == formats.end()) {
+                text = fmt::format("<unknown format {}>", id);
+            } else {
+                try {
+                    text = fmt::vformat(it->second, store);
+                } catch (const fmt::format_error& e) {
+                    text = fmt::format("<{}: {}>", e.what(), it->second);
+                }
+            }
+            callback(type, level, thread, time + wallOffset, text);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
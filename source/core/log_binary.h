@@ -0,0 +1,162 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include <fmt/core.h>
+#include <fmt/format.h>
+
+/**
+* Binary log, records are stored without formatting
+* The caller appends the format string id and the raw arguments to a
+* thread local buffer, the text is only generated when decoding.
+*
+* File layout, a sequence of entries in host byte order:
+*   'W' i64 offset                     Added to the times to get the wall time (ns)
+*   'F' u32 id, u32 size, chars         Format string definition
+*   'R' u8 type, u8 level, u32 thread, i64 time, u32 format id, u8 nargs, args...
+* Each argument is a tag followed by the value:
+*   'i' i64, 'u' u64, 'd' double, 'b' u8, 'c' char, 's' u32 size, chars
+* Arguments of any other type are formatted to text by the caller
+*
+* Locks are taken in one order, mMutex then a buffer mMutex, never the
+* other way around
+*/
+class BinaryLog {
+public:
+    static constexpr size_t kFlushSize = 64 * 1024;
+
+    // Format strings are identified by their contents, a runtime one can
+    //  reuse the storage of a different one
+    struct StringHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view str) const {return std::hash<std::string_view>{}(str);}
+    };
+    typedef std::unordered_map<std::string, uint32_t, StringHash, std::equal_to<>> FormatMap;
+
+    struct Buffer {
+        std::mutex mMutex;
+        std::vector<char> mData;
+        uint32_t mGeneration = 0; // Of the file mData is for
+        // Only used by the owner thread, no lock
+        FormatMap mFormats;
+        uint32_t mFormatsGeneration = 0;
+        Buffer();
+        ~Buffer();
+    };
+
+    // wallOffset converts the monotonic times of the records to wall time
+    static bool open(const std::string& path, int64_t wallOffset);
+    static void close();
+    // Writes all the thread buffers to the file
+    static void flush();
+
+    template <class... Args>
+    static void write(uint8_t type, uint8_t level, uint32_t thread, int64_t time, fmt::string_view format, const Args&... args)
+    {
+        auto& buf = buffer();
+        // Before locking the buffer, registering a format takes mMutex
+        auto id = formatId(buf, format);
+        std::unique_lock<std::mutex> lock(buf.mMutex);
+        if (buf.mGeneration != id.mGeneration) {
+            // Left from a closed file
+            buf.mData.clear();
+            buf.mGeneration = id.mGeneration;
+        }
+        auto& out = buf.mData;
+        out.push_back('R');
+        put<uint8_t>(out, type);
+        put<uint8_t>(out, level);
+        put<uint32_t>(out, thread);
+        put<int64_t>(out, time);
+        put<uint32_t>(out, id.mId);
+        put<uint8_t>(out, sizeof...(Args));
+        (putArg(out, args), ...);
+        bool full = out.size() >= kFlushSize;
+        lock.unlock();
+        if (full)
+            flush(buf);
+    }
+
+    // Reads a binary log file, and calls back with every record formatted
+    //  and its wall time in ns
+    typedef std::function<void(uint8_t type, uint8_t level, uint32_t thread, int64_t wallTime, const std::string& text)> decodeFunction;
+    static bool decode(const std::string& path, decodeFunction callback);
+
+private:
+    static std::mutex mMutex;
+    static FILE* mFile;
+    // Changed under mMutex, read without it by the writers
+    static std::atomic<uint32_t> mGeneration;
+    static FormatMap mFormats;
+
+    struct FormatId {
+        uint32_t mId;
+        uint32_t mGeneration; // Of the file it is defined in
+    };
+
+    static Buffer& buffer();
+    static void flush(Buffer& buf);
+    // Writes and empties a buffer, with mMutex
+    static void writeBuffer(Buffer& buf);
+    static FormatId registerFormat(std::string_view format);
+
+    static FormatId formatId(Buffer& buf, fmt::string_view format) {
+        std::string_view str(format.data(), format.size());
+        auto generation = mGeneration.load(std::memory_order_acquire);
+        if (buf.mFormatsGeneration != generation) {
+            buf.mFormats.clear();
+            buf.mFormatsGeneration = generation;
+        }
+        auto it = buf.mFormats.find(str);
+        if (it != buf.mFormats.end())
+            return {it->second, generation};
+        auto id = registerFormat(str);
+        if (id.mGeneration == generation)
+            buf.mFormats.emplace(str, id.mId);
+        return id;
+    }
+
+    template <class T>
+    static void put(std::vector<char>& out, T value) {
+        char raw[sizeof(T)];
+        memcpy(raw, &value, sizeof(T));
+        out.insert(out.end(), raw, raw + sizeof(T));
+    }
+    static void putString(std::vector<char>& out, std::string_view str) {
+        out.push_back('s');
+        put<uint32_t>(out, str.size());
+        out.insert(out.end(), str.begin(), str.end());
+    }
+    template <class T>
+    static void putArg(std::vector<char>& out, const T& value) {
+        if constexpr (std::is_same_v<T, bool>) {
+            out.push_back('b');
+            put<uint8_t>(out, value);
+        } else if constexpr (std::is_same_v<T, char>) {
+            out.push_back('c');
+            out.push_back(value);
+        } else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+            out.push_back('i');
+            put<int64_t>(out, value);
+        } else if constexpr (std::is_integral_v<T>) {
+            out.push_back('u');
+            put<uint64_t>(out, value);
+        } else if constexpr (std::is_floating_point_v<T>) {
+            out.push_back('d');
+            put<double>(out, value);
+        } else if constexpr (std::is_convertible_v<const T&, std::string_view>) {
+            putString(out, value);
+        } else {
+            putString(out, fmt::vformat("{}", fmt::make_format_args(value)));
+        }
+    }
+};
@@ -0,0 +1,147 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "core/log_recorder.h"
+
+namespace {
+    constexpr char kMagic[8] = {'F', 'D', 'B', 'R', 'E', 'C', '0', '2'};
+    constexpr size_t kAlign = 8;
+
+    constexpr uint64_t align(uint64_t size) {
+        return (size + kAlign - 1) & ~(kAlign - 1);
+    }
+
+    // Copies out of the ring, wrapping around the end
+    void copyOut(const char* ring, uint64_t capacity, uint64_t pos, void* dst, size_t size) {
+        auto offset = pos % capacity;
+        auto first = std::min<uint64_t>(size, capacity - offset);
+        memcpy(dst, ring + offset, first);
+        memcpy(static_cast<char*>(dst) + first, ring, size - first);
+    }
+};
+
+FlightRecorder::~FlightRecorder() {
+    close();
+}
+
+bool FlightRecorder::open(const std::string& path, size_t size) {
+    close();
+    size = align(std::max(size, sizeof(Entry) * 16));
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    auto mapSize = sizeof(Header) + size;
+    void* map = MAP_FAILED;
+    if (ftruncate(fd, mapSize) == 0)
+        map = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    // The mapping keeps the file alive
+    ::close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    mMapSize = mapSize;
+    mHeader = static_cast<Header*>(map);
+    mRing = static_cast<char*>(map) + sizeof(Header);
+    mHeader->capacity = size;
+    mHeader->head = 0;
+    mHeader->wallOffset = Log::wallOffset();
+    // Magic last, a half created file is not valid
+    memcpy(mHeader->magic, kMagic, sizeof(kMagic));
+    return true;
+}
+
+void FlightRecorder::close() {
+    if (!mHeader)
+        return;
+    msync(mHeader, mMapSize, MS_ASYNC);
+    munmap(mHeader, mMapSize);
+    mHeader = nullptr;
+    mRing = nullptr;
+    mMapSize = 0;
+}
+
+void FlightRecorder::copyIn(uint64_t pos, const void* src, size_t size) {
+    auto capacity = mHeader->capacity;
+    auto offset = pos % capacity;
+    auto first = std::min<uint64_t>(size, capacity - offset);
+    memcpy(mRing + offset, src, first);
+    memcpy(mRing, static_cast<const char*>(src) + first, size - first);
+}
+
+void FlightRecorder::write(Log::Type type, Log::Level level, uint32_t thread, Log::Clock::time_point time, std::string_view text) {
+    auto capacity = mHeader->capacity;
+    // A single record can not take more than a quarter of the ring
+    text = text.substr(0, capacity / 4);
+    auto total = align(sizeof(Entry) + text.size());
+    auto pos = mHeader->head.fetch_add(total, std::memory_order_relaxed);
+
+    // pos is written last, it is what makes the entry valid
+    Entry entry{~pos, time.time_since_epoch().count(), static_cast<uint32_t>(text.size()), thread,
+        static_cast<uint8_t>(type), static_cast<uint8_t>(level), {}};
+    copyIn(pos, &entry, sizeof(entry));
+    copyIn(pos + sizeof(entry), text.data(), text.size());
+    // Aligned to 8 so the pos field never wraps around the ring
+    auto& posField = *reinterpret_cast<uint64_t*>(mRing + pos % capacity);
+    std::atomic_ref<uint64_t>(posField).store(pos, std::memory_order_release);
+}
+
+Log::callbackFunction FlightRecorder::sink() {
+    return [this](Log::Type type, Log::Level level, std::string_view text) {
+        auto& record = Log::current();
+        write(type, level, record.thread, record.time, text);
+    };
+}
+
+bool FlightRecorder::dump(const std::string& path, std::function<void(const Log::Record&)> callback) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(Header))
+        map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    auto header = static_cast<const Header*>(map);
+    auto ring = static_cast<const char*>(map) + sizeof(Header);
+    auto capacity = header->capacity;
+    bool valid = memcmp(header->magic, kMagic, sizeof(kMagic)) == 0 &&
+        capacity % kAlign == 0 && capacity > 0 &&
+        sizeof(Header) + capacity == static_cast<size_t>(st.st_size);
+    if (valid) {
+        uint64_t head = header->head.load(std::memory_order_acquire);
+        uint64_t pos = head > capacity ? align(head - capacity) : 0;
+        // To our clock, so Log::wallTime() gives back the original one
+        auto clockOffset = header->wallOffset - Log::wallOffset();
+        std::string text;
+        while (pos + sizeof(Entry) <= head) {
+            Entry entry;
+            copyOut(ring, capacity, pos, &entry, sizeof(entry));
+            auto total = align(sizeof(Entry) + entry.size);
+            auto type = magic_enum::enum_cast<Log::Type>(entry.type);
+            auto level = magic_enum::enum_cast<Log::Level>(entry.level);
+            // A matching pos alone could be chance, check what write() can produce
+            bool complete = entry.pos == pos && entry.size <= capacity / 4 && pos + total <= head &&
+                type && level && std::all_of(std::begin(entry.pad), std::end(entry.pad), [](char c){ return c == 0; });
+            if (!complete) {
+                // Overwritten or never completed, look for the next one
+                pos += kAlign;
+                continue;
+            }
+            text.resize(entry.size);
+            copyOut(ring, capacity, pos + sizeof(entry), text.data(), entry.size);
+            auto time = Log::Clock::time_point(Log::Clock::duration(entry.time + clockOffset));
+            callback({*type, *level, entry.thread, text, time});
+            pos += total;
+        }
+    }
+    munmap(map, st.st_size);
+    return valid;
+}
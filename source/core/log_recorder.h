@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+
+#include "common/nocopyormove.h"
+#include "core/log.h"
+
+/**
+* Flight recorder, a Log sink that keeps the last records in a fixed size
+* circular file mapped in memory. Writing a record is a copy to the map,
+* no syscalls, and the kernel keeps the pages if the process crashes.
+*
+* File layout, host byte order:
+*   Header (64 bytes): magic, u64 capacity, u64 head, i64 wall offset
+*   Ring of capacity bytes, entries aligned to 8:
+*     u64 pos, i64 time, u32 size, u32 thread, u8 type, u8 level, 6 pad, chars
+* head is the total amount of bytes ever reserved, an entry is valid
+* if its pos matches the position it is found at, so the oldest entry
+* partially overwritten or one being written during a crash are skipped.
+*
+* Usage:
+*   FlightRecorder recorder;
+*   recorder.open("node.rec");
+*   auto c = Log::add(recorder.sink());
+*/
+class FlightRecorder : private NoCopyOrMove {
+public:
+    static constexpr size_t kDefaultSize = 16 * 1024 * 1024;
+
+    FlightRecorder() = default;
+    ~FlightRecorder();
+
+    // Creates (or truncates) the file, size is the ring capacity
+    bool open(const std::string& path, size_t size = kDefaultSize);
+    // Remove the sink from Log before closing
+    void close();
+    bool isOpen() const {return mHeader != nullptr;}
+
+    // Lock-free, can be called from many threads at once
+    void write(Log::Type type, Log::Level level, uint32_t thread, Log::Clock::time_point time, std::string_view text);
+    // Callback for Log::add, the recorder must outlive it
+    Log::callbackFunction sink();
+
+    // Reads a recorder file (even of a crashed process), oldest first
+    static bool dump(const std::string& path, std::function<void(const Log::Record&)> callback);
+
+private:
+    struct Header {
+        char magic[8];
+        uint64_t capacity;
+        std::atomic<uint64_t> head;
+        int64_t wallOffset;
+        char pad[32];
+    };
+    struct Entry {
+        uint64_t pos;
+        int64_t time;
+        uint32_t size;
+        uint32_t thread;
+        uint8_t type;
+        uint8_t level;
+        char pad[6];
+    };
+    static_assert(sizeof(Header) == 64 && sizeof(Entry) == 32);
+    static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+    Header* mHeader = nullptr;
+    char* mRing = nullptr;
+    size_t mMapSize = 0;
+
+    void copyIn(uint64_t pos, const void* src, size_t size);
+};
@@ -1,4 +1,5 @@
 #include "freedom_db.h"
+#include "core/log_recorder.h"
 
 #include <cxxopts.hpp>
 
@@ -18,8 +19,11 @@ int main(int argc, const char **argv)
         ("i,interactive", "Interactive shell mode")
         ("p,port", "Select P2P network port", cxxopts::value<int>())
         ("n,netid", "Select Network ID", cxxopts::value<int>())
+        ("decode-log", "Print a binary log file as text", cxxopts::value<std::string>())
+        ("dump-recorder", "Print a flight recorder file, oldest first", cxxopts::value<std::string>())
         ("color", "Use color printing", cxxopts::value<bool>()
             ->default_value("true")->implicit_value("false"))
+        ("time", "Print the time of the records")
         ("v,verbose", "Verbose Level", cxxopts::value<std::string>()
             ->default_value("INFO")->implicit_value("DEBUG"));
 
@@ -33,6 +37,8 @@ int main(int argc, const char **argv)
 
     if (parsed.count("color"))
         Log::mColored = parsed["color"].as<bool>();
+    if (parsed.count("time"))
+        Log::mPrintTime = true;
     if (parsed.count("verbose")) {
         auto mod = magic_enum::enum_cast<Log::Level>(parsed["v"].as<std::string>());
         if (mod) {
@@ -43,6 +49,26 @@ int main(int argc, const char **argv)
 
     //Log::e(Log::Type::CMD, "Cactus {}", parsed["v"].as<int>());
 
+    if (parsed.count("decode-log")) {
+        auto path = parsed["decode-log"].as<std::string>();
+        bool colored = Log::mColored;
+        if (!Log::decodeBinary(path, [&](const Log::Record& r){ Log::print(r, colored); })) {
+            Log::e(Log::Type::CMD, "Could not decode binary log '{}'", path);
+            return 1;
+        }
+        return 0;
+    }
+
+    if (parsed.count("dump-recorder")) {
+        auto path = parsed["dump-recorder"].as<std::string>();
+        bool colored = Log::mColored;
+        if (!FlightRecorder::dump(path, [&](const Log::Record& r){ Log::print(r, colored); })) {
+            Log::e(Log::Type::CMD, "Could not read flight recorder '{}'", path);
+            return 1;
+        }
+        return 0;
+    }
+
     FreedomDB fdb;
     return 0;
 }
@@ -0,0 +1,382 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <charconv>
+
+#include <fmt/format.h>
+
+#include "p2p/address_manager.h"
+
+namespace {
+    constexpr unsigned kMaxTries = 4 * AddressManager::kMaxWeight;
+    constexpr char kMagic[8] = {'F', 'D', 'B', 'A', 'D', 'D', 'R', '1'};
+
+    uint64_t mix(uint64_t x) {
+        // splitmix64 finalizer
+        x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ull;
+        x ^= x >> 27; x *= 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+};
+
+AddressManager::AddressManager() : mEngine(std::random_device()()) {
+    mSalt = mEngine();
+}
+
+bool AddressManager::open(const std::string& path) {
+    std::unique_lock lock(mMutex);
+    auto mapSize = sizeof(Header) + kMaxEntries * sizeof(Record);
+    if (mMap) {
+        munmap(mMap, mapSize);
+        mMap = nullptr;
+        mRecords = nullptr;
+    }
+
+    // The valid records of the old one, anything else (a new file) is
+    //  started empty
+    std::vector<Record> loaded;
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        struct stat st;
+        void* old = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) == mapSize)
+            old = mmap(nullptr, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (old != MAP_FAILED) {
+            auto header = static_cast<const Header*>(old);
+            auto records = reinterpret_cast<const Record*>(header + 1);
+            if (memcmp(header->mMagic, kMagic, sizeof(kMagic)) == 0 && header->mNumRecords == kMaxEntries) {
+                for (size_t i = 0; i < kMaxEntries; i++) {
+                    if (valid(records[i].mKey))
+                        loaded.push_back(records[i]);
+                }
+            }
+            munmap(old, mapSize);
+        }
+    }
+
+    // Compacted into a new one that replaces it, a crash before the
+    //  rename leaves the old one as it was
+    auto tmp = path + ".tmp";
+    fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+    void* map = MAP_FAILED;
+    if (ftruncate(fd, mapSize) == 0)
+        map = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    // The mapping keeps the file alive
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    auto header = static_cast<Header*>(map);
+    header->mNumRecords = kMaxEntries;
+    memcpy(header->mMagic, kMagic, sizeof(kMagic));
+    mMap = map;
+    mRecords = reinterpret_cast<Record*>(header + 1);
+
+    // Written again at the slots they get, with the ones known already
+    for (auto& record : loaded) {
+        auto it = mIndex.find(record.mKey);
+        auto slot = it != mIndex.end() ? std::optional(it->second) : insert(record.mKey);
+        if (!slot)
+            continue;
+        auto& entry = mEntries[*slot];
+        if (entry.mSuccesses == 0) {
+            entry.mSuccesses = record.mSuccesses;
+            entry.mFailures = std::min<uint16_t>(record.mFailures, kMaxFailures - 1);
+            entry.mLatencyMs = record.mLatencyMs;
+        }
+    }
+    for (auto& [key, slot] : mIndex)
+        persist(slot);
+    // On disk before it replaces the old one
+    if (msync(map, mapSize, MS_SYNC) != 0 || rename(tmp.c_str(), path.c_str()) != 0) {
+        munmap(map, mapSize);
+        mMap = nullptr;
+        mRecords = nullptr;
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+void AddressManager::close() {
+    std::unique_lock lock(mMutex);
+    if (!mMap)
+        return;
+    auto mapSize = sizeof(Header) + kMaxEntries * sizeof(Record);
+    msync(mMap, mapSize, MS_ASYNC);
+    munmap(mMap, mapSize);
+    mMap = nullptr;
+    mRecords = nullptr;
+}
+
+void AddressManager::persist(uint32_t slot) {
+    if (!mRecords)
+        return;
+    // Only the ones that connected, a restart dials them first
+    auto& entry = mEntries[slot];
+    if (entry.mSuccesses > 0 && mIndex.count(entry.mKey))
+        mRecords[slot] = {entry.mKey, entry.mSuccesses, entry.mFailures, entry.mLatencyMs};
+    else if (mRecords[slot].mKey != 0)
+        mRecords[slot] = {};
+}
+
+bool AddressManager::valid(uint64_t key) {
+    // ip << 16 | port, as parse() makes them
+    return (key >> 48) == 0 && (key & 0xffff) != 0;
+}
+
+std::optional<uint64_t> AddressManager::parse(std::string_view address) {
+    auto pos = address.rfind(':');
+    if (pos == address.npos)
+        return {};
+    unsigned port = 0;
+    auto portStr = address.substr(pos + 1);
+    auto [end, ec] = std::from_chars(portStr.data(), portStr.data() + portStr.size(), port);
+    if (ec != std::errc() || end != portStr.data() + portStr.size() || port == 0 || port > 0xffff)
+        return {};
+    struct in_addr addr;
+    if (inet_pton(AF_INET, std::string(address.substr(0, pos)).c_str(), &addr) <= 0)
+        return {};
+    return uint64_t(ntohl(addr.s_addr)) << 16 | port;
+}
+
+std::string AddressManager::format(uint64_t key) {
+    struct in_addr addr;
+    addr.s_addr = htonl(static_cast<uint32_t>(key >> 16));
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+    return fmt::format("{}:{}", ip, key & 0xffff);
+}
+
+uint32_t AddressManager::weight(const Entry& entry) {
+    uint32_t w = kNeutralWeight;
+    // Faster than 150ms is better than an untried one
+    if (entry.mSuccesses > 0)
+        w = kMaxWeight * 50 / (entry.mLatencyMs + 50);
+    w >>= std::min<unsigned>(entry.mFailures, 5);
+    return std::clamp<uint32_t>(w, 1, kMaxWeight);
+}
+
+AddressManager::Entry* AddressManager::find(std::string_view address) {
+    auto key = parse(address);
+    if (!key)
+        return nullptr;
+    auto it = mIndex.find(*key);
+    return it == mIndex.end() ? nullptr : &mEntries[it->second];
+}
+
+void AddressManager::setState(uint32_t slot, State state) {
+    auto& entry = mEntries[slot];
+    auto unlist = [&](std::vector<uint32_t>& list) {
+        list[entry.mPos] = list.back();
+        mEntries[list.back()].mPos = entry.mPos;
+        list.pop_back();
+    };
+    if (entry.mState == State::READY)
+        unlist(mReady);
+    else if (entry.mState == State::BACKOFF)
+        unlist(mBackoff);
+
+    entry.mState = state;
+    if (state == State::READY) {
+        entry.mPos = mReady.size();
+        mReady.push_back(slot);
+    } else if (state == State::BACKOFF) {
+        entry.mPos = mBackoff.size();
+        mBackoff.push_back(slot);
+        mNextRetry = std::min(mNextRetry, entry.mRetry);
+    }
+}
+
+void AddressManager::retryExpired() {
+    auto now = std::chrono::steady_clock::now();
+    if (now < mNextRetry)
+        return;
+    mNextRetry = std::chrono::steady_clock::time_point::max();
+    for (size_t i = mBackoff.size(); i-- > 0;) {
+        auto slot = mBackoff[i];
+        if (mEntries[slot].mRetry <= now)
+            setState(slot, State::READY);
+        else
+            mNextRetry = std::min(mNextRetry, mEntries[slot].mRetry);
+    }
+}
+
+void AddressManager::erase(uint32_t slot) {
+    auto& entry = mEntries[slot];
+    setState(slot, State::IN_USE); // Out of the lists
+    auto& bucket = mBuckets[entry.mBucket];
+    bucket.erase(std::find(bucket.begin(), bucket.end(), slot));
+    mIndex.erase(entry.mKey);
+    mFree.push_back(slot);
+    persist(slot);
+}
+
+bool AddressManager::add(std::string_view address) {
+    auto key = parse(address);
+    if (!key)
+        return false;
+    std::unique_lock lock(mMutex);
+    return insert(*key).has_value();
+}
+
+std::optional<uint32_t> AddressManager::insert(uint64_t key) {
+    if (mIndex.count(key) || mBanned.count(key))
+        return {};
+
+    auto bucketId = static_cast<uint32_t>(mix((key >> 32) ^ mSalt) % kNumBuckets);
+    auto& bucket = mBuckets[bucketId];
+    if (bucket.size() >= kBucketSize) {
+        // Only known bad ones make room, the good ones are kept
+        uint32_t worst = 0, worstWeight = kNeutralWeight;
+        for (auto slot : bucket) {
+            auto& entry = mEntries[slot];
+            if (entry.mState != State::IN_USE && weight(entry) < worstWeight) {
+                worst = slot;
+                worstWeight = weight(entry);
+            }
+        }
+        if (worstWeight == kNeutralWeight)
+            return {};
+        erase(worst);
+    }
+
+    uint32_t slot;
+    if (mFree.empty()) {
+        slot = mEntries.size();
+        mEntries.emplace_back();
+    } else {
+        slot = mFree.back();
+        mFree.pop_back();
+        mEntries[slot] = {};
+    }
+    auto& entry = mEntries[slot];
+    entry.mKey = key;
+    entry.mBucket = bucketId;
+    entry.mState = State::IN_USE; // Not listed yet
+    mIndex.emplace(key, slot);
+    bucket.push_back(slot);
+    setState(slot, State::READY);
+    return slot;
+}
+
+std::optional<std::string> AddressManager::select() {
+    std::unique_lock lock(mMutex);
+    retryExpired();
+    if (mReady.empty())
+        return {};
+    // Rejection sampling, a uniform pick accepted with weight/kMaxWeight
+    //  probability. The weights are never below 1, so it takes at most
+    //  kMaxWeight tries on average, without any structure to update
+    std::uniform_int_distribution<size_t> pick(0, mReady.size() - 1);
+    std::uniform_int_distribution<uint32_t> accept(0, kMaxWeight - 1);
+    uint32_t slot;
+    for (unsigned tries = 0; ; tries++) {
+        slot = mReady[pick(mEngine)];
+        if (tries == kMaxTries || accept(mEngine) < weight(mEntries[slot]))
+            break;
+    }
+    setState(slot, State::IN_USE);
+    return format(mEntries[slot].mKey);
+}
+
+std::vector<std::string> AddressManager::best(size_t n) {
+    std::unique_lock lock(mMutex);
+    retryExpired();
+    auto slots = mReady;
+    n = std::min(n, slots.size());
+    std::partial_sort(slots.begin(), slots.begin() + n, slots.end(), [&](uint32_t a, uint32_t b) {
+        return weight(mEntries[a]) > weight(mEntries[b]);
+    });
+    std::vector<std::string> addresses;
+    for (size_t i = 0; i < n; i++) {
+        setState(slots[i], State::IN_USE);
+        addresses.push_back(format(mEntries[slots[i]].mKey));
+    }
+    return addresses;
+}
+
+void AddressManager::succeeded(std::string_view address, std::chrono::milliseconds latency) {
+    std::unique_lock lock(mMutex);
+    auto entry = find(address);
+    if (!entry)
+        return;
+    auto ms = static_cast<uint32_t>(std::max<int64_t>(latency.count(), 0));
+    entry->mLatencyMs = entry->mSuccesses ? (7 * entry->mLatencyMs + ms) / 8 : ms;
+    if (entry->mSuccesses < UINT16_MAX)
+        entry->mSuccesses++;
+    entry->mFailures = 0;
+    persist(entry - mEntries.data());
+}
+
+void AddressManager::failed(std::string_view address) {
+    std::unique_lock lock(mMutex);
+    auto entry = find(address);
+    if (!entry)
+        return;
+    auto slot = static_cast<uint32_t>(entry - mEntries.data());
+    if (++entry->mFailures >= kMaxFailures)
+        return erase(slot);
+    entry->mRetry = std::chrono::steady_clock::now() + kBackoff * (1 << (entry->mFailures - 1));
+    setState(slot, State::BACKOFF);
+    persist(slot);
+}
+
+void AddressManager::release(std::string_view address, std::chrono::milliseconds delay) {
+    std::unique_lock lock(mMutex);
+    auto entry = find(address);
+    if (!entry || entry->mState != State::IN_USE)
+        return;
+    if (delay.count() > 0) {
+        entry->mRetry = std::chrono::steady_clock::now() + delay;
+        setState(entry - mEntries.data(), State::BACKOFF);
+    } else {
+        setState(entry - mEntries.data(), State::READY);
+    }
+}
+
+void AddressManager::releaseAll() {
+    std::unique_lock lock(mMutex);
+    for (auto& [key, slot] : mIndex) {
+        if (mEntries[slot].mState == State::IN_USE)
+            setState(slot, State::READY);
+    }
+}
+
+void AddressManager::ban(std::string_view address) {
+    auto key = parse(address);
+    if (!key)
+        return;
+    std::unique_lock lock(mMutex);
+    if (mBanned.size() < kMaxBanned)
+        mBanned.insert(*key);
+    auto it = mIndex.find(*key);
+    if (it != mIndex.end())
+        erase(it->second);
+}
+
+bool AddressManager::contains(std::string_view address) {
+    std::unique_lock lock(mMutex);
+    return find(address) != nullptr;
+}
+
+size_t AddressManager::size() {
+    std::unique_lock lock(mMutex);
+    return mIndex.size();
+}
+
+uint32_t AddressManager::weight(std::string_view address) {
+    std::unique_lock lock(mMutex);
+    auto entry = find(address);
+    return entry ? weight(*entry) : 0;
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "common/nocopyormove.h"
+
+/**
+* The addresses we know of ("ip:port", IPv4), with how well connecting
+* to them went. Each one is kept once, in one of kNumBuckets buckets
+* picked by its /16 subnet, so one network can not fill the table with
+* its own addresses. A full bucket replaces its worst address, if it is
+* worse than an untried one.
+*
+* select() picks an address that is not in use with a probability
+* proportional to its weight: untried ones kNeutralWeight, then higher
+* the faster they connected, halved with each failure in a row. Failed
+* ones are not picked again until a backoff passes.
+*
+* The ones that connected at least once can be kept in a file mapped in
+* memory, so a restarted node knows them. Each change is a copy of its
+* record to the map, the kernel writes it back.
+*
+* File layout, host byte order:
+*   Header (16 bytes): magic, u32 number of records, 4 pad
+*   Records of 16 bytes, one per slot: u64 ip << 16 | port (0 if free),
+*     u16 successes, u16 failures, u32 smoothed latency in ms
+*
+* Usage:
+*   book.open("addresses.bin"); // Optional
+*   book.add("1.2.3.4:11250");
+*   if (auto address = book.select()) ... // In use until its outcome
+*   book.succeeded(*address, latency); ... book.release(*address);
+*/
+class AddressManager : private NoCopyOrMove {
+public:
+    static constexpr size_t kNumBuckets = 256;
+    static constexpr size_t kBucketSize = 16;
+    static constexpr uint32_t kMaxWeight = 64;
+    static constexpr uint32_t kNeutralWeight = 16;
+    static constexpr unsigned kMaxFailures = 8; // In a row, then forgotten
+    static constexpr auto kBackoff = std::chrono::seconds(1); // Doubled with each failure
+    static constexpr size_t kMaxBanned = 1024;
+
+    AddressManager();
+    ~AddressManager() {close();}
+
+    // Loads the known good addresses of the file, and keeps them there
+    //  from now on. It is created if it does not exist, or rewritten
+    //  next to it (path.tmp) and renamed over it
+    bool open(const std::string& path);
+    void close();
+
+    // False if it is invalid, known, banned, or its bucket is full of
+    //  better ones
+    bool add(std::string_view address);
+    // The next one to connect to, it is in use until released or failed
+    std::optional<std::string> select();
+    // The n ones with the highest weight not in use, in use as select()
+    std::vector<std::string> best(size_t n);
+    // Outcome of an attempt at an address taken by select()
+    void succeeded(std::string_view address, std::chrono::milliseconds latency);
+    void failed(std::string_view address);
+    // Not in use any more, it can be selected again after delay. Not
+    //  a failure of the address, its weight stays the same
+    void release(std::string_view address, std::chrono::milliseconds delay = {});
+    void releaseAll();
+    // Forgotten, and never added again (ourselves, misbehaving peers)
+    void ban(std::string_view address);
+
+    bool contains(std::string_view address);
+    size_t size();
+    // 0 for unknown ones
+    uint32_t weight(std::string_view address);
+
+private:
+    enum class State : uint8_t {READY, IN_USE, BACKOFF};
+    struct Entry {
+        uint64_t mKey; // ip << 16 | port
+        uint32_t mBucket;
+        uint32_t mPos; // In mReady or mBackoff
+        State mState = State::READY;
+        uint16_t mSuccesses = 0;
+        uint16_t mFailures = 0; // In a row
+        uint32_t mLatencyMs = 0; // Smoothed, 0 if never connected
+        std::chrono::steady_clock::time_point mRetry;
+    };
+
+    std::mutex mMutex;
+    std::mt19937_64 mEngine; // Seeded once
+    uint64_t mSalt;
+    std::vector<Entry> mEntries; // Slots, reused
+    std::vector<uint32_t> mFree;
+    std::unordered_map<uint64_t, uint32_t> mIndex; // Key to slot
+    std::vector<uint32_t> mBuckets[kNumBuckets];
+    std::vector<uint32_t> mReady; // The ones select() can take
+    std::vector<uint32_t> mBackoff;
+    std::chrono::steady_clock::time_point mNextRetry = std::chrono::steady_clock::time_point::max();
+    std::unordered_set<uint64_t> mBanned;
+
+    struct Header {
+        char mMagic[8];
+        uint32_t mNumRecords;
+        uint32_t mPad;
+    };
+    struct Record {
+        uint64_t mKey;
+        uint16_t mSuccesses;
+        uint16_t mFailures;
+        uint32_t mLatencyMs;
+    };
+    static_assert(sizeof(Header) == 16 && sizeof(Record) == 16);
+    static constexpr size_t kMaxEntries = kNumBuckets * kBucketSize;
+    void* mMap = nullptr;
+    Record* mRecords = nullptr; // kMaxEntries, indexed by slot
+
+    static std::optional<uint64_t> parse(std::string_view address);
+    // Could come from parse(), the file ones are checked with it
+    static bool valid(uint64_t key);
+    static std::string format(uint64_t key);
+    static uint32_t weight(const Entry& entry);
+    Entry* find(std::string_view address);
+    // A new one, or nullopt
+    std::optional<uint32_t> insert(uint64_t key);
+    // Its record in the file, if it has one
+    void persist(uint32_t slot);
+
+    // Moves it between the lists
+    void setState(uint32_t slot, State state);
+    void retryExpired();
+    void erase(uint32_t slot);
+};
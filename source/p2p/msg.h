@@ -1,8 +1,16 @@
 #pragma once
 
 #include <msgpack.hpp>
+#include <algorithm>
 #include <array>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
 #include <fmt/format.h>
+#include <magic_enum.hpp>
 
 namespace Msg {
 
@@ -10,8 +18,14 @@ enum class Type  {
     PEER_INFO,
     DISCOVERY,
     DISCONNECT,
+    INVENTORY,
+    GET_DATA,
+    DATA,
+    PING,
+    PONG,
 };
 
+// Wire format of all the messages, see encode() and decode()
 struct Any {
     Type type;
     msgpack::object data;
@@ -42,10 +56,209 @@ struct Disconnect {
     std::string mText;
     MSGPACK_DEFINE(mReason, mText);
 };
+
+// Gossiped items are announced by their hash (INVENTORY), and only the
+//  peers that did not see them ask for the data (GET_DATA, DATA)
+using Hash = std::array<char, 32>;
+// The hashes come from other nodes, salted so they can not make all of
+//  them fall in the same bucket
+struct HashOf {
+    uint64_t mSalt = (uint64_t(std::random_device()()) << 32) | std::random_device()();
+    size_t operator()(const Hash& h) const {
+        uint64_t v;
+        memcpy(&v, h.data(), sizeof(v));
+        v = (v ^ mSalt) * 0x9e3779b97f4a7c15;
+        return v ^ (v >> 32);
+    }
+};
+struct Item {
+    enum class Kind {
+        BLOCK,
+        TX,
+    } mKind;
+    Hash mHash;
+    MSGPACK_DEFINE(mKind, mHash);
+};
+struct Inventory {
+    std::vector<Item> mItems;
+    MSGPACK_DEFINE(mItems);
+};
+struct GetData {
+    std::vector<Item> mItems;
+    MSGPACK_DEFINE(mItems);
+};
+struct Data {
+    Item mItem;
+    std::string mData;
+    MSGPACK_DEFINE(mItem, mData);
+};
+
+// Liveness and round trip time, the pong echoes the nonce and the time
+//  of the ping it answers, the time is only meaningful to its sender
+struct Ping {
+    uint64_t mNonce;
+    int64_t mTime; // Steady clock of the sender, in microseconds
+    MSGPACK_DEFINE(mNonce, mTime);
+};
+struct Pong {
+    uint64_t mNonce;
+    int64_t mTime; // Echoed, not trusted
+    MSGPACK_DEFINE(mNonce, mTime);
+};
+
+// What is received, the strings point to the received buffer and are
+//  only valid while the handler runs
+struct DiscoveryView {
+    std::vector<std::string_view> mAddresses;
+    MSGPACK_DEFINE(mAddresses);
+};
+struct DisconnectView {
+    Disconnect::Reason mReason;
+    std::string_view mText;
+    MSGPACK_DEFINE(mReason, mText);
+};
+struct DataView {
+    Item mItem;
+    std::string_view mData;
+    MSGPACK_DEFINE(mItem, mData);
+};
 }; // namepsace Msg
 
 MSGPACK_ADD_ENUM(Msg::Type);
 MSGPACK_ADD_ENUM(Msg::Disconnect::Reason);
+MSGPACK_ADD_ENUM(Msg::Item::Kind);
+
+namespace Msg {
+// Message registry, for each type: the payload that is sent, the one
+//  that is received (it can be a view of the received buffer), and the
+//  biggest packed message accepted. A new message only needs its Type,
+//  its Payload and a P2P::onMsg overload
+template <Type> struct Payload;
+template <> struct Payload<Type::PEER_INFO> {
+    using Send = PeerInfo;
+    using Recv = PeerInfo;
+    static constexpr size_t kMaxSize = 128;
+};
+template <> struct Payload<Type::DISCOVERY> {
+    using Send = Discovery;
+    using Recv = DiscoveryView;
+    static constexpr size_t kMaxSize = 64 * 1024;
+};
+template <> struct Payload<Type::DISCONNECT> {
+    using Send = Disconnect;
+    using Recv = DisconnectView;
+    static constexpr size_t kMaxSize = 1024;
+};
+template <> struct Payload<Type::INVENTORY> {
+    using Send = Inventory;
+    using Recv = Inventory;
+    static constexpr size_t kMaxSize = 64 * 1024; // ~1600 items
+};
+template <> struct Payload<Type::GET_DATA> {
+    using Send = GetData;
+    using Recv = GetData;
+    static constexpr size_t kMaxSize = 64 * 1024;
+};
+template <> struct Payload<Type::DATA> {
+    using Send = Data;
+    using Recv = DataView;
+    static constexpr size_t kMaxSize = 1024 * 1024;
+};
+template <> struct Payload<Type::PING> {
+    using Send = Ping;
+    using Recv = Ping;
+    static constexpr size_t kMaxSize = 32;
+};
+template <> struct Payload<Type::PONG> {
+    using Send = Pong;
+    using Recv = Pong;
+    static constexpr size_t kMaxSize = 32;
+};
+
+constexpr size_t kNumTypes = magic_enum::enum_count<Type>();
+
+namespace detail {
+    constexpr bool contiguous() {
+        auto values = magic_enum::enum_values<Type>();
+        for (size_t i = 0; i < values.size(); i++) {
+            if (values[i] != Type(i))
+                return false;
+        }
+        return true;
+    }
+
+    template <class T, size_t... I>
+    constexpr Type typeOf(std::index_sequence<I...>) {
+        Type type = Type(kNumTypes);
+        ((std::is_same_v<T, typename Payload<Type(I)>::Send> ? type = Type(I) : type), ...);
+        return type;
+    }
+
+    template <class F, size_t I>
+    void decodeAs(const msgpack::object& data, size_t size, F& f) {
+        using P = Payload<Type(I)>;
+        if (size > P::kMaxSize)
+            throw std::length_error(fmt::format("{} message of {} bytes", magic_enum::enum_name(Type(I)), size));
+        f(data.as<typename P::Recv>());
+    }
+    template <class F, size_t... I>
+    constexpr auto decoders(std::index_sequence<I...>) {
+        return std::array<void(*)(const msgpack::object&, size_t, F&), sizeof...(I)>{&decodeAs<F, I>...};
+    }
+    // One table per handler type, built at compile time
+    template <class F>
+    constexpr auto kDecoders = decoders<F>(std::make_index_sequence<kNumTypes>{});
+
+    template <size_t... I>
+    constexpr size_t maxSize(std::index_sequence<I...>) {
+        return std::max({Payload<Type(I)>::kMaxSize...});
+    }
+};
+
+static_assert(detail::contiguous(), "Msg::Type values index the dispatch table, they have to be 0..N-1");
+
+// The biggest message of any type
+constexpr size_t kMaxSize = detail::maxSize(std::make_index_sequence<kNumTypes>{});
+
+// The Type a payload is sent as
+template <class T>
+constexpr Type kTypeOf = detail::typeOf<T>(std::make_index_sequence<kNumTypes>{});
+
+// Packs [type, payload] straight into the stream
+template <class Stream, class T>
+void encode(Stream& stream, const T& payload) {
+    static_assert(kTypeOf<T> != Type(kNumTypes), "Not a registered Msg::Payload");
+    msgpack::packer<Stream> packer(stream);
+    packer.pack_array(2);
+    packer.pack(kTypeOf<T>);
+    packer.pack(payload);
+}
+
+// A packed message, immutable once packed, so all the peers it is
+//  sent to can share it
+using Packed = std::shared_ptr<const msgpack::sbuffer>;
+
+template <class T>
+Packed pack(const T& payload) {
+    auto buffer = std::make_shared<msgpack::sbuffer>();
+    encode(*buffer, payload);
+    return buffer;
+}
+
+// Converts the payload of a received [type, data] message of size
+//  bytes straight from the unpacked object, and calls f(payload)
+// Unknown types and messages over their kMaxSize are rejected before
+//  converting them, throws on those and on invalid data
+template <class F>
+void decode(const msgpack::object& obj, size_t size, F&& f) {
+    if (obj.type != msgpack::type::ARRAY || obj.via.array.size != 2)
+        throw msgpack::type_error();
+    auto& tag = obj.via.array.ptr[0];
+    if (tag.type != msgpack::type::POSITIVE_INTEGER || tag.via.u64 >= kNumTypes)
+        throw msgpack::type_error();
+    detail::kDecoders<std::remove_reference_t<F>>[tag.via.u64](obj.via.array.ptr[1], size, f);
+}
+}; // namepsace Msg
 
 // Printers
 template <>
@@ -72,3 +285,64 @@ struct fmt::formatter<Msg::Disconnect> {
             magic_enum::enum_name(d.mReason), d.mText);
     }
 };
+template <>
+struct fmt::formatter<Msg::DiscoveryView> {
+    constexpr auto parse(format_parse_context& ctx) { return ctx.begin(); }  template <typename FormatContext>
+    auto format(const Msg::DiscoveryView& d, FormatContext& ctx) {
+        return format_to(ctx.out(), "'{}'", fmt::join(d.mAddresses, ", "));
+    }
+};
+template <>
+struct fmt::formatter<Msg::DisconnectView> {
+    constexpr auto parse(format_parse_context& ctx) { return ctx.begin(); }  template <typename FormatContext>
+    auto format(const Msg::DisconnectView& d, FormatContext& ctx) {
+        return format_to(ctx.out(), "{}:{}", 
+            magic_enum::enum_name(d.mReason), d.mText);
+    }
+};
+template <>
+struct fmt::formatter<Msg::Item> {
+    constexpr auto parse(format_parse_context& ctx) { return ctx.begin(); }  template <typename FormatContext>
+    auto format(const Msg::Item& d, FormatContext& ctx) const {
+        // The first bytes are enough to tell them apart in the logs
+        uint32_t prefix = 0;
+        for (int i = 0; i < 4; i++)
+            prefix = prefix << 8 | static_cast<uint8_t>(d.mHash[i]);
+        return format_to(ctx.out(), "{}:{:08x}", magic_enum::enum_name(d.mKind), prefix);
+    }
+};
+template <>
+struct fmt::formatter<Msg::Inventory> {
+    constexpr auto parse(format_parse_context& ctx) { return ctx.begin(); }  template <typename FormatContext>
+    auto format(const Msg::Inventory& d, FormatContext& ctx) {
+        return format_to(ctx.out(), "'{}'", fmt::join(d.mItems, ", "));
+    }
+};
+template <>
+struct fmt::formatter<Msg::GetData> {
+    constexpr auto parse(format_parse_context& ctx) { return ctx.begin(); }  template <typename FormatContext>
+    auto format(const Msg::GetData& d, FormatContext& ctx) {
+        return format_to(ctx.out(), "'{}'", fmt::join(d.mItems, ", "));
+    }
+};
+template <>
+struct fmt::formatter<Msg::DataView> {
+    constexpr auto parse(format_parse_context& ctx) { return ctx.begin(); }  template <typename FormatContext>
+    auto format(const Msg::DataView& d, FormatContext& ctx) {
+        return format_to(ctx.out(), "{}, {} bytes", d.mItem, d.mData.size());
+    }
+};
+template <>
+struct fmt::formatter<Msg::Ping> {
+    constexpr auto parse(format_parse_context& ctx) { return ctx.begin(); }  template <typename FormatContext>
+    auto format(const Msg::Ping& d, FormatContext& ctx) {
+        return format_to(ctx.out(), "Nonce:{:016x}, Time:{}", d.mNonce, d.mTime);
+    }
+};
+template <>
+struct fmt::formatter<Msg::Pong> {
+    constexpr auto parse(format_parse_context& ctx) { return ctx.begin(); }  template <typename FormatContext>
+    auto format(const Msg::Pong& d, FormatContext& ctx) {
+        return format_to(ctx.out(), "Nonce:{:016x}, Time:{}", d.mNonce, d.mTime);
+    }
+};
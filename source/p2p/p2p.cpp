@@ -5,6 +5,7 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <fcntl.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
 
@@ -40,12 +41,11 @@ bool P2P::start(){
     mOwnPeerInfo.mListenPort = mListenPort;
     mOwnPeerInfo.mUID = mUID++;
 
-    // We first do the initialization of socket in the main thread
+    // We first do the initialization of sockets in the main thread
     //  This make seasy to report errors
-    // If everything in the setup succeeds, then start the thread loop
+    // If everything in the setup succeeds, then start the thread loops
 
     struct addrinfo hints, *res;
-    int reuseaddr = 1;
 
     // Get the address info
     memset(&hints, 0, sizeof hints);
@@ -56,82 +56,194 @@ bool P2P::start(){
         return false;
     }
 
+    unsigned numReactors = mNumReactors ? mNumReactors : std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned i = 0; i < numReactors; i++) {
+        auto reactor = std::make_unique<Reactor>();
+        reactor->mId = i;
+        bool opened = openReactor(*reactor, res);
+        std::unique_lock lock(mReactorsMutex);
+        mReactors.emplace_back(std::move(reactor));
+        if (!opened) {
+            for (auto& r : mReactors)
+                closeReactor(*r);
+            mReactors.clear();
+            freeaddrinfo(res);
+            return false;
+        }
+    }
+    freeaddrinfo(res);
+
+    mLog.i("opened listen socket on port {} ({} threads)", mListenPort, numReactors);
+
+    // Launch threads
+    mRunning = true;
+    for (auto& reactor : mReactors) {
+        reactor->mRunning = true;
+        reactor->mNextPing = std::chrono::steady_clock::now() + mPingInterval;
+        reactor->mThread = std::thread(&P2P::threadLoop, this, std::ref(*reactor));
+    }
+
+    // The ones that connected fastest last time are dialed at once,
+    //  then the bootstrap ones fill the rest
+    if (!mAddressFile.empty() && !mAddresses.open(mAddressFile))
+        mLog.w("Can not open the address file {}", mAddressFile);
+    for (auto& address : mAddresses.best(std::min(mMaxConnecting, kTargetNumPeers)))
+        dial(address);
+    for (auto& str : mBootStrap)
+        mAddresses.add(str);
+    tryConnect();
+
+    return true;
+}
+
+bool P2P::openReactor(Reactor& reactor, const struct addrinfo* res) {
+    int reuse = 1;
+
     // Create the socket
-    mMainSocket = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    if (mMainSocket == -1) {
+    reactor.mListenSocket = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (reactor.mListenSocket == -1) {
         mLog.e("socket creation error");
         return false;
     }
 
-    // Enable the socket to reuse the address
-    if (setsockopt(mMainSocket, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, sizeof(int)) == -1) {
+    // Enable the socket to reuse the address, and all the reactors
+    //  to listen on the same port
+    if (setsockopt(reactor.mListenSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int)) == -1 ||
+        setsockopt(reactor.mListenSocket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(int)) == -1) {
         mLog.e("setsockopt {}", errno);
         return false;
     }
 
     // Bind to the address
-    if (bind(mMainSocket, res->ai_addr, res->ai_addrlen) == -1) {
+    if (bind(reactor.mListenSocket, res->ai_addr, res->ai_addrlen) == -1) {
         mLog.e("bind {}", errno);
         return false;
     }
 
     // Listen
-    if (listen(mMainSocket, kListenQueueLen) == -1) {
+    if (listen(reactor.mListenSocket, kListenQueueLen) == -1) {
         mLog.e("listen {}", errno);
         return false;
     }
-    freeaddrinfo(res);
-
-    mLog.i("opened listen socket on port {}", mListenPort);
 
-    // Event Fd to send data to the thread
-    if(pipe(mEventPipe)){
-        mLog.e("Pipe with thread not set up {}", errno);
+    // Event Fd to wake up the thread
+    reactor.mEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reactor.mEventFd == -1) {
+        mLog.e("eventfd with thread not set up {}", errno);
         return false;
     }
 
     // Initialize epoll that the thread will serve
     //  we do this before the thread to be able to start straight away
     //  connecting and adding clients before we even serve it
-    mEpollFd = epoll_create(1);
-
-    // Launch thread
-    std::unique_lock lock2(mPeersMutex);
-    mPeers.clear();
-    mRunning = true;
-    mThread = std::thread(&P2P::threadLoop, this);
-
-    // Launch connections async on all bootstrap addresses
-    for (auto& str : mBootStrap) {
-        aConnect(str);
+    reactor.mEpollFd = epoll_create1(0);
+    if (reactor.mEpollFd == -1) {
+        mLog.e("epoll_create {}", errno);
+        return false;
     }
+    epollCtl(reactor, EPOLL_CTL_ADD, reactor.mListenSocket, EPOLLIN, -1);
+    epollCtl(reactor, EPOLL_CTL_ADD, reactor.mEventFd, EPOLLIN, -2);
 
+    // Without io_uring support it stays on epoll
+    if (mBackend == Backend::URING)
+        openUring(reactor);
     return true;
 }
 
+void P2P::closeReactor(Reactor& reactor) {
+    reactor.mUring.close();
+    // Started after its thread stopped
+    for (auto& attempt : reactor.mConnects) {
+        if (attempt.mFd != -1) {
+            close(attempt.mFd);
+            attempt.mFd = -1;
+            mConnecting--;
+        }
+    }
+    for (auto fd : {reactor.mEpollFd, reactor.mEventFd, reactor.mListenSocket}) {
+        if (fd != -1)
+            close(fd);
+    }
+    reactor.mEpollFd = reactor.mEventFd = reactor.mListenSocket = -1;
+}
+
 void P2P::stop(){
-    std::unique_lock lock1(mTasksMutex, std::defer_lock);
-    std::unique_lock lock2(mThreadMutex, std::defer_lock);
-    std::lock(lock1, lock2);
-    mTasks.clear();
+    std::unique_lock lock(mThreadMutex);
     if (mRunning){
-        //Send Event to thread
-        sendThreadEvent(Event::SHUTDOWN);
-        mThread.join();
+        //Send Event to threads
+        for (auto& reactor : mReactors)
+            sendThreadEvent(*reactor, Event::SHUTDOWN);
+        for (auto& reactor : mReactors)
+            reactor->mThread.join();
+        // Once all stopped, taken out of the list before closing them,
+        //  so a concurrent connect() can not pick a closing one
+        decltype(mReactors) reactors;
+        {
+            std::unique_lock lock(mReactorsMutex);
+            reactors.swap(mReactors);
+        }
+        for (auto& reactor : reactors)
+            closeReactor(*reactor);
     }
     mRunning = false;
+    // All the connections are closed, they can be used again
+    mAddresses.releaseAll();
+}
+
+void P2P::sendThreadEvent(Reactor& reactor, Event ev, int fd, uint32_t generation) {
+    sendThreadEvent(reactor, ThreadEvent{ev, fd, generation});
 }
 
-void P2P::sendThreadEvent(const Event& ev) {
-    if (sizeof(ev) != write(mEventPipe[1], &ev, sizeof(ev))) {
-        mLog.e("Error sending event to Thread");
+void P2P::sendThreadEvent(Reactor& reactor, ThreadEvent&& event) {
+    auto ev = event.mEvent;
+    if (!reactor.mEvents.tryPush([&](ThreadEvent& slot){ slot = std::move(event); })) {
+        // The reactor itself can be the sender, it can not wait for it
+        std::unique_lock lock(reactor.mOverflowMutex);
+        reactor.mOverflow.push_back(std::move(event));
+        reactor.mHasOverflow = true;
+    }
+    // One wake up until the reactor drains the queue, it clears the
+    //  flag before draining so nothing pushed after it is missed
+    if (!reactor.mWakePending.exchange(true)) {
+        uint64_t one = 1;
+        if (sizeof(one) != write(reactor.mEventFd, &one, sizeof(one)))
+            mLog.e("Error sending event {} to Thread", ev);
     }
 }
 
+void P2P::sendThreadEvent(const Peer& peer, Event ev) {
+    sendThreadEvent(*mReactors[peer.mReactor], ev, peer.mFd, peer.mGeneration);
+}
 
 void P2P::aConnect(const std::string& address) {
-    std::unique_lock lock(mTasksMutex);
-    mTasks.emplace_back(std::async(std::launch::async, &P2P::connect, this, address));
+    mAddresses.add(address);
+    tryConnect();
+}
+
+void P2P::tryConnect() {
+    // Another attempt finishing tries again
+    while (getNumClients() + mConnecting < kTargetNumPeers && mConnecting < mMaxConnecting) {
+        auto address = mAddresses.select();
+        if (!address || !dial(*address))
+            break;
+    }
+}
+
+bool P2P::dial(const std::string& address) {
+    // Only the failures of the address count against it
+    auto res = connect(address);
+    if (res == -2 || res == -3) {
+        mAddresses.failed(address);
+    } else if (res == -1) {
+        // Out of fds likely, it waits without counting as a failure
+        mAddresses.release(address, AddressManager::kBackoff);
+        return false;
+    } else if (res < 0) {
+        // Stopped, or the attempts are taken, dialed once one finishes
+        mAddresses.release(address);
+        return false;
+    }
+    return true;
 }
 
 int P2P::connect(const std::string& address) {
@@ -140,20 +252,12 @@ int P2P::connect(const std::string& address) {
     auto pos = address.find(':');
     if (pos == address.npos) {
         mLog.w("No ':' found in address '{}'", address);
-        return -1;
+        return -2;
     }
     auto addr = address.substr(0, pos);
     auto p = address.substr(pos+1);
     auto port = atoi(p.c_str());
 
-    auto sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    int sock = 0, valread;
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-    {
-        mLog.e("Socket creation error");
-        return -1;
-    }
-
     struct sockaddr_in sockaddr;
     sockaddr.sin_family = AF_INET;
     sockaddr.sin_port = htons(port);
@@ -164,216 +268,569 @@ int P2P::connect(const std::string& address) {
         mLog.w("Invalid address {}", addr);
         return -2;
     }
-    if (::connect(sock, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) < 0)
+
+    if (++mConnecting > mMaxConnecting) {
+        mConnecting--;
+        return -5;
+    }
+
+    // Never blocks, the reactor gets the result (EPOLLOUT)
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sock < 0) {
+        mLog.e("Socket creation error");
+        mConnecting--;
+        return -1;
+    }
+    if (::connect(sock, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) < 0 && errno != EINPROGRESS)
     {
         mLog.w("Connection Failed to {}:{}",
             inet_ntoa(sockaddr.sin_addr), htons(sockaddr.sin_port));
+        close(sock);
+        mConnecting--;
         return -3;
     }
 
-    // At this point the connection succeeded add it to the queue of mPeers
-    std::unique_lock lock(mPeersMutex);
-    auto& peer = insertPeer(sockaddr, sock, Peer::Direction::OUT);
-
-    // We connected, so we have to send our own peer info/discovery list
-    sendThreadEvent(PEER_WELCOME);
-    sendThreadEventData(sock);
-
+    // Outgoing connections are spread between the reactors
+    std::unique_lock lock(mReactorsMutex);
+    if (mReactors.empty()) {
+        mLog.w("P2P not running, dropping connection to {}", address);
+        close(sock);
+        mConnecting--;
+        return -4;
+    }
+    auto& reactor = *mReactors[mNextReactor++ % mReactors.size()];
+    unsigned slot;
+    {
+        std::unique_lock lock(reactor.mConnectMutex);
+        if (reactor.mFreeConnects.empty()) {
+            slot = reactor.mConnects.size();
+            reactor.mConnects.emplace_back();
+        } else {
+            slot = reactor.mFreeConnects.back();
+            reactor.mFreeConnects.pop_back();
+        }
+        auto& attempt = reactor.mConnects[slot];
+        attempt.mFd = sock;
+        attempt.mAddress = address;
+        attempt.mAddr = sockaddr;
+        attempt.mStart = std::chrono::steady_clock::now();
+        attempt.mDeadline = attempt.mStart + mConnectTimeout;
+    }
+    sendThreadEvent(reactor, CONNECT_NEW, slot);
     return 0;
 }
 
-Peer& P2P::insertPeer(const sockaddr_in& sockaddr, int sock, const Peer::Direction& dir) {
+void P2P::watchConnect(Reactor& reactor, unsigned slot) {
+    if (isUring(reactor))
+        return uringConnect(reactor, slot);
+    int fd;
+    {
+        std::unique_lock lock(reactor.mConnectMutex);
+        fd = reactor.mConnects[slot].mFd;
+    }
+    // Writable once connected, or failed
+    epollCtl(reactor, EPOLL_CTL_ADD, fd, EPOLLOUT, kConnectData - slot);
+}
+
+void P2P::connectDone(Reactor& reactor, unsigned slot, int error) {
+    Connect attempt;
     {
-        std::unique_lock lock(mPeersMutex);
-        mPeers[sock].mConAddress = inet_ntoa(sockaddr.sin_addr);
-        mPeers[sock].mConPort = htons(sockaddr.sin_port);
-        mPeers[sock].mFd = sock;
-        mPeers[sock].mReady = false; // Not ready until we check peer info
-        mPeers[sock].mDirection = dir;
+        std::unique_lock lock(reactor.mConnectMutex);
+        attempt = reactor.mConnects[slot];
+        reactor.mConnects[slot].mFd = -1;
+        reactor.mFreeConnects.push_back(slot);
     }
+    mConnecting--;
+
+    if (!isUring(reactor))
+        epoll_ctl(reactor.mEpollFd, EPOLL_CTL_DEL, attempt.mFd, NULL);
+    socklen_t size = sizeof(error);
+    if (!error && getsockopt(attempt.mFd, SOL_SOCKET, SO_ERROR, &error, &size) < 0)
+        error = errno;
+    if (error || !reactor.mRunning) {
+        // Only its own failures count against the address
+        if (!reactor.mRunning || error == ECANCELED || error == EAGAIN) {
+            mAddresses.release(attempt.mAddress);
+        } else {
+            mLog.w("Connection Failed to {} ({})", attempt.mAddress, strerror(error));
+            mAddresses.failed(attempt.mAddress);
+        }
+        close(attempt.mFd);
+    } else {
+        auto latency = std::chrono::steady_clock::now() - attempt.mStart;
+        mAddresses.succeeded(attempt.mAddress, std::chrono::duration_cast<std::chrono::milliseconds>(latency));
+        // We connected, so we have to send our own peer info/discovery list
+        if (auto peer = insertPeer(reactor, attempt.mAddr, attempt.mFd, Peer::Direction::OUT))
+            sendThreadEvent(*peer, PEER_WELCOME);
+    }
+
+    // The pool might have addresses waiting for a free attempt
+    if (reactor.mRunning)
+        sendThreadEvent(reactor, TRY_CONNECT);
+}
+
+void P2P::expireConnects(Reactor& reactor, bool all) {
+    auto now = std::chrono::steady_clock::now();
+    std::vector<unsigned> expired;
     {
-        std::unique_lock<std::mutex> lock(mThreadMutex);
-        if (mRunning)
-            epollCtl(EPOLL_CTL_ADD, sock, EPOLLIN, sock);
+        std::unique_lock lock(reactor.mConnectMutex);
+        for (unsigned slot = 0; slot < reactor.mConnects.size(); slot++) {
+            auto& attempt = reactor.mConnects[slot];
+            if (attempt.mFd != -1 && (all || attempt.mDeadline <= now))
+                expired.push_back(slot);
+        }
+    }
+    for (auto slot : expired)
+        connectDone(reactor, slot, all ? ECANCELED : ETIMEDOUT);
+}
+
+int P2P::connectTimeout(Reactor& reactor) {
+    // Until the first attempt expires, forever without attempts
+    std::unique_lock lock(reactor.mConnectMutex);
+    if (reactor.mFreeConnects.size() == reactor.mConnects.size())
+        return -1;
+    auto deadline = std::chrono::steady_clock::time_point::max();
+    for (auto& attempt : reactor.mConnects) {
+        if (attempt.mFd != -1)
+            deadline = std::min(deadline, attempt.mDeadline);
     }
-    return mPeers[sock];
+    auto ms = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+    return std::max<int>(0, ms.count());
+}
+
+int P2P::pingTimeout(Reactor& reactor) {
+    auto deadline = std::min(reactor.mNextPing, mNextExpiry.load(std::memory_order_relaxed));
+    auto ms = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+    return std::max<int>(0, ms.count());
 }
 
-void P2P::newPeer(struct epoll_event& ev) {
-    // New connection in Main socket
+void P2P::pingPeers(Reactor& reactor) {
+    auto now = std::chrono::steady_clock::now();
+    reactor.mNextPing = now + mPingInterval;
+    auto time = std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch());
+    bool rotate = getNumClients() > mMaxPeers;
+    int slowest = -1;
+    uint32_t slowestGeneration = 0;
+    auto slowestRtt = std::chrono::microseconds(0);
+
+    // Only the peers of this reactor, the busy ones are being served
+    //  and are pinged the next time
+    mPeers.forEach([&](Peer& peer){
+        if (peer.mReactor != reactor.mId || peer.mClosing)
+            return;
+        if (peer.mPingNonce != 0 && now - peer.mPingSent >= mPingTimeout) {
+            // The connection is dead, or the peer is
+            mLog.i("{} did not answer the ping", peer);
+            removePeer(peer.mFd);
+            return;
+        }
+        if (rotate && peer.mRtt > slowestRtt) {
+            slowest = peer.mFd;
+            slowestGeneration = peer.mGeneration;
+            slowestRtt = peer.mRtt;
+        }
+        if (peer.mPingNonce != 0)
+            return; // Still waiting for the last one
+        peer.mPingNonce = reactor.mRandom() | 1;
+        peer.mPingSent = now;
+        sendMsg(peer, Msg::Ping{peer.mPingNonce, time.count()});
+    }, [](Peer&, int){});
+
+    // One at a time, the ones that replace it are likely faster
+    std::unique_lock<std::recursive_mutex> lock;
+    if (slowest != -1) {
+        if (auto peer = mPeers.lock(slowest, lock, slowestGeneration)) {
+            mLog.d("Rotating out {}", *peer);
+            sendMsg_Disconnect(*peer, Msg::Disconnect::Reason::ROTATING);
+            peer->mClosing = true;
+            sendThreadEvent(*peer, PEER_CLOSE);
+        }
+    }
+}
+
+Peer* P2P::insertPeer(Reactor& reactor, const sockaddr_in& sockaddr, int sock, const Peer::Direction& dir) {
+    std::unique_lock<std::recursive_mutex> lock;
+    auto peer = mPeers.insert(sock, lock);
+    if (!peer) {
+        mLog.e("No room for the socket {} in the peer table", sock);
+        close(sock);
+        return nullptr;
+    }
+    peer->mConAddress = inet_ntoa(sockaddr.sin_addr);
+    peer->mConPort = htons(sockaddr.sin_port);
+    peer->mReactor = reactor.mId;
+    peer->mReady = false; // Not ready until we check peer info
+    peer->mDirection = dir;
+    // The reactors are only destroyed after the tasks connecting finish
+    if (!isUring(reactor)) {
+        // Sends never block the thread, what the socket does not take
+        //  is queued and written once it can (EPOLLOUT)
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+        peer->mEvents = EPOLLIN;
+        epollCtl(reactor, EPOLL_CTL_ADD, sock, peer->mEvents, sock);
+    } else if (std::this_thread::get_id() == reactor.mThread.get_id())
+        uringOpen(reactor, *peer);
+    else // Only its thread can use the ring
+        sendThreadEvent(*peer, PEER_NEW);
+    return peer;
+}
+
+void P2P::newPeer(Reactor& reactor) {
+    // New connection in the listen socket of this reactor
     socklen_t size = sizeof(struct sockaddr_in);
     struct sockaddr_in addr;
-    int newsock = accept(mMainSocket, (struct sockaddr*)&addr, &size);
+    int newsock = accept(reactor.mListenSocket, (struct sockaddr*)&addr, &size);
     if (newsock == -1) {
         mLog.e("accept error {}", errno);
     } else {
-        mLog.i("Got a connection (fd {}) from {}:{}",
-                newsock, inet_ntoa(addr.sin_addr), htons(addr.sin_port));
-        // Add it to the peer socket list & epoll
-        insertPeer(addr, newsock, Peer::Direction::IN);
+        acceptPeer(reactor, newsock, addr);
     }
 }
 
+void P2P::acceptPeer(Reactor& reactor, int sock, const sockaddr_in& addr) {
+    // Connection storms would flood the log
+    static Log::Limit limit(10);
+    mLog.i(limit, "Got a connection (fd {}) from {}:{}",
+            sock, inet_ntoa(addr.sin_addr), htons(addr.sin_port));
+    // Add it to the peer socket list & epoll
+    insertPeer(reactor, addr, sock, Peer::Direction::IN);
+}
+
 void P2P::removePeer(const Peer& peer) {
     removePeer(peer.mFd);
 }
 void P2P::removePeer(int fd) {
-    std::unique_lock lock(mPeersMutex);
-    auto it = mPeers.find(fd);
-    if (it != mPeers.end()) {
-        auto& peer = it->second;
-        std::unique_lock lock(peer.mMutex);
-        lock.unlock();
+    std::unique_lock<std::recursive_mutex> lock;
+    auto peer = mPeers.lock(fd, lock);
+    if (!peer)
+        return;
+
+    // Disconnected, what it was asked for is asked to others
+    mLog.i("Disconnected from {}", *peer);
+    forgetAnnouncer(*peer);
+    if (peer->mDirection == Peer::Direction::OUT)
+        mAddresses.release(fmt::format("{}:{}", peer->mConAddress, peer->mConPort));
+
+    // Remove from poll and close the socket, the fd is reused only
+    //  after it is closed, so after its slot is free
+    auto& reactor = *mReactors[peer->mReactor];
+    if (isUring(reactor))
+        uringClose(reactor, *peer);
+    else
+        epoll_ctl(reactor.mEpollFd, EPOLL_CTL_DEL, fd, NULL);
+    mPeers.erase(*peer);
+    close(fd);
+}
 
-        // Disconnected
-        mLog.i("Disconnected from {}", peer);
 
-        // Close the socket and remove from poll
-        close(peer.mFd);
-        epoll_ctl(mEpollFd, EPOLL_CTL_DEL, peer.mFd, NULL);
-        mPeers.erase(it);
+void P2P::servePeer(Reactor& reactor, int fd) {
+    std::unique_lock<std::recursive_mutex> peerLock;
+    auto peer = mPeers.lock(fd, peerLock);
+    if (!peer) {
+        mLog.w("Serve peer requested on unknown FD={}", fd);
+        epoll_ctl(reactor.mEpollFd, EPOLL_CTL_DEL, fd, NULL);
+        return;
+    }
+
+    // Until the socket is drained, or the budget of this wake up is
+    //  used, then the other peers are served. The rest is reported
+    //  again by epoll (level triggered)
+    auto& unp = peer->mUnpacker;
+    for (size_t budget = kReadBudget; budget > 0;) {
+        unp.reserve_buffer(kUpackBuffer);
+        // Never block, the event could be stale (a previous event of the
+        //  batch removed the peer, and the fd was reused)
+        int valread = recv(fd, unp.buffer(), kUpackBuffer, MSG_DONTWAIT);
+        if (valread < 0 && errno == EINTR)
+            continue;
+        if (valread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (valread <= 0){
+            if (valread < 0) {
+                static Log::Limit limit(10);
+                mLog.w(limit, "Socket returned {}", valread);
+            }
+            peerLock.unlock();
+            removePeer(fd);
+            return;
+        }
+        if (!decodePeer(*peer, valread)) {
+            peerLock.unlock();
+            removePeer(fd);
+            return;
+        }
+        // A short read took all there was, no need for the EAGAIN one
+        if (peer->mThrottled || valread < kUpackBuffer)
+            return;
+        budget -= std::min<size_t>(budget, valread);
     }
 }
 
+void P2P::writePeer(Reactor& reactor, int fd) {
+    std::unique_lock<std::recursive_mutex> lock;
+    // Stale events are cleaned by servePeer
+    if (auto peer = mPeers.lock(fd, lock))
+        flushPeer(*peer);
+}
 
-void P2P::servePeer(int fd) {
-    std::unique_lock lock(mPeersMutex);
-    auto it = mPeers.find(fd);
-    if (it == mPeers.end()) {
-        mLog.w("Serve peer requested on unknown FD={}", fd);
-        epoll_ctl(mEpollFd, EPOLL_CTL_DEL, fd, NULL);
+void P2P::flushPeer(Peer& peer) {
+    auto& reactor = *mReactors[peer.mReactor];
+    if (isUring(reactor))
+        return uringFlush(reactor, peer);
+
+    // As many queued messages as the socket takes, in one call each time
+    struct iovec iov[kMaxIovecs];
+    while (!peer.mOutbound.empty()) {
+        struct msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = toIovecs(peer.mOutbound, peer.mOutboundSent, iov, kMaxIovecs);
+        auto sent = sendmsg(peer.mFd, &msg, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // The read will find the socket broken
+                mLog.e("Error sending to socket on {}", peer);
+                peer.mOutbound.clear();
+                peer.mOutboundSent = peer.mOutboundBytes = 0;
+            }
+            break;
+        }
+        peer.mOutboundBytes -= sent;
+        consume(peer.mOutbound, peer.mOutboundSent, sent);
+    }
+    checkSlowPeer(peer);
+    updateEvents(peer);
+}
+
+void P2P::updateEvents(Peer& peer) {
+    // Throttled peers are not read, and only the ones with a queue
+    //  wait for the socket to be writable
+    uint32_t events = (peer.mThrottled ? 0 : EPOLLIN) | (peer.mOutbound.empty() ? 0 : EPOLLOUT);
+    if (events == peer.mEvents || peer.mClosing)
         return;
+    peer.mEvents = events;
+    epollCtl(*mReactors[peer.mReactor], EPOLL_CTL_MOD, peer.mFd, events, peer.mFd);
+}
+
+void P2P::checkSlowPeer(Peer& peer) {
+    if (peer.mOutboundBytes > mSendHighWater) {
+        if (mSlowPeer == SlowPeer::THROTTLE) {
+            peer.mThrottled = true;
+        } else if (!peer.mClosing) {
+            mLog.w("{} is not reading, {} bytes queued", peer, peer.mOutboundBytes);
+            peer.mClosing = true;
+            sendThreadEvent(peer, PEER_CLOSE);
+        }
+    } else if (peer.mThrottled && peer.mOutboundBytes <= mSendHighWater / 2) {
+        peer.mThrottled = false;
+    }
+}
+
+size_t P2P::toIovecs(const std::deque<Msg::Packed>& buffers, size_t sent, struct iovec* iov, size_t max) {
+    size_t num = 0;
+    for (auto it = buffers.begin(); it != buffers.end() && num < max; ++it, num++, sent = 0) {
+        iov[num].iov_base = const_cast<char*>((*it)->data()) + sent;
+        iov[num].iov_len = (*it)->size() - sent;
     }
-    auto& peer = it->second;
+    return num;
+}
+
+void P2P::consume(std::deque<Msg::Packed>& buffers, size_t& sent, size_t bytes) {
+    // Short sends continue where they stopped
+    sent += bytes;
+    while (!buffers.empty() && sent >= buffers.front()->size()) {
+        sent -= buffers.front()->size();
+        buffers.pop_front();
+    }
+}
 
-    std::unique_lock peerLock(peer.mMutex);
-    lock.unlock();
+bool P2P::decodePeer(Peer& peer, size_t size) {
+    //Packet on already connected peer
+    mLog.t("Packet on connected peer (size {})", size);
 
     auto& unp = peer.mUnpacker;
-    unp.reserve_buffer(kUpackBuffer);
-    int valread = -1;
-    if ((valread = read(fd, unp.buffer(), kUpackBuffer)) <= 0){
-        if (valread < 0) {
-            mLog.w("Socket returned {}", valread);
-        }
-        peerLock.unlock();
-        removePeer(fd);
-    } else {
-        //Packet on already connected peer
-        mLog.t("Packet on connected peer (size {})", valread);
-
-        unp.buffer_consumed(valread);
-        msgpack::object_handle result;
-        // Message pack data loop, only one, since it may be destroyed afterwards
-        if (unp.next(result)) {
-            msgpack::object obj(result.get());
-            
+    unp.buffer_consumed(size);
+    msgpack::object_handle result;
+    // Decode all the complete messages, the handlers do not remove
+    //  the peer, they mark it and we remove it afterwards
+    try {
+        auto pending = unp.nonparsed_size();
+        while (!peer.mClosing && unp.next(result)) {
             // New object received, parse it to the peer processor
-            decodeMsg(peer, obj);
+            decodeMsg(peer, result.get(), pending - unp.nonparsed_size());
+            pending = unp.nonparsed_size();
         }
+        // Not buffered forever waiting for the rest
+        if (pending > Msg::kMaxSize)
+            throw std::length_error(fmt::format("incomplete message of {} bytes", pending));
+    } catch (const std::exception& e) {
+        mLog.w("{} sent an invalid message: {}", peer, e.what());
+        peer.mClosing = true;
     }
+    return !peer.mClosing;
 }
 
-void P2P::handleEvents() {
-    Event ev;
-    readThreadEventData(ev);
+void P2P::handleEvents(Reactor& reactor) {
+    uint64_t count;
+    if (read(reactor.mEventFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        mLog.e("Error reading thread event {}", errno);
+    reactor.mWakePending = false;
+
+    // All the commands sent until now, in one go
+    auto handle = [&](ThreadEvent& event){
+        handleEvent(reactor, event);
+        // The slot is not overwritten until the queue wraps
+        event.mPacked.reset();
+    };
+    while (reactor.mRunning && reactor.mEvents.tryPop(handle)) {}
+    if (reactor.mHasOverflow) {
+        std::deque<ThreadEvent> overflow;
+        {
+            std::unique_lock lock(reactor.mOverflowMutex);
+            overflow.swap(reactor.mOverflow);
+            reactor.mHasOverflow = false;
+        }
+        for (auto& event : overflow) {
+            if (reactor.mRunning)
+                handleEvent(reactor, event);
+        }
+    }
+}
+
+void P2P::handleEvent(Reactor& reactor, const ThreadEvent& event) {
+    auto ev = event.mEvent;
     switch(ev) {
         default:
             mLog.e("unknown event received {}", ev);
         case SHUTDOWN:
             mLog.d("Event received {}", ev);
-            mRunning = false;
+            reactor.mRunning = false;
             break;
         case PEER_WELCOME: {
-            int fd;
-            readThreadEventData(fd);
-            std::unique_lock<std::recursive_mutex> lock(mPeersMutex);
-            auto it = mPeers.find(fd);
-            if (it != mPeers.end()) {
-                sendMsg_PeerInfo(it->second);
-                sendMsg_Discovery(it->second);
+            std::unique_lock<std::recursive_mutex> lock;
+            if (auto peer = mPeers.lock(event.mFd, lock, event.mGeneration)) {
+                sendMsg_PeerInfo(*peer);
+                sendMsg_Discovery(*peer);
             }
             break;
         }
-        case PEER_CLOSE: {
-            int fd;
-            readThreadEventData(fd);
-            mLog.d("Closing connection with {}", fd);
-            removePeer(fd);
+        case PEER_NEW: {
+            std::unique_lock<std::recursive_mutex> lock;
+            auto peer = mPeers.lock(event.mFd, lock, event.mGeneration);
+            if (peer && !peer->mChannel)
+                uringOpen(reactor, *peer);
             break;
         }
-        case TRY_CONNECT: {
-            std::random_device random_device;
-            std::mt19937 engine{random_device()};
-            while (getNumClients() < kTargetNumPeers && mAddressPool.size() > 0) {
-                std::uniform_int_distribution<int> dist(0, mAddressPool.size() - 1);
-                int idx = dist(engine);
-                aConnect(mAddressPool[idx]);
-                mAddressPool[idx].swap(mAddressPool.back());
-                mAddressPool.resize(mAddressPool.size()-1);
+        case CONNECT_NEW:
+            watchConnect(reactor, event.mFd);
+            break;
+        case PEER_SEND: {
+            std::unique_lock<std::recursive_mutex> lock;
+            if (auto peer = mPeers.lock(event.mFd, lock, event.mGeneration))
+                uringFlush(reactor, *peer);
+            break;
+        }
+        case PEER_BROADCAST: {
+            // Any reactor, the peer lock is the only one taken
+            std::unique_lock<std::recursive_mutex> lock;
+            auto peer = mPeers.lock(event.mFd, lock, event.mGeneration);
+            if (!peer || (!peer->mReady && event.mReadyOnly) || peer->mClosing)
+                break;
+            if (event.mUnknown && !peer->mKnown.insert(*event.mUnknown))
+                break;
+            queueMsg(*peer, event.mPacked);
+            break;
+        }
+        case PEER_CLOSE: {
+            // Only if it is still the same connection, the fd could be reused
+            std::unique_lock<std::recursive_mutex> lock;
+            if (mPeers.lock(event.mFd, lock, event.mGeneration)) {
+                mLog.d("Closing connection with {}", event.mFd);
+                removePeer(event.mFd);
             }
             break;
         }
+        case TRY_CONNECT:
+            tryConnect();
+            break;
     }
 }
 
-void P2P::epollCtl(int op, int fd, uint32_t ev, int data) {
+void P2P::epollCtl(Reactor& reactor, int op, int fd, uint32_t ev, int data) {
     struct epoll_event event;
     event.events = ev;
     event.data.fd = data;
-    epoll_ctl(mEpollFd, op, fd, &event);
+    epoll_ctl(reactor.mEpollFd, op, fd, &event);
 }
 
-void P2P::threadLoop(void) {
-    mLog.t("thread created");
-
-    // Add Main Socket and Event Fd
-    epollCtl(EPOLL_CTL_ADD, mMainSocket, EPOLLIN, -1);
-    epollCtl(EPOLL_CTL_ADD, mEventPipe[0], EPOLLIN, -2);
-
-    // Main loop
-    while (mRunning) {
-        struct epoll_event event;
-        if(epoll_wait(mEpollFd, &event, 1, -1) == -1){
+void P2P::threadLoop(Reactor& reactor) {
+    if (isUring(reactor))
+        return threadLoopUring(reactor);
+    mLog.t("thread {} created", reactor.mId);
+
+    // Main loop, attend all the ready fds of each wake up
+    std::vector<struct epoll_event> events(std::max(mMaxEpollEvents, 1));
+    while (reactor.mRunning) {
+        // Wakes up for the connection attempts timing out, the pings and
+        //  the requests
+        int timeout = connectTimeout(reactor);
+        timeout = timeout < 0 ? pingTimeout(reactor) : std::min(timeout, pingTimeout(reactor));
+        int num = epoll_wait(reactor.mEpollFd, events.data(), events.size(), timeout);
+        if (num == -1) {
+            if (errno == EINTR)
+                continue;
             mLog.e("epoll error {}", errno);
             break;
         }
 
-        // We have been woken, check what to attend
-        if (event.data.fd == -2) {
-            // Event socket
-            handleEvents();
-        } else if (event.data.fd == -1){
-            //Process the main socket socket that has data
-            newPeer(event);
-        } else {
-            // Serve this socket
-            servePeer(event.data.fd);
+        for (int i = 0; i < num && reactor.mRunning; i++) {
+            auto& event = events[i];
+            if (event.data.fd == -2) {
+                // Event socket
+                handleEvents(reactor);
+            } else if (event.data.fd == -1){
+                //Process the listen socket that has data
+                newPeer(reactor);
+            } else if (event.data.fd <= kConnectData) {
+                // Connection attempt finished
+                connectDone(reactor, kConnectData - event.data.fd, 0);
+            } else {
+                // Serve this socket, first the queue it can take now
+                if (event.events & EPOLLOUT)
+                    writePeer(reactor, event.data.fd);
+                if (event.events & ~EPOLLOUT)
+                    servePeer(reactor, event.data.fd);
+            }
         }
+        expireConnects(reactor);
+        expireRequests();
+        if (std::chrono::steady_clock::now() >= reactor.mNextPing)
+            pingPeers(reactor);
     }
-
-    //Stop epoll & Pipes
-    close(mEpollFd);
-    close(mEventPipe[0]);
-    close(mEventPipe[1]);
-
-    //Stop all sockets
-    {
-        std::unique_lock lock(mPeersMutex);
-        for(auto& i : mPeers){
-            close(i.first);
+    reactor.mRunning = false;
+
+    //Stop all the sockets of this reactor, the rest of fds are
+    //  closed once all the reactors stop
+    expireConnects(reactor, true);
+    mPeers.forEach([&](Peer& peer){
+        if (peer.mReactor == reactor.mId) {
+            auto fd = peer.mFd;
+            mPeers.erase(peer);
+            close(fd);
         }
-        mPeers.clear();
-    }
+    });
 
-    close(mMainSocket);
-    mMainSocket = -1;
+    mLog.t("thread {} stopped", reactor.mId);
+}
 
-    mLog.t("thread stopped");
+P2P::Backend P2P::getBackend(){
+    std::unique_lock lock(mThreadMutex);
+    if (!mReactors.empty() && isUring(*mReactors.front()))
+        return Backend::URING;
+    return Backend::EPOLL;
 }
 
 int P2P::getNumClients(){
-    std::unique_lock lock(mPeersMutex);
-
     return mPeers.size();
 }
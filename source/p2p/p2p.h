@@ -2,17 +2,28 @@
 
 #include <vector>
 #include <list>
-#include <map>
 #include <mutex>
 #include <atomic>
 #include <thread>
 #include <netdb.h>
-#include <future>
+#include <sys/socket.h>
+#include <chrono>
 #include <functional>
+#include <memory>
+#include <deque>
+#include <optional>
+#include <random>
+#include <string_view>
+#include <unordered_map>
 
 #include "common/nocopyormove.h"
+#include "common/mpsc_queue.h"
 #include "core/log.h"
 #include "peer.h"
+#include "address_manager.h"
+#include "peer_table.h"
+#include "seen_set.h"
+#include "uring.h"
 
 class P2P : private NoCopyOrMove {
 public:
@@ -22,12 +33,51 @@ public:
         PEER_WELCOME, // When the thread needs to greet a new peer
         PEER_CLOSE, // When we have to close a connection with a peer
         TRY_CONNECT, // When we have new addresses and might want to connect
+        PEER_NEW, // When a peer connected by another thread has to be served
+        PEER_SEND, // When another thread queued messages to a peer (io_uring)
+        CONNECT_NEW, // When a connection attempt has to be watched
+        PEER_BROADCAST, // When a broadcast found the peer busy in another thread
 
         NEW_BLOCK,
         NEW_TX,
         // ...
     };
 
+    // How the reactors do the socket I/O
+    enum class Backend {
+        EPOLL, // epoll and a syscall per read/write
+        URING, // io_uring, falls back to EPOLL if the kernel lacks it
+    };
+
+    // What to do with a peer that does not read what we send
+    enum class SlowPeer {
+        DISCONNECT, // Close the connection
+        THROTTLE, // Stop reading from it until it catches up
+    };
+
+    // Which peers a broadcast goes to
+    struct BroadcastFilter {
+        const Peer* mExclude = nullptr; // Usually the one it came from
+        bool mReadyOnly = true; // Only the ones that sent their PeerInfo
+        // Only the ones that do not know this item, then they do
+        const Msg::Hash* mUnknown = nullptr;
+    };
+
+    // Fan-out of a broadcast, the same mBytes are queued to every peer
+    struct BroadcastStats {
+        size_t mBytes = 0;
+        unsigned mQueued = 0;
+        unsigned mDeferred = 0; // Queued by a reactor, busy when sent
+        unsigned mFiltered = 0;
+    };
+
+    // Called once with each new item received, from the reactor threads.
+    //  It checks the data (its hash), only the valid ones are stored and
+    //  relayed, the peers sending invalid ones are banned. Without it,
+    //  all are taken as valid
+    typedef std::function<bool(const Msg::Item&, std::string_view data)> ItemCallback;
+    ItemCallback mOnItem;
+
     // Callbacks can be added any time (with mutex hold)
     typedef std::function<bool(Event)> Callback;
     std::list<Callback> mCallbacks;
@@ -38,60 +88,276 @@ public:
     static constexpr auto kListenQueueLen = 10;
     static constexpr auto kDefaultListenPort = 11250;
     static constexpr auto kUpackBuffer = 4096;
+    static constexpr size_t kReadBudget = 16 * kUpackBuffer; // Per peer and wake up
+    static constexpr auto kMaxEpollEvents = 64;
+    static constexpr auto kMaxIovecs = 64;
+    static constexpr size_t kSendHighWater = 1024 * 1024;
+    static constexpr auto kMaxConnecting = 8;
+    static constexpr auto kConnectTimeout = std::chrono::seconds(5);
+    static constexpr auto kEventQueueLen = 1024;
+    static constexpr auto kUringEntries = 256;
+    static constexpr auto kUringRecvSlots = 128; // kUpackBuffer each
+    static constexpr size_t kSeenItems = 64 * 1024; // Per generation of the seen-set
+    static constexpr size_t kMaxRequested = 4096;
+    // Asked to one peer at once, so one can not take all of kMaxRequested
+    static constexpr size_t kMaxRequestedPerPeer = 256;
+    static constexpr size_t kMaxAnnouncers = 8; // Kept per requested item
+    static constexpr size_t kStoredBytes = 64 * 1024 * 1024; // Data served to GET_DATA
+    static constexpr auto kFetchTimeout = std::chrono::seconds(2);
+    static constexpr auto kMinFetchTimeout = std::chrono::milliseconds(250);
+    static constexpr auto kPingInterval = std::chrono::seconds(10);
+    static constexpr auto kPingTimeout = std::chrono::seconds(30);
+    static constexpr auto kMaxPeers = 2 * kTargetNumPeers;
     static const std::vector<std::string> kBootStrap;
 
     int mListenPort = 11250;
+    // Number of event loop threads, 0 is one per core
+    unsigned mNumReactors = 0;
+    Backend mBackend = Backend::EPOLL;
+    // Bytes queued to a peer before it is considered slow
+    size_t mSendHighWater = kSendHighWater;
+    SlowPeer mSlowPeer = SlowPeer::DISCONNECT;
+    // Outgoing connections in progress at once, the rest wait in the pool
+    int mMaxConnecting = kMaxConnecting;
+    std::chrono::milliseconds mConnectTimeout = kConnectTimeout;
+    // Ready fds taken from epoll per wake up, at least 1
+    int mMaxEpollEvents = kMaxEpollEvents;
     std::vector<std::string> mBootStrap = kBootStrap;
-    std::vector<std::string> mAddressPool; //Mutex?
+    // Every peer is pinged each mPingInterval, the ones that do not
+    //  answer in mPingTimeout are closed
+    std::chrono::milliseconds mPingInterval = kPingInterval;
+    std::chrono::milliseconds mPingTimeout = kPingTimeout;
+    // The items are waited for at most mFetchTimeout from a peer, then
+    //  the others that announced them are asked
+    std::chrono::milliseconds mFetchTimeout = kFetchTimeout;
+    // Over it, the peer with the highest round trip time is rotated out
+    //  at each ping
+    int mMaxPeers = kMaxPeers;
+    // The addresses that connected are kept there for the next start,
+    //  empty to keep them only in memory
+    std::string mAddressFile;
+    AddressManager mAddresses;
 
-    std::recursive_mutex mPeersMutex;
-    std::map<int, Peer> mPeers;
+    PeerTable mPeers;
     Msg::PeerInfo mOwnPeerInfo = {};
 
 private:
     static std::atomic<int> mUID;
     Log mLog = Log(Log::Type::P2P);
 
-    int mMainSocket = -1;
-    int mEventPipe[2] = {};
-    int mEpollFd = -1;
+    // io_uring state of a peer. It outlives the peer until the
+    //  operations using it complete, so it is not part of Peer
+    struct Channel {
+        int mFd;
+        bool mOpen = true;
+        int mRecvSlot = -1; // Registered buffer of the read in flight
+        bool mWaitingSlot = false;
+        bool mReadStopped = false; // Throttled
+        // Taken from the peer queue, all in flight in one request
+        std::deque<Msg::Packed> mSending;
+        size_t mSent = 0; // Of the front one
+        struct iovec mIovecs[kMaxIovecs];
+        struct msghdr mMsg;
+    };
+
+    // Gossip state, the peer locks can be taken before it, not after
+    struct Announcer {
+        int mFd;
+        uint32_t mGeneration;
+        std::chrono::microseconds mRtt; // 0 if unknown
+    };
+    struct Request : Announcer {
+        std::chrono::steady_clock::time_point mSent;
+        std::chrono::steady_clock::time_point mDeadline; // Then the others are asked
+        bool mChecking = false; // Received, mOnItem is checking it
+        Msg::Item::Kind mKind = {};
+        // The others that announced it meanwhile, asked if it is invalid
+        std::vector<Announcer> mOthers = {};
+    };
+    std::mutex mInventoryMutex;
+    SeenSet mSeen{kSeenItems, 32};
+    std::unordered_map<Msg::Hash, Request, Msg::HashOf> mRequested;
+    // How many of them each announcer has, by announcerKey()
+    std::unordered_map<uint64_t, size_t> mRequestsOf;
+    // The earliest deadline of them, read by the reactors without the lock
+    std::atomic<std::chrono::steady_clock::time_point> mNextExpiry = std::chrono::steady_clock::time_point::max();
+    std::unordered_map<Msg::Hash, Msg::Packed, Msg::HashOf> mStored;
+    std::deque<Msg::Hash> mStoredOrder; // Oldest first, evicted first
+    size_t mStoredBytes = 0;
+
+    // epoll data of the connection attempts, kConnectData - slot
+    static constexpr int kConnectData = -3;
+
+    // A command for a reactor thread
+    struct ThreadEvent {
+        Event mEvent;
+        int mFd;
+        uint32_t mGeneration; // Of the peer, stale ones are dropped
+        Msg::Packed mPacked = {}; // PEER_BROADCAST
+        bool mReadyOnly = false;
+        std::optional<Msg::Hash> mUnknown = {};
+    };
+
+    // Outgoing connection in progress, a slot of the reactor table
+    struct Connect {
+        int mFd = -1; // Free slot
+        std::string mAddress;
+        struct sockaddr_in mAddr;
+        std::chrono::steady_clock::time_point mStart;
+        std::chrono::steady_clock::time_point mDeadline;
+        struct __kernel_timespec mTimeout; // io_uring
+    };
+
+    // An event loop thread, with its own listen socket on the same port
+    //  (SO_REUSEPORT, the kernel spreads the incoming connections), epoll
+    //  and event queue. A peer is always served by the same reactor
+    struct Reactor {
+        int mId;
+        int mListenSocket = -1;
+        int mEpollFd = -1;
+
+        // Commands from any thread, with a single eventfd wake up for
+        //  all the ones sent before the reactor drains them
+        MpscQueue<ThreadEvent> mEvents{kEventQueueLen};
+        int mEventFd = -1;
+        std::atomic<bool> mWakePending = false;
+        // Only used if the queue is full
+        std::mutex mOverflowMutex;
+        std::deque<ThreadEvent> mOverflow;
+        std::atomic<bool> mHasOverflow = false;
+
+        bool mRunning = false; // Only used by its thread
+        std::thread mThread;
 
-    std::mutex mTasksMutex;
-    std::list<std::future<int>> mTasks;
+        // Its peers are pinged from its thread
+        std::chrono::steady_clock::time_point mNextPing;
+        std::mt19937_64 mRandom{std::random_device()()}; // Ping nonces
+        struct __kernel_timespec mPingTimer; // io_uring
+        // When the armed one expires, io_uring
+        std::chrono::steady_clock::time_point mTimerDeadline;
+
+        // Filled by any thread, watched by the reactor
+        std::mutex mConnectMutex;
+        std::vector<Connect> mConnects;
+        std::vector<unsigned> mFreeConnects;
+
+        // io_uring backend, only used from its thread
+        Uring mUring;
+        bool mMultishotAccept = true;
+        bool mFixedBuffers = false;
+        std::vector<char> mRecvBuffers; // Registered, one slot per read
+        std::vector<unsigned> mFreeSlots;
+        std::deque<uint64_t> mSlotWaiters;
+        std::unordered_map<uint64_t, Channel> mChannels;
+        uint64_t mNextChannel = 1;
+        unsigned mInFlight = 0; // Requests the kernel still has
+    };
+    std::mutex mReactorsMutex; // Growing and clearing the list
+    std::vector<std::unique_ptr<Reactor>> mReactors;
+    std::atomic<unsigned> mNextReactor = 0;
+    std::atomic<int> mConnecting = 0;
 
     std::atomic<bool> mRunning = false;
-    std::thread mThread;
     std::mutex mThreadMutex;
 
-    void threadLoop(void);
+    bool openReactor(Reactor& reactor, const struct addrinfo* addr);
+    void closeReactor(Reactor& reactor);
+    void threadLoop(Reactor& reactor);
+
+    // io_uring backend (p2p_uring.cpp)
+    bool openUring(Reactor& reactor);
+    void threadLoopUring(Reactor& reactor);
+    bool isUring(const Reactor& reactor) const {return reactor.mUring.isOpen();}
+    void uringAccept(Reactor& reactor);
+    void uringPollEvents(Reactor& reactor);
+    void uringPingTimer(Reactor& reactor);
+    void uringConnect(Reactor& reactor, unsigned slot);
+    void uringOpen(Reactor& reactor, Peer& peer);
+    void uringClose(Reactor& reactor, Peer& peer);
+    void uringFlush(Reactor& reactor, Peer& peer);
+    void uringRead(Reactor& reactor, uint64_t id, Channel& channel);
+    void uringSend(Reactor& reactor, uint64_t id, Channel& channel);
+    void uringComplete(Reactor& reactor, const io_uring_cqe& cqe);
+    void uringReadDone(Reactor& reactor, uint64_t id, unsigned slot, int res);
+    void uringSendDone(Reactor& reactor, uint64_t id, int res);
+    void freeSlot(Reactor& reactor, unsigned slot);
 
     // Private functions called by thread loop
-    void servePeer(int fd);
-    Peer& insertPeer(const sockaddr_in& sockaddr, int sock, const Peer::Direction& dir);
+    void servePeer(Reactor& reactor, int fd);
+    Peer* insertPeer(Reactor& reactor, const sockaddr_in& sockaddr, int sock, const Peer::Direction& dir);
     void removePeer(int fd);
     void removePeer(const Peer& peer);
-    void newPeer(struct epoll_event& ev);
-
-    void handleEvents();
-    void epollCtl(int op, int fd, uint32_t ev, int data);
-    void sendThreadEvent(const Event& ev);
-    template<class T>
-    void sendThreadEventData(const T& data){
-        if(sizeof(data) != write(mEventPipe[1], &data, sizeof(data)))
-            mLog.e("sendThreadEventData failed {}", data);
-    }
-    template<class T>
-    void readThreadEventData(T& data){
-        if(sizeof(data) != read(mEventPipe[0], &data, sizeof(data)))
-            mLog.e("readThreadEventData failed {}", data);
-    }
+    void newPeer(Reactor& reactor);
+    void acceptPeer(Reactor& reactor, int sock, const sockaddr_in& addr);
+    bool decodePeer(Peer& peer, size_t size);
 
-    void decodeMsg(Peer& peer, const msgpack::object& obj);
-    void decodeMsg_Discovery(Peer& peer, const Msg::Discovery& msg);
-    void decodeMsg_PeerInfo(Peer& peer, const Msg::PeerInfo& msg);
-    void decodeMsg_Disconnect(Peer& peer, const Msg::Disconnect& msg);
+    void watchConnect(Reactor& reactor, unsigned slot);
+    void connectDone(Reactor& reactor, unsigned slot, int error);
+    void expireConnects(Reactor& reactor, bool all = false);
+    // Connects to the best known addresses, up to the limits
+    void tryConnect();
+    // Connects to an address taken from mAddresses, false if it failed
+    //  for a local reason, so would the next ones
+    bool dial(const std::string& address);
+    int connectTimeout(Reactor& reactor);
+    // Pings its peers, closes the ones that did not answer, and rotates
+    //  out the slowest one if there are too many
+    void pingPeers(Reactor& reactor);
+    // Until the next ping or expired request, in ms
+    int pingTimeout(Reactor& reactor);
 
-    void sendMsg(Peer& peer, const msgpack::object& obj);
+    void writePeer(Reactor& reactor, int fd);
+    void flushPeer(Peer& peer);
+    void updateEvents(Peer& peer);
+    void checkSlowPeer(Peer& peer);
+    static size_t toIovecs(const std::deque<Msg::Packed>& buffers, size_t sent, struct iovec* iov, size_t max);
+    static void consume(std::deque<Msg::Packed>& buffers, size_t& sent, size_t bytes);
+
+    void handleEvents(Reactor& reactor);
+    void handleEvent(Reactor& reactor, const ThreadEvent& event);
+    void epollCtl(Reactor& reactor, int op, int fd, uint32_t ev, int data);
+    void sendThreadEvent(Reactor& reactor, Event ev, int fd = -1, uint32_t generation = PeerTable::kAnyGeneration);
+    void sendThreadEvent(Reactor& reactor, ThreadEvent&& event);
+    void sendThreadEvent(const Peer& peer, Event ev);
+
+    void decodeMsg(Peer& peer, const msgpack::object& obj, size_t size);
+    // Handlers of the received messages, one per Msg::Payload::Recv
+    void onMsg(Peer& peer, const Msg::DiscoveryView& msg);
+    void onMsg(Peer& peer, const Msg::PeerInfo& msg);
+    void onMsg(Peer& peer, const Msg::DisconnectView& msg);
+    void onMsg(Peer& peer, const Msg::Inventory& msg);
+    void onMsg(Peer& peer, const Msg::GetData& msg);
+    void onMsg(Peer& peer, const Msg::DataView& msg);
+    void onMsg(Peer& peer, const Msg::Ping& msg);
+    void onMsg(Peer& peer, const Msg::Pong& msg);
+    // Its address is never connected to again
+    void banPeer(const Peer& peer);
+
+    // How long a GET_DATA to the peer is waited for, shorter the faster
+    //  it answers the pings
+    std::chrono::microseconds fetchTimeout(const Peer& peer) const;
+    // Asks the fastest of the others for an item a peer sent invalid,
+    //  did not send in time or disconnected, with mInventoryMutex
+    void refetchItem(const Msg::Item& item, std::vector<Announcer> others);
+    // With mInventoryMutex, they keep mRequestsOf and mNextExpiry
+    void addRequest(const Msg::Hash& hash, Request request);
+    decltype(mRequested)::iterator eraseRequest(decltype(mRequested)::iterator it);
+    static uint64_t announcerKey(const Announcer& a) {return (uint64_t(a.mFd) << 32) | a.mGeneration;}
+    // The requests past their deadline go to the others, from the reactors
+    void expireRequests();
+    // The requests to a closed peer go to the others, it is not asked again
+    void forgetAnnouncer(const Peer& peer);
+    // With mInventoryMutex
+    void storeItem(const Msg::Hash& hash, Msg::Packed packed);
+    // Announces it to the peers that do not know it
+    void relayItem(const Msg::Item& item, const Peer* origin);
+
+    // Packs a registered payload (Msg::Payload::Send) and queues it
+    template <class T>
+    void sendMsg(Peer& peer, const T& payload) {
+        queueMsg(peer, Msg::pack(payload));
+    }
+    void queueMsg(Peer& peer, Msg::Packed packed);
     void sendMsg_PeerInfo(Peer& peer);
     void sendMsg_Discovery(Peer& peer);
     void sendMsg_Disconnect(Peer& peer, const Msg::Disconnect::Reason& r=Msg::Disconnect::Reason::UNKNOWN, const std::string& text = {});
@@ -103,8 +369,31 @@ public:
     bool start();
     void stop();
 
+    // Serializes the payload once and queues the same buffer to every
+    //  peer that passes the filter. It can be called from any thread,
+    //  a handler holding a peer lock included
+    template <class T>
+    BroadcastStats broadcast(const T& payload, const BroadcastFilter& filter) {
+        return broadcast(Msg::pack(payload), filter);
+    }
+    template <class T>
+    BroadcastStats broadcast(const T& payload) {
+        return broadcast(Msg::pack(payload), BroadcastFilter());
+    }
+    BroadcastStats broadcast(Msg::Packed packed, const BroadcastFilter& filter);
+
+    // Stores a new item and announces it to the peers that do not know
+    //  it, the ones that did not see it fetch it. False if seen already
+    bool announce(const Msg::Item& item, std::string_view data);
+
+    // Adds it to the known addresses, and connects to the best ones
     void aConnect(const std::string& address);
+    // Starts the connection, the reactor completes it. 0 if started,
+    //  -1 no socket, -2 invalid address, -3 refused at once, -4 not
+    //  running, -5 too many attempts
     int connect(const std::string& address);
     bool isRunning() {return mRunning;};
+    // The one really used, after start
+    Backend getBackend();
     int getNumClients();
 };
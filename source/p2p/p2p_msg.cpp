@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <string.h> // memset()
+#include <algorithm>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -14,49 +15,68 @@
 #include "p2p/msg.h"
 #include "core/log.h"
 
-void P2P::decodeMsg(Peer& peer, const msgpack::object& obj){
-    Msg::Any any = obj.convert();
-    auto& data = any.data;
-    auto name = magic_enum::enum_name(any.type);
-
-    #define DECODE(ty, o, f) \
-        case ty: { o m = data.convert(); \
-            mLog.t("{} msg recv {}", name, m); \
-            f(peer, m); \
-        }; break;
-
-    switch(any.type){
-        DECODE(Msg::Type::PEER_INFO, Msg::PeerInfo, decodeMsg_PeerInfo);
-        DECODE(Msg::Type::DISCOVERY, Msg::Discovery, decodeMsg_Discovery);
-        DECODE(Msg::Type::DISCONNECT, Msg::Disconnect, decodeMsg_Disconnect);
-    }
+void P2P::decodeMsg(Peer& peer, const msgpack::object& obj, size_t size){
+    // The registry jump table picks the payload, the overload its handler
+    Msg::decode(obj, size, [&](const auto& m){
+        mLog.t("msg recv {}", m);
+        onMsg(peer, m);
+    });
 }
-void P2P::decodeMsg_Discovery(Peer& peer, const Msg::Discovery& msg){
-    // Add addresses to the pool
-    for (auto& addr : msg.mAddresses) {
-        mAddressPool.emplace_back(addr);
-    }
-    sendThreadEvent(TRY_CONNECT);
+void P2P::onMsg(Peer& peer, const Msg::DiscoveryView& msg){
+    // Known ones and the ones of full subnets are dropped
+    for (auto& addr : msg.mAddresses)
+        mAddresses.add(addr);
+    sendThreadEvent(peer, TRY_CONNECT);
 }
 
-void P2P::decodeMsg_Disconnect(Peer& peer, const Msg::Disconnect& msg){
+void P2P::onMsg(Peer& peer, const Msg::DisconnectView& msg){
     // Add addresses to the pool
     mLog.e("{} disconnected due to {}", peer, msg);
-    removePeer(peer.mFd);
+    peer.mClosing = true;
+    // It has enough faster peers, not dialed again until a backoff
+    if (msg.mReason == Msg::Disconnect::Reason::ROTATING && peer.mDirection == Peer::Direction::OUT)
+        mAddresses.failed(fmt::format("{}:{}", peer.mConAddress, peer.mConPort));
+}
+
+void P2P::onMsg(Peer& peer, const Msg::Ping& msg){
+    sendMsg(peer, Msg::Pong{msg.mNonce, msg.mTime});
+}
+
+void P2P::onMsg(Peer& peer, const Msg::Pong& msg){
+    if (peer.mPingNonce == 0 || msg.mNonce != peer.mPingNonce) {
+        mLog.d("{} sent a pong of another ping", peer);
+        return;
+    }
+    peer.mPingNonce = 0;
+    // From our own send time, the echoed mTime is the peer's to choose
+    auto rtt = std::max(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - peer.mPingSent), std::chrono::microseconds(1));
+    // RFC 6298, the deviation is updated with the previous average
+    if (peer.mRtt.count() == 0) {
+        peer.mRtt = rtt;
+        peer.mJitter = rtt / 2;
+    } else {
+        auto delta = rtt > peer.mRtt ? rtt - peer.mRtt : peer.mRtt - rtt;
+        peer.mJitter = (3 * peer.mJitter + delta) / 4;
+        peer.mRtt = (7 * peer.mRtt + rtt) / 8;
+    }
+    mLog.t("{} answered in {}us", peer, rtt.count());
 }
 
-void P2P::decodeMsg_PeerInfo(Peer& peer, const Msg::PeerInfo& msg){
+void P2P::onMsg(Peer& peer, const Msg::PeerInfo& msg){
     // Inmediately remove the peer, do not let more msg from coming from it
     // Check the peer is connected on the same network
     if (msg.mNetID != mOwnPeerInfo.mNetID) {
         mLog.w("Client not of the same network {} != {}", msg.mNetID, mOwnPeerInfo.mNetID);
         // TODO: Send reason for disconnect
         sendMsg_Disconnect(peer, Msg::Disconnect::Reason::WRONG_NETWORK);
-        removePeer(peer.mFd);
+        peer.mClosing = true;
+        banPeer(peer);
     }
     else if (msg.mUID == mOwnPeerInfo.mUID) {
         mLog.d("{} is likely ourselve, discarding {}", peer, msg.mUID);
-        removePeer(peer.mFd);
+        peer.mClosing = true;
+        banPeer(peer);
     } else {
         // The peer info is valid, set it
         peer.mName = msg.mName;
@@ -65,51 +85,328 @@ void P2P::decodeMsg_PeerInfo(Peer& peer, const Msg::PeerInfo& msg){
         peer.mNetID = msg.mNetID;
         peer.mUID = msg.mUID;
 
-        // Then send our welcome pack as well (PEER_INFO + DISCOVERY)
-        if (!peer.mReady && peer.mDirection == Peer::Direction::IN) {
-            peer.mReady = true;
-            sendThreadEvent(PEER_WELCOME);
-            sendThreadEventData(peer.mFd);
-        }
+        // Then send our welcome pack as well (PEER_INFO + DISCOVERY),
+        //  the outbound ones sent ours when connecting
+        if (!peer.mReady && peer.mDirection == Peer::Direction::IN)
+            sendThreadEvent(peer, PEER_WELCOME);
+        peer.mReady = true;
     }
 }
 
-void P2P::sendMsg(Peer& peer, const msgpack::object& obj){
+void P2P::banPeer(const Peer& peer){
+    // The address we connected to, the port of the others is not known
+    if (peer.mDirection == Peer::Direction::OUT)
+        mAddresses.ban(fmt::format("{}:{}", peer.mConAddress, peer.mConPort));
+}
+
+void P2P::queueMsg(Peer& peer, Msg::Packed packed){
     std::unique_lock<std::recursive_mutex> lock(peer.mMutex);
-    msgpack::sbuffer packed;
-    msgpack::pack(&packed, obj);
-    if (packed.size() != write(peer.mFd, packed.data(), packed.size())) {
-        mLog.e("Error sending to socket on {}", peer);
-    }
+    if (peer.mClosing)
+        return;
+    // Never blocks, what the socket does not take stays queued
+    peer.mOutboundBytes += packed->size();
+    peer.mOutbound.emplace_back(std::move(packed));
+    flushPeer(peer);
 }
 
 void P2P::sendMsg_PeerInfo(Peer& peer){
-    msgpack::zone z;
-    auto msg = msgpack::object(Msg::Any { Msg::Type::PEER_INFO, 
-        msgpack::object(Msg::PeerInfo {mOwnPeerInfo}, z) }, z);
-    mLog.t("Sending {}", Msg::PeerInfo {mOwnPeerInfo});
-    sendMsg(peer, msg);
+    mLog.t("Sending {}", mOwnPeerInfo);
+    sendMsg(peer, mOwnPeerInfo);
 }
 void P2P::sendMsg_Disconnect(Peer& peer, const Msg::Disconnect::Reason& r, const std::string& text){
-    msgpack::zone z;
-    auto msg = msgpack::object(Msg::Any { Msg::Type::DISCONNECT, 
-        msgpack::object(Msg::Disconnect {r, text}, z) }, z);
-    mLog.t("Sending {}", Msg::Disconnect {r, text});
+    Msg::Disconnect msg {r, text};
+    mLog.t("Sending {}", msg);
     sendMsg(peer, msg);
 }
+P2P::BroadcastStats P2P::broadcast(Msg::Packed packed, const BroadcastFilter& filter){
+    BroadcastStats stats;
+    stats.mBytes = packed->size();
+    auto selected = [&](const Peer& p){
+        return &p != filter.mExclude && (p.mReady || !filter.mReadyOnly) && !p.mClosing
+            && !(filter.mUnknown && p.mKnown.contains(*filter.mUnknown));
+    };
+    // The peers busy in other threads are sent by a reactor, this one
+    //  could hold the lock they are waiting for
+    std::vector<int> busy;
+    mPeers.forEach([&](Peer& p){
+        if (!selected(p)) {
+            stats.mFiltered++;
+            return;
+        }
+        queueMsg(p, packed);
+        if (filter.mUnknown)
+            p.mKnown.insert(*filter.mUnknown);
+        stats.mQueued++;
+    }, [&](Peer& p, int fd){
+        if (&p == filter.mExclude)
+            stats.mFiltered++;
+        else
+            busy.push_back(fd);
+    });
+    if (!busy.empty()) {
+        std::unique_lock lock(mReactorsMutex);
+        for (auto fd : busy) {
+            if (mReactors.empty())
+                break;
+            // Its generation can not be read unlocked, a new connection
+            //  with the same fd gets it too
+            auto& reactor = *mReactors[mNextReactor++ % mReactors.size()];
+            ThreadEvent event = {PEER_BROADCAST, fd, PeerTable::kAnyGeneration, packed, filter.mReadyOnly};
+            if (filter.mUnknown)
+                event.mUnknown = *filter.mUnknown;
+            sendThreadEvent(reactor, std::move(event));
+            stats.mDeferred++;
+        }
+    }
+    mLog.t("Broadcast {} bytes, {} queued, {} deferred, {} filtered", stats.mBytes, stats.mQueued, stats.mDeferred, stats.mFiltered);
+    return stats;
+}
+
+std::chrono::microseconds P2P::fetchTimeout(const Peer& peer) const {
+    // Unknown ones get the longest one, the items can be big
+    std::chrono::microseconds longest = mFetchTimeout;
+    if (peer.mRtt.count() == 0)
+        return longest;
+    auto timeout = 4 * (peer.mRtt + 4 * peer.mJitter);
+    return std::clamp<std::chrono::microseconds>(timeout, std::min<std::chrono::microseconds>(kMinFetchTimeout, longest), longest);
+}
+
+void P2P::onMsg(Peer& peer, const Msg::Inventory& msg){
+    // Each item is fetched from the first peer that announces it, the
+    //  others only if it does not send it in time. One that answers the
+    //  pings much faster takes it over once it would have sent it
+    Msg::GetData request;
+    auto now = std::chrono::steady_clock::now();
+    auto faster = [&](const Request& r){
+        return peer.mRtt.count() > 0 && (r.mRtt.count() == 0 || 4 * peer.mRtt < r.mRtt)
+            && now - r.mSent > 2 * peer.mRtt;
+    };
+    {
+        std::unique_lock lock(mInventoryMutex);
+        for (auto& item : msg.mItems) {
+            peer.mKnown.insert(item.mHash);
+            if (mSeen.contains(item.mHash))
+                continue;
+            auto it = mRequested.find(item.mHash);
+            auto isPeer = [&](const Announcer& a){ return a.mFd == peer.mFd && a.mGeneration == peer.mGeneration; };
+            if (it != mRequested.end() && (it->second.mChecking || (now < it->second.mDeadline && !faster(it->second)))) {
+                // The next ones to ask if it sends it invalid
+                auto& r = it->second;
+                if (!isPeer(r) && std::none_of(r.mOthers.begin(), r.mOthers.end(), isPeer) && r.mOthers.size() < kMaxAnnouncers)
+                    r.mOthers.push_back({peer.mFd, peer.mGeneration, peer.mRtt});
+                continue;
+            }
+            if (it == mRequested.end() && mRequested.size() >= kMaxRequested)
+                continue; // Asked to the next announcer, once some expire
+            auto asked = mRequestsOf.find(announcerKey({peer.mFd, peer.mGeneration, {}}));
+            if (asked != mRequestsOf.end() && asked->second >= kMaxRequestedPerPeer)
+                continue; // Its share is taken, maybe by fake ones
+            Request next = {{peer.mFd, peer.mGeneration, peer.mRtt}, now, now + fetchTimeout(peer)};
+            next.mKind = item.mKind;
+            if (it != mRequested.end()) {
+                // Taken over, the slow one is still asked if this one fails
+                next.mOthers = std::move(it->second.mOthers);
+                std::erase_if(next.mOthers, isPeer);
+                if (!isPeer(it->second) && next.mOthers.size() < kMaxAnnouncers)
+                    next.mOthers.push_back(it->second);
+            }
+            addRequest(item.mHash, std::move(next));
+            request.mItems.push_back(item);
+        }
+    }
+    if (request.mItems.empty())
+        return;
+    mLog.t("Sending {}", request);
+    sendMsg(peer, request);
+}
+
+void P2P::onMsg(Peer& peer, const Msg::GetData& msg){
+    std::vector<Msg::Packed> found;
+    {
+        std::unique_lock lock(mInventoryMutex);
+        for (auto& item : msg.mItems) {
+            auto it = mStored.find(item.mHash);
+            if (it != mStored.end())
+                found.push_back(it->second);
+        }
+    }
+    // Already packed, the same buffer for every peer that asks
+    for (auto& packed : found)
+        queueMsg(peer, std::move(packed));
+}
+
+void P2P::onMsg(Peer& peer, const Msg::DataView& msg){
+    auto& hash = msg.mItem.mHash;
+    {
+        std::unique_lock lock(mInventoryMutex);
+        auto it = mRequested.find(hash);
+        if (it == mRequested.end() || it->second.mChecking ||
+            it->second.mFd != peer.mFd || it->second.mGeneration != peer.mGeneration) {
+            mLog.d("{} sent {} without being asked", peer, msg.mItem);
+            return;
+        }
+        // Still requested while it is checked, nobody else is asked
+        it->second.mChecking = true;
+        it->second.mDeadline = std::chrono::steady_clock::time_point::max();
+    }
+
+    // Nothing is stored or relayed before it is checked, a peer could
+    //  poison an item for the whole network otherwise
+    bool valid = !mOnItem || mOnItem(msg.mItem, msg.mData);
+    {
+        std::unique_lock lock(mInventoryMutex);
+        auto it = mRequested.find(hash);
+        auto others = std::move(it->second.mOthers);
+        eraseRequest(it);
+        if (!valid) {
+            refetchItem(msg.mItem, std::move(others));
+        } else {
+            mSeen.insert(hash);
+            storeItem(hash, Msg::pack(Msg::Data{msg.mItem, std::string(msg.mData)}));
+        }
+    }
+    if (!valid) {
+        mLog.w("{} sent invalid data for {}", peer, msg.mItem);
+        sendMsg_Disconnect(peer, Msg::Disconnect::Reason::BLOCKING, "invalid data");
+        peer.mClosing = true;
+        banPeer(peer);
+        return;
+    }
+    relayItem(msg.mItem, &peer);
+}
+
+void P2P::refetchItem(const Msg::Item& item, std::vector<Announcer> others){
+    if (others.empty())
+        return; // Fetched when announced again
+    // The fastest one, the unknown ones last
+    auto best = std::min_element(others.begin(), others.end(), [](const Announcer& a, const Announcer& b){
+        return (a.mRtt.count() ? a.mRtt.count() : INT64_MAX) < (b.mRtt.count() ? b.mRtt.count() : INT64_MAX);
+    });
+    auto now = std::chrono::steady_clock::now();
+    Request request = {*best, now, now + mFetchTimeout};
+    request.mKind = item.mKind;
+    others.erase(best);
+    request.mOthers = std::move(others);
+    addRequest(item.mHash, request);
+
+    // We hold another peer lock, a reactor sends it
+    Msg::GetData msg {{item}};
+    mLog.t("Sending {} to Fd{}", msg, request.mFd);
+    std::unique_lock lock(mReactorsMutex);
+    if (mReactors.empty())
+        return;
+    auto& reactor = *mReactors[mNextReactor++ % mReactors.size()];
+    sendThreadEvent(reactor, ThreadEvent{PEER_BROADCAST, request.mFd, request.mGeneration, Msg::pack(msg), false});
+}
+
+void P2P::addRequest(const Msg::Hash& hash, Request request){
+    if (request.mDeadline < mNextExpiry.load(std::memory_order_relaxed))
+        mNextExpiry = request.mDeadline;
+    mRequestsOf[announcerKey(request)]++;
+    auto [it, added] = mRequested.try_emplace(hash);
+    if (!added) {
+        // Taken over, the previous one has one less
+        auto previous = mRequestsOf.find(announcerKey(it->second));
+        if (--previous->second == 0)
+            mRequestsOf.erase(previous);
+    }
+    it->second = std::move(request);
+}
+
+decltype(P2P::mRequested)::iterator P2P::eraseRequest(decltype(mRequested)::iterator it){
+    auto asked = mRequestsOf.find(announcerKey(it->second));
+    if (--asked->second == 0)
+        mRequestsOf.erase(asked);
+    return mRequested.erase(it);
+}
+
+void P2P::expireRequests(){
+    auto now = std::chrono::steady_clock::now();
+    if (now < mNextExpiry.load(std::memory_order_relaxed))
+        return;
+    std::unique_lock lock(mInventoryMutex);
+    std::vector<std::pair<Msg::Item, std::vector<Announcer>>> expired;
+    auto next = std::chrono::steady_clock::time_point::max();
+    for (auto it = mRequested.begin(); it != mRequested.end();) {
+        auto& r = it->second;
+        if (now < r.mDeadline) {
+            next = std::min(next, r.mDeadline); // max() while checked
+            ++it;
+            continue;
+        }
+        mLog.d("Fd{} did not send {} in time", r.mFd, Msg::Item{r.mKind, it->first});
+        expired.push_back({{r.mKind, it->first}, std::move(r.mOthers)});
+        it = eraseRequest(it);
+    }
+    mNextExpiry = next;
+    // Without others, fetched from the next one that announces it
+    for (auto& [item, others] : expired)
+        refetchItem(item, std::move(others));
+}
+
+void P2P::forgetAnnouncer(const Peer& peer){
+    auto isPeer = [&](const Announcer& a){ return a.mFd == peer.mFd && a.mGeneration == peer.mGeneration; };
+    std::unique_lock lock(mInventoryMutex);
+    std::vector<std::pair<Msg::Item, std::vector<Announcer>>> orphans;
+    for (auto it = mRequested.begin(); it != mRequested.end();) {
+        auto& r = it->second;
+        std::erase_if(r.mOthers, isPeer);
+        // The one being checked is finished by its DATA handler
+        if (!isPeer(r) || r.mChecking) {
+            ++it;
+            continue;
+        }
+        orphans.push_back({{r.mKind, it->first}, std::move(r.mOthers)});
+        it = eraseRequest(it);
+    }
+    for (auto& [item, others] : orphans)
+        refetchItem(item, std::move(others));
+}
+
+void P2P::storeItem(const Msg::Hash& hash, Msg::Packed packed){
+    auto size = packed->size();
+    if (!mStored.emplace(hash, std::move(packed)).second)
+        return; // Forgotten by the seen-set, but still stored
+    mStoredBytes += size;
+    mStoredOrder.push_back(hash);
+    while (mStoredBytes > kStoredBytes && mStoredOrder.size() > 1) {
+        auto it = mStored.find(mStoredOrder.front());
+        mStoredBytes -= it->second->size();
+        mStored.erase(it);
+        mStoredOrder.pop_front();
+    }
+}
+
+void P2P::relayItem(const Msg::Item& item, const Peer* origin){
+    BroadcastFilter filter;
+    filter.mExclude = origin;
+    filter.mUnknown = &item.mHash;
+    auto stats = broadcast(Msg::Inventory{{item}}, filter);
+    mLog.t("Announced {} to {} peers", item, stats.mQueued + stats.mDeferred);
+}
+
+bool P2P::announce(const Msg::Item& item, std::string_view data){
+    {
+        std::unique_lock lock(mInventoryMutex);
+        if (!mSeen.insert(item.mHash))
+            return false;
+        storeItem(item.mHash, Msg::pack(Msg::Data{item, std::string(data)}));
+    }
+    relayItem(item, nullptr);
+    return true;
+}
+
 void P2P::sendMsg_Discovery(Peer& peer){
-    msgpack::zone z;
     // Aggregate all adddresses and send them
-    std::unique_lock<std::recursive_mutex> lock(mPeersMutex);
+    // The peers busy in other threads are skipped, we hold a peer lock
     std::vector<std::string> addr;
-    for(auto& [fd, p] : mPeers) {
+    mPeers.forEach([&](Peer& p){
         if (p.mReady)
             addr.emplace_back(fmt::format("{}:{}", p.mConAddress, p.mListenPort));
-    }
+    }, [](Peer&, int){});
     if (addr.size() == 0)
         return;
-    auto msg = msgpack::object(Msg::Any { Msg::Type::DISCOVERY, 
-        msgpack::object(Msg::Discovery {addr}, z) }, z);
-    mLog.t("Sending {}", Msg::Discovery {addr});
+    Msg::Discovery msg {std::move(addr)};
+    mLog.t("Sending {}", msg);
     sendMsg(peer, msg);
 }
\ No newline at end of file
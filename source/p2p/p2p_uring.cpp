@@ -0,0 +1,484 @@
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "p2p/p2p.h"
+#include "core/log.h"
+
+// io_uring backend of the reactors. Accepts with one multishot request,
+//  reads into registered buffers owned by the reactor, and all the
+//  requests queued while handling a batch of completions are submitted
+//  with a single syscall
+namespace {
+    // user_data: op (8 bits), read slot (16 bits), channel id (40 bits)
+    enum Op : uint64_t {
+        ACCEPT = 1,
+        EVENTS,
+        READ,
+        SEND,
+        CONNECT,
+        CANCEL,
+        PING,
+    };
+    constexpr uint64_t kIdBits = 40;
+    constexpr uint64_t kIdMask = (uint64_t(1) << kIdBits) - 1;
+
+    constexpr uint64_t tag(Op op, uint64_t id = 0, uint64_t slot = 0) {
+        return (uint64_t(op) << 56) | (slot << kIdBits) | (id & kIdMask);
+    }
+
+    // Nothing of the kernel is using it
+    constexpr auto isIdle = [](const auto& channel) {
+        return channel.mRecvSlot == -1 && channel.mSending.empty();
+    };
+};
+
+bool P2P::openUring(Reactor& reactor) {
+    auto& ring = reactor.mUring;
+    bool ok = ring.open(kUringEntries);
+    for (auto op : {IORING_OP_ACCEPT, IORING_OP_POLL_ADD, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_LINK_TIMEOUT, IORING_OP_TIMEOUT, IORING_OP_TIMEOUT_REMOVE})
+        ok = ok && ring.supports(op);
+    if (!ok) {
+        static Log::Limit limit(1);
+        mLog.w(limit, "io_uring not available ({}), using epoll", errno);
+        ring.close();
+        return false;
+    }
+
+    reactor.mRecvBuffers.resize(kUringRecvSlots * kUpackBuffer);
+    reactor.mFreeSlots.clear();
+    for (unsigned i = kUringRecvSlots; i-- > 0;)
+        reactor.mFreeSlots.push_back(i);
+    // Pinned once, the reads do not map them every time. The memlock
+    //  limit of older kernels might not allow it, plain reads then
+    struct iovec iov = {reactor.mRecvBuffers.data(), reactor.mRecvBuffers.size()};
+    reactor.mFixedBuffers = ring.supports(IORING_OP_READ_FIXED) && ring.registerBuffers(&iov, 1);
+    return true;
+}
+
+void P2P::threadLoopUring(Reactor& reactor) {
+    mLog.t("thread {} created (io_uring)", reactor.mId);
+    auto& ring = reactor.mUring;
+
+    uringAccept(reactor);
+    uringPollEvents(reactor);
+    uringPingTimer(reactor);
+
+    // Main loop, all the requests queued by a batch of completions
+    //  are submitted with the wait for the next one
+    auto complete = [&](const io_uring_cqe& cqe){ uringComplete(reactor, cqe); };
+    while (reactor.mRunning) {
+        if (ring.submitAndWait(1) < 0 && errno != EINTR && errno != EBUSY) {
+            mLog.e("io_uring error {}", errno);
+            break;
+        }
+        ring.forEachCqe(complete);
+        // A request expires before the armed timer, it is armed again
+        //  once removed
+        if (reactor.mRunning && mNextExpiry.load(std::memory_order_relaxed) < reactor.mTimerDeadline) {
+            if (auto sqe = ring.sqe()) {
+                sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+                sqe->addr = tag(PING);
+                sqe->user_data = tag(CANCEL);
+                reactor.mTimerDeadline = mNextExpiry;
+            }
+        }
+    }
+    reactor.mRunning = false;
+
+    // The armed accept keeps the listen socket alive after closing it
+    //  (the ring is released asynchronously), and with SO_REUSEPORT it
+    //  would still take connections of the port
+    for (auto op : {ACCEPT, EVENTS}) {
+        if (auto sqe = ring.sqe()) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = tag(op);
+            sqe->user_data = tag(CANCEL);
+        }
+    }
+    if (auto sqe = ring.sqe()) {
+        sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+        sqe->addr = tag(PING);
+        sqe->user_data = tag(CANCEL);
+    }
+
+    // The attempts finish with the cancel, and the ones not watched
+    //  yet are closed with the reactor
+    {
+        std::unique_lock lock(reactor.mConnectMutex);
+        for (unsigned slot = 0; slot < reactor.mConnects.size(); slot++) {
+            if (reactor.mConnects[slot].mFd == -1)
+                continue;
+            if (auto sqe = ring.sqe()) {
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = tag(CONNECT, slot);
+                sqe->user_data = tag(CANCEL);
+            }
+        }
+    }
+
+    //Stop all the sockets of this reactor, then wait for all the
+    //  requests in flight, reads and sends use the reactor buffers
+    mPeers.forEach([&](Peer& peer){
+        if (peer.mReactor == reactor.mId) {
+            auto fd = peer.mFd;
+            uringClose(reactor, peer);
+            mPeers.erase(peer);
+            close(fd);
+        }
+    });
+    while (reactor.mInFlight > 0) {
+        if (ring.submitAndWait(1) < 0 && errno != EINTR && errno != EBUSY)
+            break;
+        ring.forEachCqe(complete);
+    }
+    reactor.mChannels.clear();
+    reactor.mSlotWaiters.clear();
+
+    mLog.t("thread {} stopped", reactor.mId);
+}
+
+void P2P::uringAccept(Reactor& reactor) {
+    auto sqe = reactor.mUring.sqe();
+    if (!sqe) {
+        mLog.e("io_uring can not accept connections");
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = reactor.mListenSocket;
+    // A single request for all the connections (5.19)
+    if (reactor.mMultishotAccept)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = tag(ACCEPT);
+    reactor.mInFlight++;
+}
+
+void P2P::uringPollEvents(Reactor& reactor) {
+    auto sqe = reactor.mUring.sqe();
+    if (!sqe) {
+        mLog.e("io_uring can not poll the thread events");
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = reactor.mEventFd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = tag(EVENTS);
+    reactor.mInFlight++;
+}
+
+void P2P::uringPingTimer(Reactor& reactor) {
+    auto sqe = reactor.mUring.sqe();
+    if (!sqe) {
+        mLog.e("io_uring can not ping the peers");
+        return;
+    }
+    // The next ping, or the first request to expire
+    reactor.mTimerDeadline = std::min(reactor.mNextPing, mNextExpiry.load(std::memory_order_relaxed));
+    auto timeout = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        reactor.mTimerDeadline - std::chrono::steady_clock::now());
+    timeout = std::max(timeout, std::chrono::nanoseconds(0));
+    reactor.mPingTimer.tv_sec = timeout.count() / 1000000000;
+    reactor.mPingTimer.tv_nsec = timeout.count() % 1000000000;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = reinterpret_cast<uint64_t>(&reactor.mPingTimer);
+    sqe->len = 1;
+    sqe->user_data = tag(PING);
+    reactor.mInFlight++;
+}
+
+void P2P::uringConnect(Reactor& reactor, unsigned slot) {
+    auto& ring = reactor.mUring;
+    std::unique_lock lock(reactor.mConnectMutex);
+    auto& attempt = reactor.mConnects[slot];
+    auto sqe = ring.sqe();
+    if (!sqe) {
+        mLog.e("io_uring can not connect to {}", attempt.mAddress);
+        lock.unlock();
+        connectDone(reactor, slot, EAGAIN);
+        return;
+    }
+    // Writable once connected, or failed. The linked timeout cancels it
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = attempt.mFd;
+    sqe->poll32_events = POLLOUT;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = tag(CONNECT, slot);
+    reactor.mInFlight++;
+
+    auto timeout = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        attempt.mDeadline - std::chrono::steady_clock::now());
+    timeout = std::max(timeout, std::chrono::nanoseconds(0));
+    attempt.mTimeout.tv_sec = timeout.count() / 1000000000;
+    attempt.mTimeout.tv_nsec = timeout.count() % 1000000000;
+    if (auto link = ring.sqe()) {
+        link->opcode = IORING_OP_LINK_TIMEOUT;
+        link->addr = reinterpret_cast<uint64_t>(&attempt.mTimeout);
+        link->len = 1;
+        link->user_data = tag(CANCEL);
+    }
+    // The kernel copies the timeout now, the table can grow later
+    ring.submitAndWait(0);
+}
+
+void P2P::uringOpen(Reactor& reactor, Peer& peer) {
+    auto id = reactor.mNextChannel++;
+    auto& channel = reactor.mChannels[id];
+    channel.mFd = peer.mFd;
+    peer.mChannel = id;
+    uringRead(reactor, id, channel);
+    // Queued before it had a channel
+    uringFlush(reactor, peer);
+}
+
+void P2P::uringClose(Reactor& reactor, Peer& peer) {
+    auto it = reactor.mChannels.find(peer.mChannel);
+    peer.mChannel = 0;
+    if (it == reactor.mChannels.end())
+        return;
+    auto& channel = it->second;
+    channel.mOpen = false;
+    if (isIdle(channel)) {
+        reactor.mChannels.erase(it);
+        return;
+    }
+    // The queued requests take the fd before it can be reused, and
+    //  the ones in flight finish once the socket is shut down
+    reactor.mUring.submitAndWait(0);
+    shutdown(channel.mFd, SHUT_RDWR);
+}
+
+void P2P::uringRead(Reactor& reactor, uint64_t id, Channel& channel) {
+    if (reactor.mFreeSlots.empty()) {
+        // Served when another read finishes
+        if (!channel.mWaitingSlot)
+            reactor.mSlotWaiters.push_back(id);
+        channel.mWaitingSlot = true;
+        return;
+    }
+    auto sqe = reactor.mUring.sqe();
+    if (!sqe) {
+        mLog.e("io_uring can not read from {}", channel.mFd);
+        return;
+    }
+    auto slot = reactor.mFreeSlots.back();
+    reactor.mFreeSlots.pop_back();
+    sqe->opcode = reactor.mFixedBuffers ? IORING_OP_READ_FIXED : IORING_OP_RECV;
+    sqe->fd = channel.mFd;
+    sqe->addr = reinterpret_cast<uint64_t>(&reactor.mRecvBuffers[slot * kUpackBuffer]);
+    sqe->len = kUpackBuffer;
+    sqe->buf_index = 0;
+    sqe->user_data = tag(READ, id, slot);
+    channel.mRecvSlot = slot;
+    reactor.mInFlight++;
+}
+
+void P2P::freeSlot(Reactor& reactor, unsigned slot) {
+    reactor.mFreeSlots.push_back(slot);
+    while (!reactor.mSlotWaiters.empty() && !reactor.mFreeSlots.empty()) {
+        auto id = reactor.mSlotWaiters.front();
+        reactor.mSlotWaiters.pop_front();
+        auto it = reactor.mChannels.find(id);
+        if (it == reactor.mChannels.end())
+            continue;
+        it->second.mWaitingSlot = false;
+        if (it->second.mOpen)
+            uringRead(reactor, id, it->second);
+    }
+}
+
+void P2P::uringReadDone(Reactor& reactor, uint64_t id, unsigned slot, int res) {
+    reactor.mInFlight--;
+    auto it = reactor.mChannels.find(id);
+    auto& channel = it->second;
+    channel.mRecvSlot = -1;
+    if (!channel.mOpen) {
+        freeSlot(reactor, slot);
+        if (isIdle(channel))
+            reactor.mChannels.erase(it);
+        return;
+    }
+    if (res == -EINTR || res == -EAGAIN) {
+        freeSlot(reactor, slot);
+        uringRead(reactor, id, channel);
+        return;
+    }
+
+    // Open channels always have their peer
+    auto fd = channel.mFd;
+    std::unique_lock<std::recursive_mutex> peerLock;
+    auto found = mPeers.lock(fd, peerLock);
+    if (!found) {
+        mLog.w("Read done on unknown FD={}", fd);
+        freeSlot(reactor, slot);
+        return;
+    }
+    auto& peer = *found;
+
+    bool keep = res > 0;
+    if (res > 0) {
+        auto& unp = peer.mUnpacker;
+        unp.reserve_buffer(res);
+        memcpy(unp.buffer(), &reactor.mRecvBuffers[slot * kUpackBuffer], res);
+        keep = decodePeer(peer, res);
+    } else if (res < 0) {
+        static Log::Limit limit(10);
+        mLog.w(limit, "Socket returned {}", res);
+    }
+    freeSlot(reactor, slot);
+    if (keep && peer.mThrottled) {
+        // Read again once it reads what we sent
+        channel.mReadStopped = true;
+    } else if (keep) {
+        uringRead(reactor, id, channel);
+    } else {
+        peerLock.unlock();
+        removePeer(fd);
+    }
+}
+
+void P2P::uringFlush(Reactor& reactor, Peer& peer) {
+    // Only its thread can use the ring
+    if (std::this_thread::get_id() != reactor.mThread.get_id()) {
+        sendThreadEvent(peer, PEER_SEND);
+        return;
+    }
+    checkSlowPeer(peer);
+    auto it = reactor.mChannels.find(peer.mChannel);
+    if (it == reactor.mChannels.end())
+        return; // Sent once it is opened
+    auto& channel = it->second;
+    // All the queued ones in a single request, the next ones wait for it
+    if (channel.mSending.empty() && !peer.mOutbound.empty()) {
+        channel.mSending.swap(peer.mOutbound);
+        channel.mSent = 0;
+        uringSend(reactor, peer.mChannel, channel);
+    }
+    if (channel.mReadStopped && !peer.mThrottled) {
+        channel.mReadStopped = false;
+        uringRead(reactor, peer.mChannel, channel);
+    }
+}
+
+void P2P::uringSend(Reactor& reactor, uint64_t id, Channel& channel) {
+    auto sqe = reactor.mUring.sqe();
+    if (!sqe) {
+        mLog.e("io_uring can not send to {}", channel.mFd);
+        channel.mSending.clear();
+        return;
+    }
+    memset(&channel.mMsg, 0, sizeof(channel.mMsg));
+    channel.mMsg.msg_iov = channel.mIovecs;
+    channel.mMsg.msg_iovlen = toIovecs(channel.mSending, channel.mSent, channel.mIovecs, kMaxIovecs);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = channel.mFd;
+    sqe->addr = reinterpret_cast<uint64_t>(&channel.mMsg);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = tag(SEND, id);
+    reactor.mInFlight++;
+}
+
+void P2P::uringSendDone(Reactor& reactor, uint64_t id, int res) {
+    reactor.mInFlight--;
+    auto it = reactor.mChannels.find(id);
+    auto& channel = it->second;
+    if (res == -EINTR || res == -EAGAIN)
+        res = 0;
+    if (!channel.mOpen) {
+        channel.mSending.clear();
+        if (isIdle(channel))
+            reactor.mChannels.erase(it);
+        return;
+    }
+
+    // Open channels always have their peer
+    std::unique_lock<std::recursive_mutex> peerLock;
+    auto found = mPeers.lock(channel.mFd, peerLock);
+    if (!found) {
+        channel.mSending.clear();
+        return;
+    }
+    auto& peer = *found;
+
+    if (res < 0) {
+        // The read will find the socket broken
+        mLog.e("Error sending to socket on {}: {}", peer, -res);
+        channel.mSending.clear();
+        peer.mOutbound.clear();
+        peer.mOutboundBytes = 0;
+    } else {
+        peer.mOutboundBytes -= res;
+        consume(channel.mSending, channel.mSent, res);
+    }
+    if (!channel.mSending.empty())
+        uringSend(reactor, id, channel);
+    else
+        uringFlush(reactor, peer);
+}
+
+void P2P::uringComplete(Reactor& reactor, const io_uring_cqe& cqe) {
+    auto id = cqe.user_data & kIdMask;
+    auto slot = (cqe.user_data >> kIdBits) & 0xffff;
+    switch (cqe.user_data >> 56) {
+        case ACCEPT: {
+            if (cqe.res >= 0 && !reactor.mRunning) {
+                close(cqe.res);
+            } else if (cqe.res >= 0) {
+                struct sockaddr_in addr = {};
+                socklen_t size = sizeof(addr);
+                getpeername(cqe.res, (struct sockaddr*)&addr, &size);
+                acceptPeer(reactor, cqe.res, addr);
+            } else if (cqe.res == -EINVAL && reactor.mMultishotAccept) {
+                // Older kernel, one request per connection
+                reactor.mMultishotAccept = false;
+            } else if (reactor.mRunning) {
+                static Log::Limit limit(10);
+                mLog.e(limit, "accept error {}", -cqe.res);
+            }
+            if (cqe.flags & IORING_CQE_F_MORE)
+                break;
+            reactor.mInFlight--;
+            if (reactor.mRunning)
+                uringAccept(reactor);
+            break;
+        }
+        case EVENTS:
+            reactor.mInFlight--;
+            if (!reactor.mRunning)
+                break;
+            // At least one event queued
+            if (cqe.res > 0)
+                handleEvents(reactor);
+            else
+                mLog.e("poll error {}", -cqe.res);
+            if (reactor.mRunning)
+                uringPollEvents(reactor);
+            break;
+        case READ:
+            uringReadDone(reactor, id, slot, cqe.res);
+            break;
+        case SEND:
+            uringSendDone(reactor, id, cqe.res);
+            break;
+        case CONNECT: {
+            reactor.mInFlight--;
+            // Canceled by the linked timeout, or when stopping
+            int error = cqe.res >= 0 ? 0 : cqe.res == -ECANCELED ? ETIMEDOUT : -cqe.res;
+            connectDone(reactor, id, error);
+            break;
+        }
+        case PING:
+            // -ETIME when it expires, -ECANCELED when stopping or
+            //  armed again for an earlier request
+            reactor.mInFlight--;
+            if (!reactor.mRunning)
+                break;
+            expireRequests();
+            if (std::chrono::steady_clock::now() >= reactor.mNextPing)
+                pingPeers(reactor);
+            uringPingTimer(reactor);
+            break;
+    }
+}
@@ -2,9 +2,12 @@
 
 #include <mutex>
 #include <atomic>
+#include <chrono>
+#include <deque>
 #include <netdb.h>
 
 #include "p2p/msg.h"
+#include "p2p/seen_set.h"
 
 /**
 *  A peer is an stablished connection with a socket
@@ -16,15 +19,64 @@ struct Peer : Msg::PeerInfo {
     //  It is better to protect it
     std::recursive_mutex mMutex;
 
+    // Slot of the PeerTable, reused by the next socket with the same fd
+    bool mInUse = false;
+    uint32_t mGeneration = 0; // Changes every time it is freed
+
     // Connection related data
-    int mFd;
-    msgpack::unpacker mUnpacker;
+    int mFd = -1;
+    int mReactor = 0; // Index of the reactor serving it
+    uint64_t mChannel = 0; // io_uring channel, 0 with epoll
+    // Strings of the decoded messages point to its buffer, not copied
+    msgpack::unpacker mUnpacker{&Peer::referenceAll};
+    static bool referenceAll(msgpack::type::object_type, std::size_t, void*) {return true;}
     std::string mConAddress;
-    int mConPort;
+    int mConPort = 0;
     bool mReady = false;
+    // Set by the message handlers, it is removed once they finish
+    bool mClosing = false;
+
+    // Messages the socket did not take yet, oldest first
+    std::deque<Msg::Packed> mOutbound;
+    size_t mOutboundSent = 0; // Of the front one
+    size_t mOutboundBytes = 0;
+    bool mThrottled = false; // Not read until it reads what we sent
+    uint32_t mEvents = 0; // Registered in epoll
+
+    // Items it announced or we announced to it, not announced again
+    static constexpr size_t kKnownItems = 2048;
+    SeenSet mKnown{kKnownItems, 16};
+
+    // Round trip time smoothed as TCP does (RFC 6298), and its mean
+    //  deviation, 0 until its first pong
+    std::chrono::microseconds mRtt{0};
+    std::chrono::microseconds mJitter{0};
+    uint64_t mPingNonce = 0; // Of the ping in flight, 0 if none
+    std::chrono::steady_clock::time_point mPingSent;
     enum class Direction {
         OUT, IN, UNKNOWN
     } mDirection = Direction::UNKNOWN;
+
+    // Back to the state of a new connection, keeps the slot data
+    void reset() {
+        static_cast<Msg::PeerInfo&>(*this) = {};
+        mFd = -1;
+        mReactor = 0;
+        mChannel = 0;
+        mUnpacker = msgpack::unpacker(&Peer::referenceAll);
+        mConAddress.clear();
+        mConPort = 0;
+        mReady = false;
+        mClosing = false;
+        mOutbound.clear();
+        mOutboundSent = mOutboundBytes = 0;
+        mThrottled = false;
+        mEvents = 0;
+        mKnown.clear();
+        mRtt = mJitter = {};
+        mPingNonce = 0;
+        mDirection = Direction::UNKNOWN;
+    }
 };
 
 template <>
@@ -32,6 +84,6 @@ struct fmt::formatter<Peer> {
     constexpr auto parse(format_parse_context& ctx) { return ctx.begin(); }  template <typename FormatContext>
     auto format(const Peer& d, FormatContext& ctx) {
         return format_to(ctx.out(), 
-            "Peer: Fd{}, {}:{}, Ready:{}", d.mFd, d.mConAddress, d.mConPort, d.mReady);
+            "Peer: Fd{}, {}:{}, Ready:{}, Rtt:{}us", d.mFd, d.mConAddress, d.mConPort, d.mReady, d.mRtt.count());
     }
 };
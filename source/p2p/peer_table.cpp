@@ -0,0 +1,76 @@
+#include "p2p/peer_table.h"
+
+PeerTable::~PeerTable() {
+    for (auto& c : mChunks) {
+        auto chunk = c.load(std::memory_order_relaxed);
+        if (!chunk)
+            continue;
+        for (auto& slot : chunk->mSlots)
+            delete slot.load(std::memory_order_relaxed);
+        delete chunk;
+    }
+}
+
+Peer* PeerTable::slot(int fd) const {
+    if (fd < 0 || fd >= kChunkSize * kMaxChunks)
+        return nullptr;
+    auto chunk = mChunks[fd / kChunkSize].load(std::memory_order_acquire);
+    if (!chunk)
+        return nullptr;
+    return chunk->mSlots[fd % kChunkSize].load(std::memory_order_acquire);
+}
+
+Peer* PeerTable::insert(int fd, std::unique_lock<std::recursive_mutex>& lock) {
+    if (fd < 0 || fd >= kChunkSize * kMaxChunks)
+        return nullptr;
+    auto peer = slot(fd);
+    if (!peer) {
+        // First socket with this fd, readers only see it complete
+        std::unique_lock growLock(mGrowMutex);
+        auto& c = mChunks[fd / kChunkSize];
+        auto chunk = c.load(std::memory_order_relaxed);
+        if (!chunk) {
+            chunk = new Chunk;
+            c.store(chunk, std::memory_order_release);
+            if (fd / kChunkSize >= mNumChunks.load(std::memory_order_relaxed))
+                mNumChunks.store(fd / kChunkSize + 1, std::memory_order_release);
+        }
+        auto& s = chunk->mSlots[fd % kChunkSize];
+        peer = s.load(std::memory_order_relaxed);
+        if (!peer) {
+            peer = new Peer;
+            s.store(peer, std::memory_order_release);
+        }
+    }
+    lock = std::unique_lock(peer->mMutex);
+    // The kernel gives the fd again only after the previous one is closed,
+    //  which is after it is erased
+    peer->reset();
+    peer->mFd = fd;
+    peer->mInUse = true;
+    mSize++;
+    return peer;
+}
+
+Peer* PeerTable::lock(int fd, std::unique_lock<std::recursive_mutex>& lock, uint32_t generation) {
+    auto peer = slot(fd);
+    if (!peer)
+        return nullptr;
+    lock = std::unique_lock(peer->mMutex);
+    if (!peer->mInUse || (generation != kAnyGeneration && generation != peer->mGeneration)) {
+        lock.unlock();
+        return nullptr;
+    }
+    return peer;
+}
+
+void PeerTable::erase(Peer& peer) {
+    if (!peer.mInUse)
+        return;
+    peer.mInUse = false;
+    peer.mGeneration++;
+    // Nothing else will be sent
+    peer.mOutbound.clear();
+    peer.mOutboundSent = peer.mOutboundBytes = 0;
+    mSize--;
+}
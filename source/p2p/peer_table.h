@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+
+#include "common/nocopyormove.h"
+#include "p2p/peer.h"
+
+/**
+* Peers indexed by their socket fd. The slot of an fd is allocated the
+* first time it is used and reused by the next socket that gets the same
+* fd, so a Peer& stays valid while the table grows, and a lookup is two
+* array accesses without any table lock. The peer mutex is the only one
+* taken to serve a socket.
+*
+* The generation of a slot changes every time it is freed, events that
+* carry it are dropped if the fd was reused by another connection.
+*
+* Usage:
+*   std::unique_lock<std::recursive_mutex> lock;
+*   if (auto peer = table.lock(fd, lock)) ... // Locked and in use
+*/
+class PeerTable : private NoCopyOrMove {
+public:
+    static constexpr int kChunkSize = 64;
+    static constexpr int kMaxChunks = 4096; // Up to 256K fds
+    static constexpr uint32_t kAnyGeneration = ~uint32_t(0);
+
+    PeerTable() = default;
+    ~PeerTable();
+
+    // The reset slot of a new socket, locked and in use. Null if the
+    //  fd is out of the table
+    Peer* insert(int fd, std::unique_lock<std::recursive_mutex>& lock);
+    // The peer using fd, locked. Null if it is not in use, or is of
+    //  another generation
+    Peer* lock(int fd, std::unique_lock<std::recursive_mutex>& lock, uint32_t generation = kAnyGeneration);
+    // Frees the slot of a locked peer
+    void erase(Peer& peer);
+    size_t size() const {return mSize.load(std::memory_order_relaxed);}
+
+    // Calls f(Peer&) with each peer in use, locked
+    template<class F>
+    void forEach(F&& f) {
+        visit(f, [](Peer&, int){ return true; });
+    }
+    // Same, but the peers locked by other threads are not waited for,
+    //  busy(Peer&, fd) is called with them unlocked instead (they may
+    //  be free or reused by then). For callers that hold a peer lock
+    //  already, two of them waiting for each other would deadlock
+    template<class F, class B>
+    void forEach(F&& f, B&& busy) {
+        visit(f, [&](Peer& peer, int fd){ busy(peer, fd); return false; });
+    }
+
+private:
+    struct Chunk {
+        std::atomic<Peer*> mSlots[kChunkSize] = {};
+    };
+    std::atomic<Chunk*> mChunks[kMaxChunks] = {};
+    std::atomic<int> mNumChunks = 0; // Up to the last one allocated
+    std::mutex mGrowMutex; // Allocating chunks and slots
+    std::atomic<size_t> mSize = 0;
+
+    Peer* slot(int fd) const;
+
+    // busy(Peer&, fd) returns if the peer has to be waited for
+    template<class F, class B>
+    void visit(F& f, B&& busy) {
+        auto chunks = mNumChunks.load(std::memory_order_acquire);
+        for (int c = 0; c < chunks; c++) {
+            auto chunk = mChunks[c].load(std::memory_order_acquire);
+            if (!chunk)
+                continue;
+            for (int i = 0; i < kChunkSize; i++) {
+                auto peer = chunk->mSlots[i].load(std::memory_order_acquire);
+                if (!peer)
+                    continue;
+                std::unique_lock lock(peer->mMutex, std::try_to_lock);
+                if (!lock.owns_lock()) {
+                    if (!busy(*peer, c * kChunkSize + i))
+                        continue;
+                    lock.lock();
+                }
+                if (peer->mInUse)
+                    f(*peer);
+            }
+        }
+    }
+};
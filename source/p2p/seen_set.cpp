@@ -0,0 +1,71 @@
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <random>
+
+#include "p2p/seen_set.h"
+
+SeenSet::SeenSet(size_t capacity, unsigned bitsPerItem)
+    : mCapacity(std::max<size_t>(capacity, 1)) {
+    // k = m/n ln 2 is the one with less false positives
+    mNumHashes = std::max(1u, static_cast<unsigned>(std::lround(bitsPerItem * std::log(2.0))));
+    auto bits = std::bit_ceil(std::max<uint64_t>(mCapacity * bitsPerItem, 64));
+    mMask = bits - 1;
+    mSalt = (uint64_t(std::random_device()()) << 32) | std::random_device()();
+    for (auto& filter : mFilters)
+        filter.assign(bits / 64, 0);
+}
+
+void SeenSet::hashes(const Msg::Hash& hash, uint64_t& h1, uint64_t& h2) const {
+    // The items are named by a cryptographic hash, its bits are already
+    //  uniform, two words of it give all the k indexes
+    memcpy(&h1, hash.data(), sizeof(h1));
+    memcpy(&h2, hash.data() + sizeof(h1), sizeof(h2));
+    h1 ^= mSalt;
+    h2 = (h2 ^ std::rotl(mSalt, 32)) | 1;
+}
+
+bool SeenSet::test(const std::vector<uint64_t>& filter, uint64_t h1, uint64_t h2) const {
+    for (unsigned i = 0; i < mNumHashes; i++) {
+        auto bit = (h1 + i * h2) & mMask;
+        if (!(filter[bit / 64] & (uint64_t(1) << (bit % 64))))
+            return false;
+    }
+    return true;
+}
+
+bool SeenSet::contains(const Msg::Hash& hash) const {
+    uint64_t h1, h2;
+    hashes(hash, h1, h2);
+    return test(mFilters[mCurrent], h1, h2) || test(mFilters[mCurrent ^ 1], h1, h2);
+}
+
+bool SeenSet::insert(const Msg::Hash& hash) {
+    uint64_t h1, h2;
+    hashes(hash, h1, h2);
+    if (test(mFilters[mCurrent], h1, h2))
+        return false;
+    // Seen in the previous one (or a false positive of it), added to
+    //  the current one anyway so it is kept as long as the others
+    bool seen = test(mFilters[mCurrent ^ 1], h1, h2);
+    if (mInserted == mCapacity) {
+        // Forget the oldest generation
+        mCurrent ^= 1;
+        std::fill(mFilters[mCurrent].begin(), mFilters[mCurrent].end(), 0);
+        mInserted = 0;
+    }
+    auto& filter = mFilters[mCurrent];
+    for (unsigned i = 0; i < mNumHashes; i++) {
+        auto bit = (h1 + i * h2) & mMask;
+        filter[bit / 64] |= uint64_t(1) << (bit % 64);
+    }
+    mInserted++;
+    return !seen;
+}
+
+void SeenSet::clear() {
+    for (auto& filter : mFilters)
+        std::fill(filter.begin(), filter.end(), 0);
+    mInserted = 0;
+}
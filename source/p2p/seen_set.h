@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "p2p/msg.h"
+
+/**
+* Approximate set of the latest item hashes, with a fixed memory use.
+* Two Bloom filters of capacity items each: insertions go to the current
+* one, and once it is full the previous one is cleared and becomes the
+* current. An item is remembered for at least capacity insertions after
+* it, and at most 2 * capacity.
+*
+* There are no false negatives within that window. A false positive (an
+* item reported as seen that was not) happens with a probability that
+* depends on bitsPerItem, ~1e-3 with 16 and ~1e-6 with 32.
+*
+* Not synchronized, its owner locks it
+*/
+class SeenSet {
+public:
+    SeenSet(size_t capacity, unsigned bitsPerItem);
+
+    bool contains(const Msg::Hash& hash) const;
+    // False if it was there already
+    bool insert(const Msg::Hash& hash);
+    void clear();
+
+private:
+    size_t mCapacity;
+    unsigned mNumHashes;
+    uint64_t mMask; // Bits per filter - 1, a power of two
+    uint64_t mSalt; // Other nodes can not craft colliding hashes
+    std::vector<uint64_t> mFilters[2];
+    unsigned mCurrent = 0;
+    size_t mInserted = 0; // In the current one
+
+    bool test(const std::vector<uint64_t>& filter, uint64_t h1, uint64_t h2) const;
+    void hashes(const Msg::Hash& hash, uint64_t& h1, uint64_t& h2) const;
+};
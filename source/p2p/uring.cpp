@@ -0,0 +1,144 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "p2p/uring.h"
+
+namespace {
+    int uringSetup(unsigned entries, io_uring_params* p) {
+        return syscall(__NR_io_uring_setup, entries, p);
+    }
+    int uringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+        return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+    }
+    int uringRegister(int fd, unsigned op, const void* arg, unsigned num) {
+        return syscall(__NR_io_uring_register, fd, op, arg, num);
+    }
+
+    template<class T>
+    T* at(void* map, unsigned offset) {
+        return reinterpret_cast<T*>(static_cast<char*>(map) + offset);
+    }
+};
+
+bool Uring::open(unsigned entries) {
+    close();
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    // Room for the completions of a full submission queue and more
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    mFd = uringSetup(entries, &p);
+    if (mFd < 0) {
+        mFd = -1;
+        return false;
+    }
+
+    mSqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    mCqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    // Since 5.4 both rings are in the same map
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        mSqMapSize = mCqMapSize = std::max(mSqMapSize, mCqMapSize);
+    mSqMap = mmap(nullptr, mSqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQ_RING);
+    if (mSqMap == MAP_FAILED) {
+        mSqMap = nullptr;
+        close();
+        return false;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        mCqMap = mSqMap;
+    } else {
+        mCqMap = mmap(nullptr, mCqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_CQ_RING);
+        if (mCqMap == MAP_FAILED) {
+            mCqMap = nullptr;
+            close();
+            return false;
+        }
+    }
+    mSqesSize = p.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, mSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        close();
+        return false;
+    }
+    mSqes = static_cast<io_uring_sqe*>(sqes);
+
+    mSqHead = at<unsigned>(mSqMap, p.sq_off.head);
+    mSqTail = at<unsigned>(mSqMap, p.sq_off.tail);
+    mSqMask = at<unsigned>(mSqMap, p.sq_off.ring_mask);
+    mSqEntries = at<unsigned>(mSqMap, p.sq_off.ring_entries);
+    mSqArray = at<unsigned>(mSqMap, p.sq_off.array);
+    mSqLocalTail = *mSqTail;
+
+    mCqHead = at<unsigned>(mCqMap, p.cq_off.head);
+    mCqTail = at<unsigned>(mCqMap, p.cq_off.tail);
+    mCqMask = at<unsigned>(mCqMap, p.cq_off.ring_mask);
+    mCqes = at<io_uring_cqe>(mCqMap, p.cq_off.cqes);
+
+    probe();
+    return true;
+}
+
+void Uring::close() {
+    if (mSqes)
+        munmap(mSqes, mSqesSize);
+    if (mCqMap && mCqMap != mSqMap)
+        munmap(mCqMap, mCqMapSize);
+    if (mSqMap)
+        munmap(mSqMap, mSqMapSize);
+    if (mFd != -1)
+        ::close(mFd);
+    mFd = -1;
+    mSqMap = mCqMap = nullptr;
+    mSqes = nullptr;
+    memset(mSupported, 0, sizeof(mSupported));
+}
+
+void Uring::probe() {
+    // Kernels before 5.6 have no probe, and only the oldest opcodes
+    std::vector<char> buffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+    auto p = reinterpret_cast<io_uring_probe*>(buffer.data());
+    if (uringRegister(mFd, IORING_REGISTER_PROBE, p, 256) < 0)
+        return;
+    for (unsigned i = 0; i < p->ops_len; i++) {
+        if (p->ops[i].flags & IO_URING_OP_SUPPORTED)
+            mSupported[i / 64] |= uint64_t(1) << (i % 64);
+    }
+}
+
+bool Uring::supports(uint8_t op) const {
+    return mSupported[op / 64] & (uint64_t(1) << (op % 64));
+}
+
+bool Uring::registerBuffers(const struct iovec* iovecs, unsigned num) {
+    return uringRegister(mFd, IORING_REGISTER_BUFFERS, iovecs, num) == 0;
+}
+
+io_uring_sqe* Uring::sqe() {
+    // Full, push the queued ones to the kernel first. With EBUSY its
+    //  completions overflow, it takes no more until they are reaped,
+    //  which our caller might be doing
+    while (mSqLocalTail - std::atomic_ref(*mSqHead).load(std::memory_order_acquire) >= *mSqEntries) {
+        if (submitAndWait(0) < 0 && errno != EINTR)
+            return nullptr;
+    }
+    auto idx = mSqLocalTail & *mSqMask;
+    auto sqe = &mSqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    mSqArray[idx] = idx;
+    mSqLocalTail++;
+    return sqe;
+}
+
+int Uring::submitAndWait(unsigned waitNr) {
+    // Publish the filled entries, then one syscall for all of them
+    std::atomic_ref(*mSqTail).store(mSqLocalTail, std::memory_order_release);
+    auto toSubmit = mSqLocalTail - std::atomic_ref(*mSqHead).load(std::memory_order_acquire);
+    if (toSubmit == 0 && waitNr == 0)
+        return 0;
+    return uringEnter(mFd, toSubmit, waitNr, waitNr ? IORING_ENTER_GETEVENTS : 0);
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+#include <atomic>
+#include <cstdint>
+
+#include "common/nocopyormove.h"
+
+/**
+* Minimal io_uring wrapper over the raw syscalls (no liburing needed).
+* Only one thread can fill the submission queue and reap completions.
+*
+* Usage:
+*   Uring ring;
+*   if (!ring.open(256)) ... // Kernel without io_uring, use epoll
+*   auto sqe = ring.sqe();
+*   sqe->opcode = IORING_OP_RECV; ...
+*   ring.submitAndWait(1);
+*   ring.forEachCqe([](const io_uring_cqe& cqe){ ... });
+*/
+class Uring : private NoCopyOrMove {
+public:
+    Uring() = default;
+    ~Uring() {close();}
+
+    // False if the kernel has no io_uring (or it is not allowed)
+    bool open(unsigned entries);
+    void close();
+    bool isOpen() const {return mFd != -1;}
+    // Checks the opcode with the kernel probe
+    bool supports(uint8_t op) const;
+
+    // Registers memory that IORING_OP_READ_FIXED can use (buf_index)
+    bool registerBuffers(const struct iovec* iovecs, unsigned num);
+
+    // Next free submission entry, zeroed, submits the queued ones
+    //  if it is full. Null if the kernel does not take them, also
+    //  while its completions overflow (EBUSY)
+    io_uring_sqe* sqe();
+    // Submits all the queued entries in one syscall, and waits
+    //  until there are at least waitNr completions
+    int submitAndWait(unsigned waitNr);
+
+    // Calls f for all the available completions, each one is freed
+    //  before its call, so the kernel has room for the ones f causes
+    template<class F>
+    unsigned forEachCqe(F&& f) {
+        auto head = *mCqHead;
+        auto tail = std::atomic_ref(*mCqTail).load(std::memory_order_acquire);
+        unsigned num = 0;
+        for (; head != tail; num++) {
+            auto cqe = mCqes[head & *mCqMask];
+            std::atomic_ref(*mCqHead).store(++head, std::memory_order_release);
+            f(cqe);
+        }
+        return num;
+    }
+
+private:
+    int mFd = -1;
+    uint64_t mSupported[4] = {};
+
+    void* mSqMap = nullptr;
+    size_t mSqMapSize = 0;
+    void* mCqMap = nullptr;
+    size_t mCqMapSize = 0;
+    io_uring_sqe* mSqes = nullptr;
+    size_t mSqesSize = 0;
+
+    unsigned* mSqHead = nullptr;
+    unsigned* mSqTail = nullptr;
+    unsigned* mSqMask = nullptr;
+    unsigned* mSqEntries = nullptr;
+    unsigned* mSqArray = nullptr;
+    unsigned mSqLocalTail = 0; // Filled, not yet submitted up to here
+
+    unsigned* mCqHead = nullptr;
+    unsigned* mCqTail = nullptr;
+    unsigned* mCqMask = nullptr;
+    io_uring_cqe* mCqes = nullptr;
+
+    void probe();
+};
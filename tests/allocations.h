@@ -0,0 +1,7 @@
+#pragma once
+
+#include <cstddef>
+
+// Allocations done by the calling thread so far (test_log.cpp replaces
+//  the global operator new to count them)
+size_t threadAllocations();
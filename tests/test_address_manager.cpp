@@ -0,0 +1,143 @@
+#include <catch2/catch_all.hpp>
+#include <fmt/core.h>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <thread>
+
+#include "p2p/address_manager.h"
+
+TEST_CASE("address manager", "[P2P]") {
+    using namespace std::chrono_literals;
+    AddressManager book;
+
+    SECTION("valid addresses are added once") {
+        CHECK(book.add("10.0.0.1:11250") == true);
+        CHECK(book.add("10.0.0.1:11250") == false);
+        CHECK(book.add("10.0.0.1:11251") == true);
+        CHECK(book.add("10.0.0.1") == false);
+        CHECK(book.add("10.0.0.1:0") == false);
+        CHECK(book.add("10.0.0.1:70000") == false);
+        CHECK(book.add("nowhere:11250") == false);
+        CHECK(book.size() == 2);
+    }
+    SECTION("selected ones are in use until released") {
+        book.add("10.0.0.1:11250");
+        auto address = book.select();
+        REQUIRE(address == "10.0.0.1:11250");
+        CHECK(book.select() == std::nullopt);
+        book.release(*address);
+        CHECK(book.select() == address);
+    }
+    SECTION("released ones can wait without failing") {
+        book.add("10.0.0.1:11250");
+        auto address = book.select();
+        book.release(*address, 20ms);
+        CHECK(book.weight(*address) == AddressManager::kNeutralWeight);
+        CHECK(book.select() == std::nullopt);
+        std::this_thread::sleep_for(30ms);
+        CHECK(book.select() == address);
+    }
+    SECTION("failed ones wait, and are forgotten after many") {
+        book.add("10.0.0.1:11250");
+        auto address = book.select();
+        book.failed(*address);
+        CHECK(book.weight(*address) == AddressManager::kNeutralWeight / 2);
+        CHECK(book.select() == std::nullopt);
+        for (unsigned i = 1; i < AddressManager::kMaxFailures; i++)
+            book.failed(*address);
+        CHECK(book.contains(*address) == false);
+    }
+    SECTION("faster ones are selected more") {
+        book.add("10.0.0.1:1");
+        book.add("10.1.0.1:1");
+        book.succeeded("10.0.0.1:1", 1ms);
+        book.succeeded("10.1.0.1:1", 1000ms);
+        CHECK(book.weight("10.0.0.1:1") > AddressManager::kNeutralWeight);
+        CHECK(book.weight("10.1.0.1:1") < AddressManager::kNeutralWeight);
+
+        std::map<std::string, int> count;
+        for (int i = 0; i < 1000; i++) {
+            auto address = book.select();
+            REQUIRE(address);
+            count[*address]++;
+            book.release(*address);
+        }
+        CHECK(count["10.0.0.1:1"] > 5 * count["10.1.0.1:1"]);
+    }
+    SECTION("one subnet can not fill the table") {
+        for (int i = 0; i < 1000; i++)
+            book.add(fmt::format("10.0.{}.{}:11250", i / 250, i % 250 + 1));
+        CHECK(book.size() == AddressManager::kBucketSize);
+
+        // Only known bad ones are replaced
+        book.failed(*book.select());
+        CHECK(book.add("10.0.99.1:11250") == true);
+        CHECK(book.add("10.0.99.2:11250") == false);
+        CHECK(book.size() == AddressManager::kBucketSize);
+    }
+    SECTION("the ones that connected are kept in the file") {
+        auto path = std::filesystem::temp_directory_path() / "freedomdb_test_addresses.bin";
+        std::filesystem::remove(path);
+        REQUIRE(book.open(path));
+        book.add("10.0.0.1:1");
+        book.add("10.1.0.1:1");
+        book.add("10.2.0.1:1");
+        book.succeeded("10.0.0.1:1", 1ms);
+        book.succeeded("10.1.0.1:1", 100ms);
+        book.succeeded("10.2.0.1:1", 10ms);
+        book.failed("10.2.0.1:1");
+        book.ban("10.1.0.1:1");
+        book.close();
+
+        AddressManager restarted;
+        REQUIRE(restarted.open(path));
+        CHECK(restarted.size() == 2);
+        CHECK(restarted.weight("10.0.0.1:1") == book.weight("10.0.0.1:1"));
+        CHECK(restarted.weight("10.2.0.1:1") == book.weight("10.2.0.1:1"));
+        CHECK(restarted.best(1) == std::vector<std::string>{"10.0.0.1:1"});
+        restarted.close();
+        std::filesystem::remove(path);
+    }
+    SECTION("the invalid records of the file are dropped") {
+        auto path = std::filesystem::temp_directory_path() / "freedomdb_test_addresses.bin";
+        {
+            // Header, then 16 bytes records: key, successes, failures, latency
+            std::vector<char> file(16 + AddressManager::kNumBuckets * AddressManager::kBucketSize * 16);
+            memcpy(file.data(), "FDBADDR1", 8);
+            uint32_t numRecords = AddressManager::kNumBuckets * AddressManager::kBucketSize;
+            memcpy(file.data() + 8, &numRecords, sizeof(numRecords));
+            uint64_t keys[] = {
+                uint64_t(0x0a000001) << 16 | 1, // 10.0.0.1:1
+                uint64_t(0x0a010001) << 16, // Port 0
+                uint64_t(1) << 50 | uint64_t(0x0a020001) << 16 | 1, // Over 48 bits
+            };
+            for (size_t i = 0; i < std::size(keys); i++) {
+                uint16_t successes = 1;
+                memcpy(file.data() + 16 + i * 16, &keys[i], sizeof(keys[i]));
+                memcpy(file.data() + 16 + i * 16 + 8, &successes, sizeof(successes));
+            }
+            std::ofstream(path, std::ios::binary).write(file.data(), file.size());
+        }
+        REQUIRE(book.open(path));
+        CHECK(book.size() == 1);
+        CHECK(book.contains("10.0.0.1:1"));
+        book.close();
+
+        // Replaced by the compacted one, nothing left next to it
+        CHECK(std::filesystem::file_size(path) == 16 + AddressManager::kNumBuckets * AddressManager::kBucketSize * 16);
+        CHECK(!std::filesystem::exists(path.string() + ".tmp"));
+        AddressManager restarted;
+        REQUIRE(restarted.open(path));
+        CHECK(restarted.size() == 1);
+        restarted.close();
+        std::filesystem::remove(path);
+    }
+    SECTION("banned ones are not added again") {
+        book.add("10.0.0.1:11250");
+        book.ban("10.0.0.1:11250");
+        CHECK(book.contains("10.0.0.1:11250") == false);
+        CHECK(book.add("10.0.0.1:11250") == false);
+    }
+}
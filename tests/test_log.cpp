@@ -1,14 +1,58 @@
+#include <time.h>
+
 #include <catch2/catch_all.hpp>
 #include <fmt/core.h>
 #include <fmt/format.h>
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <new>
+#include <thread>
+
 #include "core/log.h"
+#include "core/log_recorder.h"
+#include "allocations.h"
+
+// Counts the allocations done by this thread
+namespace {
+    thread_local size_t tAllocations = 0;
+};
+size_t threadAllocations() {return tAllocations;}
+void* operator new(size_t size) {
+    tAllocations++;
+    if (auto p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept {std::free(p);}
+void operator delete(void* p, size_t) noexcept {std::free(p);}
+
+namespace {
+    // The Limit budgets are per second of the coarse monotonic clock,
+    //  starting right after a tick the loops do not cross one
+    void waitNewSecond() {
+        auto second = [](){
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+            return ts.tv_sec;
+        };
+        auto start = second();
+        while (second() == start)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+};
 
 TEST_CASE("basic log functionality", "[Log]") {
     Log::mStdout = true;
 
     std::vector<std::tuple<Log::Type, Log::Level, std::string>> output;
-    auto saveAll = [&](Log::Type t, Log::Level l, const std::string& str){
+    // Callbacks run concurrently (the Limit reporter thread logs too)
+    std::mutex outputMutex;
+    auto saveAll = [&](Log::Type t, Log::Level l, std::string_view str){
+        std::unique_lock<std::mutex> lock(outputMutex);
         output.emplace_back(t, l, str);
     };
 
@@ -46,13 +90,508 @@ TEST_CASE("basic log functionality", "[Log]") {
         REQUIRE(output.size() == 1);
         CHECK(std::get<0>(output[0]) == Log::Type::DB);
     }
+
+    SECTION("enabled mask follows callbacks and settings") {
+        Log::mVerboseLevel = Log::Level::INFO;
+        CHECK(Log::enabled(Log::Type::P2P, Log::Level::INFO));
+        CHECK_FALSE(Log::enabled(Log::Type::P2P, Log::Level::DEBUG));
+
+        Log::mStdout = false;
+        CHECK_FALSE(Log::enabled(Log::Type::P2P, Log::Level::ERROR));
+
+        {
+            auto c = Log::add(saveAll, [](Log::Type t, Log::Level l){
+                return t == Log::Type::DB && l >= Log::Level::WARN;
+            });
+            CHECK(Log::enabled(Log::Type::DB, Log::Level::WARN));
+            CHECK_FALSE(Log::enabled(Log::Type::DB, Log::Level::INFO));
+            CHECK_FALSE(Log::enabled(Log::Type::P2P, Log::Level::ERROR));
+
+            Log::e(Log::Type::P2P, "not wanted");
+            Log::e(Log::Type::DB, "wanted");
+            REQUIRE(output.size() == 1);
+            CHECK(std::get<2>(output[0]) == "wanted");
+        }
+        CHECK_FALSE(Log::enabled(Log::Type::DB, Log::Level::WARN));
+
+        Log::mStdout = true;
+        Log::mVerboseLevel = Log::Level::TRACE;
+        CHECK(Log::enabled(Log::Type::P2P, Log::Level::TRACE) == (Log::kMinLevel == Log::Level::TRACE));
+        Log::mVerboseLevel = Log::kDefaultVerboseLevel;
+    }
+
+    SECTION("binary mode stores records unformatted") {
+        auto path = std::string("test_log.bin");
+        REQUIRE(Log::openBinary(path, [](Log::Type, Log::Level l){return l >= Log::Level::INFO;}));
+        CHECK(Log::enabled(Log::Type::DB, Log::Level::INFO));
+
+        std::vector<int> values = {1, 2, 3};
+        Log::i(Log::Type::DB, "int {} uint {:x} double {:.2f}", -4, 255u, 1.5);
+        Log::w(Log::Type::P2P, "{} {} {}", std::string("str"), 'c', true);
+        Log::e(Log::Type::CORE, "vector {}", fmt::join(values, ","));
+        Log::d(Log::Type::CORE, "filtered out");
+        std::thread([](){ Log::i(Log::Type::TIME, "other {}", "thread"); }).join();
+        Log::closeBinary();
+
+        std::vector<Log::Record> records;
+        REQUIRE(Log::decodeBinary(path, [&](const Log::Record& r){ records.emplace_back(r); }));
+        std::remove(path.c_str());
+
+        // The thread buffer is written on thread exit, before ours
+        REQUIRE(records.size() == 4);
+        CHECK(records[0].type == Log::Type::TIME);
+        CHECK(records[0].text == "other thread");
+        CHECK(records[1].type == Log::Type::DB);
+        CHECK(records[1].level == Log::Level::INFO);
+        CHECK(records[1].thread == Log::threadId());
+        CHECK(records[1].text == "int -4 uint ff double 1.50");
+        CHECK(records[2].text == "str c true");
+        CHECK(records[3].text == "vector 1,2,3");
+        CHECK(records[1].time <= records[3].time);
+        CHECK(records[3].time <= Log::Clock::now());
+    }
+
+    SECTION("binary formats are told apart by their contents") {
+        auto path = std::string("test_log.bin");
+        REQUIRE(Log::openBinary(path));
+        // The same storage holds two different formats
+        char format[16];
+        strcpy(format, "first {}");
+        Log::i(Log::Type::DB, fmt::runtime(format), 1);
+        strcpy(format, "second {}");
+        Log::i(Log::Type::DB, fmt::runtime(format), 2);
+        Log::i(Log::Type::DB, "first {}", 3);
+        Log::closeBinary();
+
+        std::vector<std::string> texts;
+        REQUIRE(Log::decodeBinary(path, [&](const Log::Record& r){ texts.emplace_back(r.text); }));
+        std::remove(path.c_str());
+        CHECK(texts == std::vector<std::string>{"first 1", "second 2", "first 3"});
+    }
+
+    SECTION("binary files are flushed and closed while threads log") {
+        Log::mStdout = false;
+        auto path = std::string("test_log.bin");
+        REQUIRE(Log::openBinary(path));
+        std::atomic<bool> stop = false;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back([&](){
+                // Long enough to fill and flush the thread buffers
+                std::string padding(256, 'x');
+                for (int i = 0; !stop; i++)
+                    Log::i(Log::Type::DB, "{} {}", i, padding);
+            });
+        }
+        for (int i = 0; i < 20; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            Log::closeBinary();
+            REQUIRE(Log::openBinary(path));
+        }
+        stop = true;
+        for (auto& thread : threads)
+            thread.join();
+        Log::closeBinary();
+
+        CHECK(Log::decodeBinary(path, [](const Log::Record&){}));
+        std::remove(path.c_str());
+        Log::mStdout = true;
+    }
+
+    SECTION("steady state log calls do not allocate") {
+        Log::mStdout = false;
+        size_t calls = 0;
+        auto c = Log::add([&](Log::Type, Log::Level, std::string_view str){
+            calls += !str.empty();
+        });
+        auto logSome = [](){
+            Log::i(Log::Type::P2P, "Got a connection (fd {}) from {}:{}", 42, "127.0.0.1", 12301);
+            Log::w(Log::Type::P2P, "Socket returned {}", -1);
+        };
+        logSome(); // Warm up the thread buffers
+        auto before = tAllocations;
+        for (int i = 0; i < 100; i++)
+            logSome();
+        CHECK(tAllocations == before);
+        CHECK(calls == 202);
+
+        // Queue slots keep their text, once all of them were used
+        Log::startAsync(8, Log::Overflow::BLOCK);
+        for (int i = 0; i < 8; i++)
+            logSome();
+        Log::flush();
+        before = tAllocations;
+        for (int i = 0; i < 100; i++)
+            logSome();
+        CHECK(tAllocations == before);
+        Log::stopAsync();
+        Log::mStdout = true;
+    }
+
+    SECTION("call site rate limit and sampling") {
+        // Only the explicit reports
+        Log::Limit::mReportInterval = std::chrono::milliseconds(0);
+        auto c = Log::add(saveAll);
+        Log::Limit limit(5);
+        waitNewSecond();
+        for (int i = 0; i < 100; i++)
+            Log::i(Log::Type::P2P, limit, "Got a connection (fd {})", i);
+        REQUIRE(output.size() == 5);
+        CHECK(limit.getSuppressed() == 95);
+        CHECK(std::get<2>(output[4]) == "Got a connection (fd 4)");
+        output.clear();
+        Log::reportSuppressed();
+        REQUIRE(output.size() == 1);
+        CHECK(std::get<0>(output[0]) == Log::Type::P2P);
+        CHECK(std::get<1>(output[0]) == Log::Level::INFO);
+        CHECK(std::get<2>(output[0]).starts_with("Suppressed "));
+        CHECK(std::get<2>(output[0]).ends_with(" records like \"Got a connection (fd {})\""));
+        CHECK(limit.getSuppressed() == 0);
+
+        output.clear();
+        Log log(Log::Type::DB);
+        Log::Limit sample(0, 10);
+        waitNewSecond();
+        for (int i = 0; i < 100; i++)
+            log.w(sample, "{}", i);
+        REQUIRE(output.size() == 10);
+        CHECK(std::get<2>(output[0]) == "0");
+        CHECK(std::get<2>(output.back()) == "90");
+
+        // Disabled records do not count
+        c.wait();
+        Log::Limit disabled(1);
+        for (int i = 0; i < 10; i++)
+            Log::t(Log::Type::P2P, disabled, "not wanted");
+        CHECK(disabled.getSuppressed() == 0);
+        Log::Limit::mReportInterval = std::chrono::seconds(1);
+    }
+
+    SECTION("sinks can use limits while the summaries are logged") {
+        Log::Limit::mReportInterval = std::chrono::milliseconds(0);
+        std::atomic<int> summaries = 0;
+        auto c = Log::add([&](Log::Type, Log::Level, std::string_view str){
+            // Registers and unregisters while the report runs
+            Log::Limit inner(1);
+            if (str.starts_with("Suppressed "))
+                summaries++;
+        });
+        Log::Limit limit(1);
+        waitNewSecond();
+        for (int i = 0; i < 3; i++)
+            Log::i(Log::Type::P2P, limit, "{}", i);
+        CHECK(limit.getSuppressed() == 2);
+        Log::reportSuppressed();
+        CHECK(summaries == 1);
+        Log::Limit::mReportInterval = std::chrono::seconds(1);
+    }
+
+    SECTION("a burst is reported after the site goes quiet") {
+        Log::Limit::mReportInterval = std::chrono::milliseconds(20);
+        std::mutex mutex;
+        std::vector<std::string> reports;
+        auto c = Log::add([&](Log::Type, Log::Level, std::string_view str){
+            std::unique_lock<std::mutex> lock(mutex);
+            reports.emplace_back(str);
+        });
+        Log::Limit limit(1);
+        for (int i = 0; i < 10; i++)
+            Log::i(Log::Type::P2P, limit, "burst {}", i);
+
+        // Nothing else is logged by the site
+        for (int i = 0; i < 100 && limit.getSuppressed() > 0; i++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        CHECK(limit.getSuppressed() == 0);
+        c.wait();
+        std::unique_lock<std::mutex> lock(mutex);
+        CHECK(std::any_of(reports.begin(), reports.end(), [](auto& r){
+            return r.starts_with("Suppressed ") && r.ends_with(" records like \"burst {}\"");
+        }));
+        Log::Limit::mReportInterval = std::chrono::seconds(1);
+    }
+
+    SECTION("records carry their creation time") {
+        std::vector<Log::Record> records;
+        auto c = Log::add([&](Log::Type, Log::Level, std::string_view){
+            records.emplace_back(Log::current());
+        });
+        Log::Clock::mPrecise = true;
+        auto before = Log::Clock::now();
+        Log::i(Log::Type::P2P, "first");
+        Log::i(Log::Type::P2P, "second");
+        auto after = Log::Clock::now();
+        Log::Clock::mPrecise = false;
+
+        REQUIRE(records.size() == 2);
+        CHECK(before <= records[0].time);
+        CHECK(records[0].time <= records[1].time);
+        CHECK(records[1].time <= after);
+
+        // Wall time is only computed on demand
+        auto wall = Log::wallTime(records[0].time);
+        auto diff = std::chrono::system_clock::now() - wall;
+        CHECK(diff >= -std::chrono::milliseconds(50));
+        CHECK(diff < std::chrono::seconds(5));
+
+        // Coarse time is still monotonic, also right after precise
+        auto coarse = Log::Clock::now();
+        CHECK(coarse <= Log::Clock::now());
+        for (int i = 0; i < 1000; i++) {
+            Log::Clock::mPrecise = true;
+            auto last = Log::Clock::now();
+            Log::Clock::mPrecise = false;
+            REQUIRE(last <= Log::Clock::now());
+        }
+    }
+
+    SECTION("batch sinks get the records in bulk") {
+        std::mutex batchesMutex;
+        std::vector<std::vector<Log::Record>> batches;
+        auto saveBatch = [&](std::span<const Log::Record> records){
+            std::unique_lock<std::mutex> lock(batchesMutex);
+            batches.emplace_back(records.begin(), records.end());
+        };
+        auto batchCount = [&](){
+            std::unique_lock<std::mutex> lock(batchesMutex);
+            return batches.size();
+        };
+        {
+            auto c = Log::add(saveAll);
+            auto b = Log::addBatch(saveBatch, [](Log::Type t, Log::Level){return t == Log::Type::DB;},
+                10, std::chrono::hours(1));
+            for (int i = 0; i < 25; i++)
+                Log::i(Log::Type::DB, "{}", i);
+            Log::i(Log::Type::P2P, "filtered out");
+            // Per record callbacks still work alongside
+            CHECK(output.size() == 26);
+            // The full ones are delivered by the flusher thread
+            for (int i = 0; i < 100 && batchCount() < 2; i++)
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            CHECK(batchCount() == 2);
+        }
+        // Removing it delivers the rest
+        REQUIRE(batches.size() == 3);
+        CHECK(batches[0].size() == 10);
+        CHECK(batches[1].size() == 10);
+        REQUIRE(batches[2].size() == 5);
+        CHECK(batches[2][4].text == "24");
+        CHECK(batches[2][4].type == Log::Type::DB);
+        CHECK(batches[2][4].level == Log::Level::INFO);
+        CHECK(batches[2][4].thread == Log::threadId());
+        CHECK(batches[0][0].time <= batches[2][4].time);
+
+        // Old records are delivered by time
+        batches.clear();
+        auto b = Log::addBatch(saveBatch, [](Log::Type, Log::Level){return true;},
+            1000, std::chrono::milliseconds(10));
+        Log::e(Log::Type::DB, "alone");
+        for (int i = 0; i < 100 && batchCount() == 0; i++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        REQUIRE(batchCount() == 1);
+        CHECK(batches[0].back().text == "alone");
+    }
+
+    SECTION("batch callbacks can log into their sink and flush") {
+        std::atomic<size_t> delivered = 0;
+        auto b = Log::addBatch([&](std::span<const Log::Record> records){
+            delivered += records.size();
+            if (records.back().text != "from the callback") {
+                Log::i(Log::Type::DB, "from the callback");
+                Log::flush();
+            }
+        }, [](Log::Type t, Log::Level){return t == Log::Type::DB;}, 2, std::chrono::hours(1));
+        Log::i(Log::Type::DB, "1");
+        Log::i(Log::Type::DB, "2");
+        // The one logged by the callback is not a full batch, it may
+        //  come after the first flush request, not after the second
+        Log::flush();
+        Log::flush();
+        CHECK(delivered == 3);
+    }
+
+    SECTION("flight recorder keeps the last records in order") {
+        auto path = std::string("test_log.rec");
+        std::vector<Log::Record> records;
+        {
+            FlightRecorder recorder;
+            REQUIRE(recorder.open(path, 4096));
+            auto c = Log::add(recorder.sink());
+            Log::t(Log::Type::P2P, "trace is recorded");
+            for (int i = 0; i < 1000; i++)
+                Log::i(Log::Type::DB, "record {}", i);
+            // Read while still open, as after a crash
+            REQUIRE(FlightRecorder::dump(path, [&](const Log::Record& r){ records.emplace_back(r); }));
+        }
+        std::remove(path.c_str());
+
+        // Only the tail fits, and it is complete up to the last one
+        REQUIRE(records.size() > 10);
+        CHECK(records.size() < 1000);
+        auto first = 1000 - records.size();
+        for (size_t i = 0; i < records.size(); i++) {
+            CHECK(records[i].type == Log::Type::DB);
+            CHECK(records[i].level == Log::Level::INFO);
+            CHECK(records[i].thread == Log::threadId());
+            CHECK(records[i].text == fmt::format("record {}", first + i));
+            if (i > 0)
+                CHECK(records[i - 1].time <= records[i].time);
+        }
+        CHECK_FALSE(FlightRecorder::dump("missing.rec", [](const Log::Record&){}));
+    }
+
+    SECTION("flight recorder skips entries with impossible fields") {
+        auto path = std::string("test_log.rec");
+        std::vector<std::string> texts;
+        {
+            FlightRecorder recorder;
+            REQUIRE(recorder.open(path, 4096));
+            auto c = Log::add(recorder.sink());
+            for (auto text : {"a", "b", "c", "d", "e"})
+                Log::i(Log::Type::DB, "{}", text);
+        }
+        {
+            // Each entry is 32 bytes plus one of text, aligned to 40, after the 64 of header
+            std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+            auto poke = [&](size_t entry, size_t offset, const std::string& bytes) {
+                file.seekp(64 + entry * 40 + offset);
+                file.write(bytes.data(), bytes.size());
+            };
+            poke(0, 24, "\xff");              // type
+            poke(1, 25, "\xff");              // level
+            poke(2, 16, "\xff\xff\x00\x00");  // size
+            poke(3, 26, "\x01");              // pad
+        }
+        REQUIRE(FlightRecorder::dump(path, [&](const Log::Record& r){ texts.emplace_back(r.text); }));
+        std::remove(path.c_str());
+        CHECK(texts == std::vector<std::string>{"e"});
+    }
+
+    SECTION("add and remove callbacks while many threads log") {
+        Log::mStdout = false;
+        std::atomic<bool> running = true;
+        std::atomic<size_t> calls = 0;
+        std::atomic<size_t> callsAfterRemove = 0;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 24; t++) {
+            threads.emplace_back([&](){
+                while (running)
+                    Log::i(Log::Type::P2P, "peer {}", 1);
+            });
+        }
+        for (int i = 0; i < 200; i++) {
+            std::atomic<bool> alive = true;
+            auto c = Log::add([&](Log::Type, Log::Level, std::string_view){
+                // Must never be called once removed
+                if (!alive)
+                    callsAfterRemove++;
+                calls++;
+            });
+            std::this_thread::yield();
+            c.wait();
+            alive = false;
+        }
+        running = false;
+        for (auto& t : threads)
+            t.join();
+        Log::mStdout = true;
+        CHECK(calls > 0);
+        CHECK(callsAfterRemove == 0);
+    }
+
+    SECTION("callbacks can not add or remove callbacks") {
+        auto before = Log::getCallbacks().size();
+        bool nestedAsync = true;
+        std::shared_ptr<Lazy> removeSelf;
+        auto c = Log::add([&](Log::Type, Log::Level, std::string_view){
+            // Would wait for this very call
+            Log::add([](Log::Type, Log::Level, std::string_view){});
+            nestedAsync = Log::startAsync();
+            if (removeSelf)
+                removeSelf->wait();
+        });
+        Log::i(Log::Type::P2P, "nested add");
+        CHECK(Log::getCallbacks().size() == before + 1);
+        CHECK_FALSE(nestedAsync);
+        CHECK_FALSE(Log::isAsync());
+
+        // Its removal is rejected and stays, never called
+        removeSelf.reset(new Lazy(Log::add([](Log::Type, Log::Level, std::string_view){}, [](Log::Type, Log::Level){return false;})));
+        Log::i(Log::Type::P2P, "nested remove");
+        CHECK(Log::getCallbacks().size() == before + 2);
+        c.wait();
+        CHECK(Log::getCallbacks().size() == before + 1);
+    }
+
+    SECTION("async mode delivers in order from the flusher") {
+        std::vector<size_t> threads;
+        auto c = Log::add([&](Log::Type t, Log::Level l, std::string_view str){
+            saveAll(t, l, str);
+            threads.emplace_back(Log::current().thread);
+        });
+        REQUIRE(Log::startAsync());
+        CHECK(Log::isAsync());
+        for (int i = 0; i < 100; i++)
+            Log::i(Log::Type::P2P, "{}", i);
+        Log::flush();
+
+        REQUIRE(output.size() == 100);
+        for (int i = 0; i < 100; i++) {
+            CHECK(std::get<2>(output[i]) == fmt::format("{}", i));
+            CHECK(threads[i] == Log::threadId());
+        }
+
+        Log::i(Log::Type::P2P, "last");
+        Log::stopAsync();
+        CHECK_FALSE(Log::isAsync());
+        CHECK(output.size() == 101);
+    }
+
+    SECTION("async mode overflow policies") {
+        // Block the flusher inside a callback, so the queue fills up
+        std::atomic<bool> hold = true, entered = false;
+        auto c = Log::add([&](Log::Type t, Log::Level l, std::string_view str){
+            entered = true;
+            while (hold)
+                std::this_thread::yield();
+            saveAll(t, l, str);
+        });
+        Log::startAsync(4, Log::Overflow::DROP);
+        auto dropped = Log::getDropped();
+        // The producers keep going while the flusher is inside a callback
+        Log::i(Log::Type::P2P, "{}", 0);
+        while (!entered)
+            std::this_thread::yield();
+        for (int i = 1; i < 20; i++)
+            Log::i(Log::Type::P2P, "{}", i);
+        CHECK(Log::getDropped() > dropped);
+        hold = false;
+        Log::stopAsync();
+        CHECK(output.size() == 20 - (Log::getDropped() - dropped));
+
+        output.clear();
+        hold = true;
+        Log::startAsync(4, Log::Overflow::BLOCK);
+        dropped = Log::getDropped();
+        std::thread release([&](){
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            hold = false;
+        });
+        for (int i = 0; i < 20; i++)
+            Log::i(Log::Type::P2P, "{}", i);
+        release.join();
+        Log::stopAsync();
+        CHECK(Log::getDropped() == dropped);
+        CHECK(output.size() == 20);
+    }
 }
 
 TEST_CASE("benchmark log functionality", "[.][Log]") {
     Log::mStdout = false;
 
     std::vector<std::tuple<Log::Type, Log::Level, std::string>> output;
-    auto saveAll = [&](Log::Type t, Log::Level l, const std::string& str){
+    std::mutex outputMutex;
+    auto saveAll = [&](Log::Type t, Log::Level l, std::string_view str){
+        std::unique_lock<std::mutex> lock(outputMutex);
         output.emplace_back(t, l, str);
     };
     std::vector<int> costlyVector(10000, 0);
@@ -61,14 +600,73 @@ TEST_CASE("benchmark log functionality", "[.][Log]") {
         Log::e(Log::Type::P2P, "asd");
     };
 
+    // Allocations per call once the thread buffers are warm, should be 0
+    {
+        auto c = Log::add([](Log::Type, Log::Level, std::string_view){});
+        BENCHMARK("call with arguments, steady state"){
+            Log::i(Log::Type::P2P, "Got a connection (fd {}) from {}:{}", 42, "127.0.0.1", 12301);
+        };
+        auto before = tAllocations;
+        constexpr auto kCalls = 10000;
+        for (int i = 0; i < kCalls; i++)
+            Log::i(Log::Type::P2P, "Got a connection (fd {}) from {}:{}", 42, "127.0.0.1", 12301);
+        fmt::print("allocations per log call: {}\n", double(tAllocations - before) / kCalls);
+    }
+
+    // Disabled TRACE, today a single atomic load vs the previous
+    //  lock + walk through all the filters
+    std::mutex filterMutex;
+    auto callbacks = Log::getCallbacks();
+    BENCHMARK("disabled TRACE call"){
+        Log::t(Log::Type::P2P, "Packet on connected peer (size {})", 42);
+    };
+    BENCHMARK("disabled TRACE call, lock and filter walk"){
+        std::unique_lock<std::mutex> lock(filterMutex);
+        bool wanted = false;
+        for (auto& [id, callback] : callbacks)
+            wanted |= callback.first(Log::Type::P2P, Log::Level::TRACE);
+        return wanted;
+    };
+
     BENCHMARK("add remove callback"){
         auto c = Log::add(saveAll);
         c.wait();
     };
 
+    {
+        // Other threads logging do not slow down adding/removing
+        std::atomic<bool> running = true;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back([&](){
+                while (running)
+                    Log::e(Log::Type::P2P, "asd");
+            });
+        }
+        BENCHMARK("add remove callback while 4 threads log"){
+            auto c = Log::add(saveAll, [](Log::Type, Log::Level){return false;});
+            c.wait();
+        };
+        running = false;
+        for (auto& t : threads)
+            t.join();
+    }
+
     BENCHMARK("empty call with costly argument"){
         Log::e(Log::Type::P2P, "{}", fmt::join(costlyVector, ","));
     };
+
+    // Binary mode only copies the arguments, formatting happens on decode
+    BENCHMARK("add/remove + call with cheap arguments"){
+        auto c = Log::add(saveAll);
+        Log::e(Log::Type::P2P, "Packet on connected peer (size {}) from {}", 42, "127.0.0.1");
+    };
+    Log::openBinary("benchmark_log.bin");
+    BENCHMARK("binary call with cheap arguments"){
+        Log::e(Log::Type::P2P, "Packet on connected peer (size {}) from {}", 42, "127.0.0.1");
+    };
+    Log::closeBinary();
+    std::remove("benchmark_log.bin");
     BENCHMARK("add/remove + call with costly argument"){
         auto c = Log::add(saveAll);
         Log::e(Log::Type::P2P, "{}", fmt::join(costlyVector, ","));
@@ -77,4 +675,39 @@ TEST_CASE("benchmark log functionality", "[.][Log]") {
         auto c = Log::add(saveAll);
         Log::e(Log::Type::P2P, "");
     };
+
+    // Many threads logging at the same time, sync vs async dispatch
+    //  the sink simulates some work, like writing to a terminal
+    std::atomic<size_t> count = 0;
+    auto c = Log::add([&](Log::Type, Log::Level, std::string_view str){
+        for (int i = 0; i < 16; i++)
+            count += std::hash<std::string_view>{}(str);
+    });
+    constexpr auto kThreads = 4;
+    constexpr auto kCalls = 1000;
+    auto logFromThreads = [&](){
+        std::vector<std::thread> threads;
+        for (int t = 0; t < kThreads; t++) {
+            threads.emplace_back([](){
+                for (int i = 0; i < kCalls; i++)
+                    Log::i(Log::Type::P2P, "message {} with some payload", i);
+            });
+        }
+        for (auto& t : threads)
+            t.join();
+    };
+
+    BENCHMARK("4 threads x 1000 calls, sync"){
+        logFromThreads();
+    };
+
+    Log::startAsync(kThreads * kCalls, Log::Overflow::BLOCK);
+    BENCHMARK("4 threads x 1000 calls, async"){
+        logFromThreads();
+    };
+    BENCHMARK("4 threads x 1000 calls, async+flush"){
+        logFromThreads();
+        Log::flush();
+    };
+    Log::stopAsync();
 }
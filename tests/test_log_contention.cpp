@@ -0,0 +1,101 @@
+#include <catch2/catch_all.hpp>
+#include <fmt/core.h>
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "core/log.h"
+
+// Many producer threads logging at once, throughput and latency per call
+//  run with: native-tests "[Contention]"
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    constexpr size_t kTotalCalls = 64 * 1024;
+
+    struct Result {
+        double callsPerSecond;
+        std::chrono::nanoseconds p50;
+        std::chrono::nanoseconds p99;
+        size_t calls;
+    };
+
+    template <class F>
+    Result run(size_t numThreads, F&& call) {
+        auto callsPerThread = kTotalCalls / numThreads;
+        std::vector<std::vector<Clock::duration>> latencies(numThreads);
+        std::atomic<size_t> ready = 0;
+        std::atomic<bool> go = false;
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < numThreads; t++) {
+            threads.emplace_back([&, t](){
+                auto& lat = latencies[t];
+                lat.resize(callsPerThread);
+                ready++;
+                while (!go)
+                    std::this_thread::yield();
+                for (size_t i = 0; i < callsPerThread; i++) {
+                    auto start = Clock::now();
+                    call(i);
+                    lat[i] = Clock::now() - start;
+                }
+            });
+        }
+        while (ready != numThreads)
+            std::this_thread::yield();
+        auto start = Clock::now();
+        go = true;
+        for (auto& t : threads)
+            t.join();
+        std::chrono::duration<double> elapsed = Clock::now() - start;
+
+        std::vector<Clock::duration> all;
+        for (auto& lat : latencies)
+            all.insert(all.end(), lat.begin(), lat.end());
+        auto percentile = [&](double p){
+            auto it = all.begin() + static_cast<size_t>(p * (all.size() - 1));
+            std::nth_element(all.begin(), it, all.end());
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(*it);
+        };
+        return {all.size() / elapsed.count(), percentile(0.5), percentile(0.99), all.size()};
+    }
+
+    // Sinks do little work, without sharing anything between threads
+    thread_local size_t tSinkBytes = 0;
+};
+
+TEST_CASE("log contention benchmark", "[.][Log][Contention]") {
+    Log::mStdout = false;
+
+    fmt::print("{:>7} {:>5} {:>8} {:>5} | {:>12} {:>8} {:>8}\n",
+        "threads", "sinks", "level", "size", "calls/s", "p50 ns", "p99 ns");
+    for (size_t numSinks : {0, 1, 4}) {
+        // Sinks only want INFO and above, TRACE is the disabled case
+        std::vector<std::unique_ptr<Lazy>> sinks;
+        for (size_t s = 0; s < numSinks; s++) {
+            sinks.emplace_back(new Lazy(Log::add([](Log::Type, Log::Level, std::string_view text){
+                tSinkBytes += text.size();
+            }, [](Log::Type, Log::Level l){return l >= Log::Level::INFO;})));
+        }
+        for (auto level : {Log::Level::TRACE, Log::Level::INFO}) {
+            for (size_t size : {16, 256, 4096}) {
+                std::string payload(size, 'x');
+                for (size_t numThreads : {1, 4, 16, 64}) {
+                    auto result = run(numThreads, [&](size_t i){
+                        Log::log(Log::Type::P2P, level, "{} {}", i, std::string_view(payload));
+                    });
+                    fmt::print("{:>7} {:>5} {:>8} {:>5} | {:>12.0f} {:>8} {:>8}\n",
+                        numThreads, numSinks, magic_enum::enum_name(level), size,
+                        result.callsPerSecond, result.p50.count(), result.p99.count());
+                    CHECK(result.calls == kTotalCalls / numThreads * numThreads);
+                }
+                // Disabled calls do not depend on the message size
+                if (level == Log::Level::TRACE || numSinks == 0)
+                    break;
+            }
+        }
+    }
+    Log::mStdout = true;
+}
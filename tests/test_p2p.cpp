@@ -2,8 +2,12 @@
 #include <process.h>
 #include <fmt/core.h>
 #include <chrono>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <filesystem>
 
 #include "p2p/p2p.h"
+#include "allocations.h"
 
 namespace {
     using namespace std::chrono_literals;
@@ -13,6 +17,50 @@ namespace {
     constexpr auto kPort1 = 12301;
     constexpr auto kPort2 = 12302;
     constexpr auto kPort3 = 12303;
+
+    // A plain socket talking to a local node, -1 if it can not connect.
+    //  A receive buffer size is set before connecting, as the window
+    //  depends on it
+    int connectRaw(int port, int recvBuffer = 0) {
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0)
+            return -1;
+        if (recvBuffer > 0)
+            setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &recvBuffer, sizeof(recvBuffer));
+        if (::connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
+
+    // Calls f with each message received until it returns true, false
+    //  if the deadline passes before
+    template <class F>
+    bool readMessages(int sock, F&& f, std::chrono::steady_clock::time_point deadline) {
+        msgpack::unpacker unp;
+        while (std::chrono::steady_clock::now() < deadline) {
+            unp.reserve_buffer(P2P::kUpackBuffer);
+            auto n = recv(sock, unp.buffer(), P2P::kUpackBuffer, MSG_DONTWAIT);
+            if (n <= 0) {
+                std::this_thread::sleep_for(1ms);
+                continue;
+            }
+            unp.buffer_consumed(n);
+            msgpack::object_handle result;
+            while (unp.next(result)) {
+                bool done = false;
+                Msg::decode(result.get(), 0, [&](const auto& m){ done = f(m); });
+                if (done)
+                    return true;
+            }
+        }
+        return false;
+    }
 };
 
 TEST_CASE("basic functionality", "[P2P]") {
@@ -102,4 +150,786 @@ TEST_CASE("connect one to another", "[P2P]") {
         CHECK(client2.getNumClients() == 2);
         CHECK(client3.getNumClients() == 2);
     }
+
+    SECTION("one attempt at a time, failed ones free it") {
+        // Nobody listens on 3, then it tries the one waiting
+        client2.mMaxConnecting = 1;
+        client2.mBootStrap = {fmt::format("127.0.0.1:{}", kPort3), fmt::format("127.0.0.1:{}", kPort1)};
+        client2.start();
+        std::this_thread::sleep_for(kWaitTimeOut);
+
+        CHECK(client1.getNumClients() == 1);
+        CHECK(client2.getNumClients() == 1);
+    }
+
+    SECTION("local failures stop the attempts, not the addresses") {
+        // Not running, it is dialed once started
+        client2.aConnect(fmt::format("127.0.0.1:{}", kPort1));
+        CHECK(client2.getNumClients() == 0);
+        REQUIRE(client2.start());
+        std::this_thread::sleep_for(kWaitTimeOut);
+        CHECK(client1.getNumClients() == 1);
+
+        // Out of fds, no socket for the one it picks. The others it
+        //  learnt meanwhile are held, so it is that one
+        std::vector<std::string> held;
+        while (auto address = client2.mAddresses.select())
+            held.push_back(*address);
+        struct rlimit limit;
+        REQUIRE(getrlimit(RLIMIT_NOFILE, &limit) == 0);
+        auto old = limit;
+        int lowest = dup(0);
+        REQUIRE(lowest >= 0);
+        close(lowest);
+        limit.rlim_cur = lowest;
+        REQUIRE(setrlimit(RLIMIT_NOFILE, &limit) == 0);
+        client2.aConnect(fmt::format("127.0.0.1:{}", kPort3));
+        REQUIRE(setrlimit(RLIMIT_NOFILE, &old) == 0);
+        // It waits, without counting as a failure of the address
+        for (auto& address : held)
+            client2.mAddresses.release(address);
+        CHECK(client2.mAddresses.weight(fmt::format("127.0.0.1:{}", kPort3)) == AddressManager::kNeutralWeight);
+        while (auto address = client2.mAddresses.select())
+            CHECK(*address != fmt::format("127.0.0.1:{}", kPort3));
+        CHECK(client2.getNumClients() == 1);
+    }
+
+    SECTION("broadcast once to the selected peers") {
+        // A ready peer and a socket that never sends its PeerInfo
+        client2.start();
+        int sock = connectRaw(kPort1);
+        REQUIRE(sock >= 0);
+        std::this_thread::sleep_for(kWaitTimeOut);
+        REQUIRE(client1.getNumClients() == 2);
+
+        char buffer[4096];
+        while (recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {}
+
+        Msg::Discovery msg {{"127.0.0.1:1"}};
+        auto stats = client1.broadcast(msg);
+        CHECK(stats.mBytes == Msg::pack(msg)->size());
+        CHECK(stats.mQueued + stats.mDeferred == 1);
+        CHECK(stats.mFiltered == 1);
+
+        const Peer* ready = nullptr;
+        client1.mPeers.forEach([&](Peer& p){ if (p.mReady) ready = &p; });
+        REQUIRE(ready != nullptr);
+        stats = client1.broadcast(msg, {ready, false});
+        CHECK(stats.mQueued + stats.mDeferred == 1);
+        CHECK(stats.mFiltered == 1);
+        std::this_thread::sleep_for(kWaitTimeOut);
+        CHECK(recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT) == static_cast<ssize_t>(stats.mBytes));
+        close(sock);
+    }
+
+    SECTION("broadcast over an outbound connection") {
+        // 2 connected to 1, it is ready once 1 sent its PeerInfo
+        client2.start();
+        std::this_thread::sleep_for(kWaitTimeOut);
+        REQUIRE(client2.getNumClients() == 1);
+        client2.mPeers.forEach([&](Peer& p){
+            CHECK(p.mDirection == Peer::Direction::OUT);
+            CHECK(p.mReady);
+        });
+
+        auto stats = client2.broadcast(Msg::Discovery {{"127.0.0.1:1"}});
+        CHECK(stats.mQueued + stats.mDeferred == 1);
+        CHECK(stats.mFiltered == 0);
+        std::this_thread::sleep_for(kWaitTimeOut / 4);
+        CHECK(client1.mAddresses.contains("127.0.0.1:1"));
+    }
+
+    SECTION("peers that do not read are closed or throttled at the high water") {
+        auto slowPolicy = GENERATE(P2P::SlowPeer::DISCONNECT, P2P::SlowPeer::THROTTLE);
+        client1.stop();
+        client1.mSendHighWater = 256 * 1024;
+        client1.mSlowPeer = slowPolicy;
+        REQUIRE(client1.start());
+
+        int sock = connectRaw(kPort1, 4096);
+        REQUIRE(sock >= 0);
+        std::this_thread::sleep_for(kWaitTimeOut / 4);
+        REQUIRE(client1.getNumClients() == 1);
+
+        // Until the socket does not take more, then queued
+        Msg::Data data {{Msg::Item::Kind::BLOCK, {}}, std::string(16 * 1024, 'x')};
+        auto slow = [&](){
+            bool found = false;
+            client1.mPeers.forEach([&](Peer& p){ found = p.mThrottled || p.mClosing; });
+            return found || client1.getNumClients() == 0;
+        };
+        for (int i = 0; i < 4096 && !slow(); i++)
+            client1.broadcast(data, {nullptr, false});
+        REQUIRE(slow());
+        std::this_thread::sleep_for(kWaitTimeOut / 4);
+
+        if (slowPolicy == P2P::SlowPeer::DISCONNECT) {
+            CHECK(client1.getNumClients() == 0);
+        } else {
+            REQUIRE(client1.getNumClients() == 1);
+            client1.mPeers.forEach([&](Peer& p){
+                CHECK(p.mThrottled);
+                CHECK(p.mOutboundBytes > client1.mSendHighWater);
+            });
+            // Reading it flushes the queue on EPOLLOUT, then it is read again
+            char buffer[64 * 1024];
+            auto deadline = std::chrono::steady_clock::now() + 4 * kWaitTimeOut;
+            size_t queued = 1;
+            while (queued > 0 && std::chrono::steady_clock::now() < deadline) {
+                while (recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {}
+                std::this_thread::sleep_for(1ms);
+                client1.mPeers.forEach([&](Peer& p){ queued = p.mOutboundBytes; });
+            }
+            CHECK(queued == 0);
+            client1.mPeers.forEach([&](Peer& p){ CHECK_FALSE(p.mThrottled); });
+        }
+        close(sock);
+    }
+
+    SECTION("reactor commands over the queue capacity are all delivered") {
+        int sock = connectRaw(kPort1);
+        REQUIRE(sock >= 0);
+        std::this_thread::sleep_for(kWaitTimeOut / 4);
+        char buffer[64 * 1024];
+        while (recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {}
+
+        // While we hold the peer, every broadcast is deferred to the
+        //  reactor, which waits for it on the first one, so the rest
+        //  fill its queue and overflow
+        int fd = -1;
+        client1.mPeers.forEach([&](Peer& p){ fd = p.mFd; });
+        std::unique_lock<std::recursive_mutex> lock;
+        REQUIRE(client1.mPeers.lock(fd, lock) != nullptr);
+
+        constexpr int kThreads = 4;
+        constexpr int kPerThread = P2P::kEventQueueLen;
+        Msg::Discovery msg {{"127.0.0.1:1"}};
+        std::atomic<unsigned> deferred = 0;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < kThreads; t++) {
+            threads.emplace_back([&](){
+                for (int i = 0; i < kPerThread; i++)
+                    deferred += client1.broadcast(msg, {nullptr, false}).mDeferred;
+            });
+        }
+        for (auto& thread : threads)
+            thread.join();
+        CHECK(deferred == kThreads * kPerThread);
+        lock.unlock();
+
+        size_t expected = kThreads * kPerThread * Msg::pack(msg)->size(), received = 0;
+        auto deadline = std::chrono::steady_clock::now() + 4 * kWaitTimeOut;
+        while (received < expected && std::chrono::steady_clock::now() < deadline) {
+            auto n = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (n > 0)
+                received += n;
+            else
+                std::this_thread::sleep_for(1ms);
+        }
+        CHECK(received == expected);
+        close(sock);
+    }
+
+    SECTION("pipelined messages of one write are all handled") {
+        int sock = connectRaw(kPort1);
+        REQUIRE(sock >= 0);
+        std::this_thread::sleep_for(kWaitTimeOut / 4);
+        char buffer[4096];
+        while (recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {}
+
+        // Several reads worth of pings, each one is answered
+        constexpr uint64_t kPings = 1000;
+        msgpack::sbuffer pings;
+        for (uint64_t i = 1; i <= kPings; i++)
+            Msg::encode(pings, Msg::Ping{i, 0});
+        REQUIRE(pings.size() > P2P::kUpackBuffer);
+        REQUIRE(::send(sock, pings.data(), pings.size(), 0) == static_cast<ssize_t>(pings.size()));
+
+        uint64_t pongs = 0, last = 0;
+        readMessages(sock, [&](const auto& m){
+            if constexpr (std::is_same_v<std::decay_t<decltype(m)>, Msg::Pong>) {
+                CHECK(m.mNonce == ++last);
+                pongs++;
+            }
+            return pongs == kPings;
+        }, std::chrono::steady_clock::now() + kWaitTimeOut);
+        CHECK(pongs == kPings);
+        close(sock);
+    }
+
+    SECTION("gossip, each item is fetched once") {
+        std::atomic<int> received[3] = {};
+        P2P* clients[3] = {&client1, &client2, &client3};
+        for (int i = 0; i < 3; i++) {
+            clients[i]->mOnItem = [&, i](const Msg::Item&, std::string_view data){
+                CHECK(data == "block");
+                received[i]++;
+                return true;
+            };
+        }
+        client2.start();
+        std::this_thread::sleep_for(kWaitTimeOut);
+        client3.start();
+        std::this_thread::sleep_for(2*kWaitTimeOut);
+        REQUIRE(client3.getNumClients() == 2);
+
+        // 3 hears about it from 1 and 2, asks one of them
+        Msg::Item item {Msg::Item::Kind::BLOCK, {"some hash"}};
+        CHECK(client2.announce(item, "block") == true);
+        CHECK(client2.announce(item, "block") == false);
+        std::this_thread::sleep_for(kWaitTimeOut);
+        CHECK(received[0] == 1);
+        CHECK(received[1] == 0);
+        CHECK(received[2] == 1);
+    }
+
+    SECTION("invalid data is dropped, the peer banned and the next one asked") {
+        std::atomic<int> accepted = 0, rejected = 0;
+        client1.mOnItem = [&](const Msg::Item&, std::string_view data){
+            (data == "block" ? accepted : rejected)++;
+            return data == "block";
+        };
+        client2.start();
+        std::this_thread::sleep_for(kWaitTimeOut);
+        REQUIRE(client1.getNumClients() == 1);
+
+        int sock = connectRaw(kPort1);
+        REQUIRE(sock >= 0);
+
+        // The raw peer announces it first, so it is asked for it
+        Msg::Item item {Msg::Item::Kind::BLOCK, {"some hash"}};
+        msgpack::sbuffer out;
+        Msg::encode(out, Msg::Inventory{{item}});
+        REQUIRE(::send(sock, out.data(), out.size(), 0) == static_cast<ssize_t>(out.size()));
+
+        REQUIRE(readMessages(sock, [](const auto& m){
+            return std::is_same_v<std::decay_t<decltype(m)>, Msg::GetData>;
+        }, std::chrono::steady_clock::now() + kWaitTimeOut));
+
+        // 2 announces it meanwhile, then the raw peer sends it wrong
+        CHECK(client2.announce(item, "block") == true);
+        std::this_thread::sleep_for(kWaitTimeOut / 4);
+        CHECK(accepted == 0);
+        out.clear();
+        Msg::encode(out, Msg::Data{item, "evil"});
+        REQUIRE(::send(sock, out.data(), out.size(), 0) == static_cast<ssize_t>(out.size()));
+        std::this_thread::sleep_for(kWaitTimeOut);
+
+        CHECK(rejected == 1);
+        CHECK(accepted == 1);
+        char buffer[4096];
+        ssize_t n;
+        while ((n = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {}
+        CHECK(n == 0);
+        CHECK(client1.getNumClients() == 1);
+        close(sock);
+    }
+
+    SECTION("items a peer does not send are asked to the others") {
+        std::atomic<int> accepted = 0;
+        client1.stop();
+        client1.mFetchTimeout = 3*kWaitTimeOut;
+        client1.mOnItem = [&](const Msg::Item&, std::string_view){
+            accepted++;
+            return true;
+        };
+        REQUIRE(client1.start());
+        client2.start();
+        std::this_thread::sleep_for(kWaitTimeOut);
+        REQUIRE(client1.getNumClients() == 1);
+
+        int sock = connectRaw(kPort1);
+        REQUIRE(sock >= 0);
+
+        // The raw peer announces them first and never sends them
+        Msg::Item one {Msg::Item::Kind::BLOCK, {"one"}};
+        Msg::Item two {Msg::Item::Kind::BLOCK, {"two"}};
+        msgpack::sbuffer out;
+        Msg::encode(out, Msg::Inventory{{one, two}});
+        REQUIRE(::send(sock, out.data(), out.size(), 0) == static_cast<ssize_t>(out.size()));
+
+        size_t asked = 0;
+        readMessages(sock, [&](const auto& m){
+            if constexpr (std::is_same_v<std::decay_t<decltype(m)>, Msg::GetData>)
+                asked += m.mItems.size();
+            return asked == 2;
+        }, std::chrono::steady_clock::now() + kWaitTimeOut);
+        REQUIRE(asked == 2);
+
+        // 2 announces them meanwhile, and is asked once the raw peer
+        //  times out, before that if it disconnects
+        CHECK(client2.announce(one, "block") == true);
+        CHECK(client2.announce(two, "block") == true);
+        std::this_thread::sleep_for(kWaitTimeOut / 4);
+        CHECK(accepted == 0);
+        shutdown(sock, SHUT_WR);
+        std::this_thread::sleep_for(kWaitTimeOut);
+        CHECK(accepted == 2);
+        close(sock);
+
+        // Silent until the deadline, with the connection open
+        sock = connectRaw(kPort1);
+        REQUIRE(sock >= 0);
+        std::this_thread::sleep_for(kWaitTimeOut / 4);
+        Msg::Item late {Msg::Item::Kind::TX, {"late"}};
+        out.clear();
+        Msg::encode(out, Msg::Inventory{{late}});
+        REQUIRE(::send(sock, out.data(), out.size(), 0) == static_cast<ssize_t>(out.size()));
+        std::this_thread::sleep_for(kWaitTimeOut / 4);
+        CHECK(client2.announce(late, "tx") == true);
+        std::this_thread::sleep_for(kWaitTimeOut);
+        CHECK(accepted == 2);
+        std::this_thread::sleep_for(3*kWaitTimeOut);
+        CHECK(accepted == 3);
+        CHECK(client1.getNumClients() == 2);
+        close(sock);
+    }
+
+    SECTION("one peer can not take all the requests") {
+        std::atomic<int> accepted = 0;
+        client1.mOnItem = [&](const Msg::Item&, std::string_view){
+            accepted++;
+            return true;
+        };
+        client2.start();
+        std::this_thread::sleep_for(kWaitTimeOut);
+        REQUIRE(client1.getNumClients() == 1);
+
+        int sock = connectRaw(kPort1);
+        REQUIRE(sock >= 0);
+
+        // Fake ones it never sends, over its share
+        Msg::Inventory fake;
+        for (size_t i = 0; i < 2 * P2P::kMaxRequestedPerPeer; i++) {
+            Msg::Item item {Msg::Item::Kind::TX, {}};
+            memcpy(item.mHash.data(), &i, sizeof(i));
+            fake.mItems.push_back(item);
+        }
+        msgpack::sbuffer out;
+        Msg::encode(out, fake);
+        REQUIRE(::send(sock, out.data(), out.size(), 0) == static_cast<ssize_t>(out.size()));
+
+        // All it asks until the deadline
+        size_t asked = 0;
+        readMessages(sock, [&](const auto& m){
+            if constexpr (std::is_same_v<std::decay_t<decltype(m)>, Msg::GetData>)
+                asked += m.mItems.size();
+            return false;
+        }, std::chrono::steady_clock::now() + kWaitTimeOut);
+        CHECK(asked == P2P::kMaxRequestedPerPeer);
+
+        // The real ones of the others are still fetched
+        Msg::Item item {Msg::Item::Kind::BLOCK, {"real"}};
+        CHECK(client2.announce(item, "block") == true);
+        std::this_thread::sleep_for(kWaitTimeOut);
+        CHECK(accepted == 1);
+        close(sock);
+    }
+
+    SECTION("pings measure the round trip, the silent peers are closed") {
+        client1.stop();
+        client1.mPingInterval = 20ms;
+        client1.mPingTimeout = 100ms;
+        REQUIRE(client1.start());
+        client2.start();
+        int sock = connectRaw(kPort1);
+        REQUIRE(sock >= 0);
+        std::this_thread::sleep_for(kWaitTimeOut / 4);
+        REQUIRE(client1.getNumClients() == 2);
+
+        std::this_thread::sleep_for(2*kWaitTimeOut);
+        CHECK(client1.getNumClients() == 1);
+        client1.mPeers.forEach([&](Peer& p){
+            CHECK(p.mRtt > 0us);
+            CHECK(p.mRtt < kWaitTimeOut);
+        });
+        close(sock);
+    }
+
+    SECTION("the round trip does not trust the echoed time") {
+        client1.stop();
+        client1.mPingInterval = 20ms;
+        REQUIRE(client1.start());
+        int sock = connectRaw(kPort1);
+        REQUIRE(sock >= 0);
+
+        // Answered at once, claiming it was sent long ago
+        REQUIRE(readMessages(sock, [&](const auto& m){
+            if constexpr (std::is_same_v<std::decay_t<decltype(m)>, Msg::Ping>) {
+                msgpack::sbuffer out;
+                Msg::encode(out, Msg::Pong{m.mNonce, 0});
+                REQUIRE(::send(sock, out.data(), out.size(), 0) == static_cast<ssize_t>(out.size()));
+                return true;
+            }
+            return false;
+        }, std::chrono::steady_clock::now() + kWaitTimeOut));
+        std::this_thread::sleep_for(kWaitTimeOut / 4);
+        client1.mPeers.forEach([&](Peer& p){
+            CHECK(p.mRtt > 0us);
+            CHECK(p.mRtt < kWaitTimeOut);
+        });
+        close(sock);
+    }
+
+    SECTION("over the limit, the slowest peer is rotated out") {
+        client1.stop();
+        client1.mPingInterval = 20ms;
+        client1.mMaxPeers = 1;
+        REQUIRE(client1.start());
+        client2.start();
+        std::this_thread::sleep_for(kWaitTimeOut);
+        client3.start();
+        std::this_thread::sleep_for(2*kWaitTimeOut);
+
+        // Both connected, one is closed and waits to connect again
+        CHECK(client1.getNumClients() == 1);
+        CHECK(client2.getNumClients() + client3.getNumClients() == 3);
+    }
+}
+
+TEST_CASE("io_uring backend", "[P2P]") {
+    P2P client1, client2;
+
+    // Falls back to epoll if the kernel does not support it
+    client1.mBootStrap = {};
+    client1.mListenPort = kPort1;
+    client1.mBackend = P2P::Backend::URING;
+    client2.mBootStrap = {fmt::format("127.0.0.1:{}", kPort1)};
+    client2.mListenPort = kPort2;
+    client2.mBackend = P2P::Backend::URING;
+
+    REQUIRE(client1.start());
+
+    SECTION("epoll unless asked") {
+        P2P other;
+        other.mListenPort = kPort3;
+        REQUIRE(other.start());
+        CHECK(other.getBackend() == P2P::Backend::EPOLL);
+    }
+    SECTION("receive a connection and handle it") {
+        procxx::process telnet{"telnet", "127.0.0.1", fmt::format("{}", kPort1)};
+        telnet.exec();
+        std::this_thread::sleep_for(kWaitTimeOut);
+        CHECK(client1.getNumClients() == 1);
+        telnet.close(procxx::pipe_t::write_end());
+        std::this_thread::sleep_for(kWaitTimeOut);
+        CHECK(client1.getNumClients() == 0);
+    }
+    SECTION("connect 2 -> 1") {
+        client2.start();
+        std::this_thread::sleep_for(kWaitTimeOut);
+
+        CHECK(client1.getNumClients() == 1);
+        CHECK(client2.getNumClients() == 1);
+
+        client2.stop();
+        std::this_thread::sleep_for(kWaitTimeOut);
+
+        CHECK(client1.getNumClients() == 0);
+        CHECK(client2.getNumClients() == 0);
+    }
+    SECTION("a full ring does not wait for the completions it holds") {
+        // Nothing to check if the kernel lacks it
+        Uring ring;
+        if (ring.open(4)) {
+            // Its completions overflow, nothing reaps them while queuing.
+            //  Older kernels refuse more (EBUSY), newer ones keep them
+            unsigned queued = 0;
+            while (queued < 256) {
+                auto sqe = ring.sqe();
+                if (!sqe)
+                    break;
+                sqe->opcode = IORING_OP_NOP;
+                queued++;
+            }
+            CHECK(queued > 4);
+            // Once reaped it takes them again
+            ring.submitAndWait(0);
+            unsigned reaped = 0;
+            while (auto num = ring.forEachCqe([](const io_uring_cqe&){}))
+                reaped += num;
+            CHECK(reaped > 0);
+            CHECK(ring.sqe() != nullptr);
+        }
+    }
+}
+
+TEST_CASE("message registry", "[P2P]") {
+    auto decode = [](const msgpack::sbuffer& buffer, auto&& f) {
+        auto handle = msgpack::unpack(buffer.data(), buffer.size(), &Peer::referenceAll);
+        Msg::decode(handle.get(), buffer.size(), f);
+    };
+
+    SECTION("encoded payloads are decoded as their type") {
+        msgpack::sbuffer buffer;
+        Msg::encode(buffer, Msg::Disconnect {Msg::Disconnect::Reason::ROTATING, "bye"});
+        int calls = 0;
+        decode(buffer, [&](const auto& m){
+            using T = std::decay_t<decltype(m)>;
+            if constexpr (std::is_same_v<T, Msg::DisconnectView>) {
+                CHECK(m.mReason == Msg::Disconnect::Reason::ROTATING);
+                CHECK(m.mText == "bye");
+                calls++;
+            } else {
+                FAIL("decoded as another type");
+            }
+        });
+        CHECK(calls == 1);
+        STATIC_REQUIRE(Msg::kTypeOf<Msg::Discovery> == Msg::Type::DISCOVERY);
+    }
+    SECTION("unknown types are rejected") {
+        msgpack::sbuffer buffer;
+        msgpack::packer<msgpack::sbuffer> packer(buffer);
+        packer.pack_array(2);
+        packer.pack_uint32(Msg::kNumTypes);
+        packer.pack_nil();
+        CHECK_THROWS(decode(buffer, [](const auto&){ FAIL("decoded"); }));
+    }
+    SECTION("oversized messages are rejected before converting them") {
+        Msg::Discovery discovery;
+        discovery.mAddresses.assign(Msg::Payload<Msg::Type::DISCOVERY>::kMaxSize / 16, "127.0.0.1:11250");
+        msgpack::sbuffer buffer;
+        Msg::encode(buffer, discovery);
+        REQUIRE(buffer.size() > Msg::Payload<Msg::Type::DISCOVERY>::kMaxSize);
+        CHECK_THROWS_AS(decode(buffer, [](const auto&){ FAIL("decoded"); }), std::length_error);
+    }
+}
+
+namespace {
+    // A welcome, the same peer info many times, and a disconnect
+    msgpack::sbuffer chattyFrames(uint32_t uid, size_t num) {
+        msgpack::sbuffer buffer;
+        msgpack::zone z;
+        Msg::PeerInfo info = {};
+        info.mUID = uid;
+        auto msg = msgpack::object(Msg::Any {Msg::Type::PEER_INFO, msgpack::object(info, z)}, z);
+        for (size_t i = 0; i < num; i++)
+            msgpack::pack(&buffer, msg);
+        auto bye = msgpack::object(Msg::Any {Msg::Type::DISCONNECT,
+            msgpack::object(Msg::Disconnect {Msg::Disconnect::Reason::UNKNOWN, ""}, z)}, z);
+        msgpack::pack(&buffer, bye);
+        return buffer;
+    }
+
+    std::chrono::nanoseconds cpuTime() {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return std::chrono::seconds(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+            std::chrono::microseconds(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+    }
+
+    struct ChattyResult {
+        double mMsgsPerSecond;
+        int64_t mCpuNsPerMsg;
+    };
+
+    // numPeers sockets send about numMessages in total to the node on
+    //  kPort1, interleaved so all of them have data at once
+    ChattyResult chatty(P2P& node, size_t numPeers, size_t numMessages) {
+        auto perPeer = numMessages / numPeers;
+        std::vector<msgpack::sbuffer> buffers;
+        std::vector<int> socks;
+        for (size_t i = 0; i < numPeers; i++) {
+            buffers.emplace_back(chattyFrames(i + 1, perPeer));
+            int sock = connectRaw(kPort1);
+            REQUIRE(sock >= 0);
+            socks.push_back(sock);
+        }
+        while (node.getNumClients() != static_cast<int>(numPeers))
+            std::this_thread::yield();
+
+        auto start = std::chrono::steady_clock::now();
+        auto cpuStart = cpuTime();
+        std::vector<size_t> sent(numPeers);
+        for (bool pending = true; pending;) {
+            pending = false;
+            for (size_t i = 0; i < numPeers; i++) {
+                auto left = buffers[i].size() - sent[i];
+                if (left == 0)
+                    continue;
+                auto n = ::send(socks[i], buffers[i].data() + sent[i], std::min<size_t>(left, 4096), 0);
+                REQUIRE(n > 0);
+                sent[i] += n;
+                pending = true;
+            }
+        }
+        // The node closes them after the disconnect
+        while (node.getNumClients() != 0)
+            std::this_thread::yield();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        auto cpu = cpuTime() - cpuStart;
+        for (auto sock : socks)
+            close(sock);
+
+        auto total = perPeer * numPeers;
+        return {total / elapsed.count(), static_cast<int64_t>(cpu.count() / total)};
+    }
+};
+
+// Many peers sending small messages to a node, epoll against io_uring,
+//  from one reactor up to one per core
+//  run with: native-tests "[Benchmark]"
+TEST_CASE("backend benchmark", "[.][P2P][Benchmark]") {
+    constexpr size_t kMessages = 64 * 1024;
+    std::vector<unsigned> reactors = {1};
+    auto cores = std::max(1u, std::thread::hardware_concurrency());
+    while (reactors.back() < cores)
+        reactors.push_back(std::min(2 * reactors.back(), cores));
+
+    Log::mStdout = false;
+    fmt::print("{:>7} {:>8} {:>7} | {:>12} {:>12}\n", "backend", "reactors", "peers", "msgs/s", "cpu ns/msg");
+    for (auto backend : {P2P::Backend::EPOLL, P2P::Backend::URING}) {
+        for (auto numReactors : reactors) {
+            P2P node;
+            node.mBootStrap = {};
+            node.mListenPort = kPort1;
+            node.mBackend = backend;
+            node.mNumReactors = numReactors;
+            REQUIRE(node.start());
+
+            for (size_t numPeers : {1, 16, 128}) {
+                auto result = chatty(node, numPeers, kMessages);
+                fmt::print("{:>7} {:>8} {:>7} | {:>12.0f} {:>12}\n",
+                    magic_enum::enum_name(node.getBackend()), numReactors, numPeers,
+                    result.mMsgsPerSecond, result.mCpuNsPerMsg);
+            }
+        }
+    }
+    Log::mStdout = true;
+}
+
+// 200 chatty peers, with more or less ready fds taken per epoll_wait
+TEST_CASE("epoll batch benchmark", "[.][P2P][Benchmark]") {
+    constexpr size_t kMessages = 64 * 1024;
+    constexpr size_t kPeers = 200;
+
+    Log::mStdout = false;
+    fmt::print("{:>7} {:>7} | {:>12} {:>12}\n", "batch", "peers", "msgs/s", "cpu ns/msg");
+    for (int batch : {1, 8, 64, 256}) {
+        P2P node;
+        node.mBootStrap = {};
+        node.mListenPort = kPort1;
+        node.mNumReactors = 1;
+        node.mMaxEpollEvents = batch;
+        REQUIRE(node.start());
+
+        auto result = chatty(node, kPeers, kMessages);
+        fmt::print("{:>7} {:>7} | {:>12.0f} {:>12}\n",
+            batch, kPeers, result.mMsgsPerSecond, result.mCpuNsPerMsg);
+    }
+    Log::mStdout = true;
+}
+
+// Decoding of a received message of each type, as the reactors do it
+//  against the old conversion to Msg::Any and then to the struct
+TEST_CASE("decode benchmark", "[.][P2P][Benchmark]") {
+    constexpr size_t kDecodes = 100000;
+
+    auto frame = [](Msg::Type type, const auto& payload) {
+        msgpack::sbuffer buffer;
+        msgpack::zone z;
+        msgpack::pack(&buffer, msgpack::object(Msg::Any {type, msgpack::object(payload, z)}, z));
+        return buffer;
+    };
+    Msg::Discovery discovery;
+    for (int i = 0; i < P2P::kTargetNumPeers; i++)
+        discovery.mAddresses.emplace_back(fmt::format("192.168.{}.{}:{}", i, i, P2P::kDefaultListenPort));
+    std::vector<std::pair<Msg::Type, msgpack::sbuffer>> frames;
+    frames.emplace_back(Msg::Type::PEER_INFO, frame(Msg::Type::PEER_INFO, Msg::PeerInfo {}));
+    frames.emplace_back(Msg::Type::DISCOVERY, frame(Msg::Type::DISCOVERY, discovery));
+    frames.emplace_back(Msg::Type::DISCONNECT, frame(Msg::Type::DISCONNECT,
+        Msg::Disconnect {Msg::Disconnect::Reason::ROTATING, "Too many connections, try later"}));
+
+    // As the peer unpacker, the strings point to the received buffer
+    auto unpack = [](const msgpack::sbuffer& buffer) {
+        return msgpack::unpack(buffer.data(), buffer.size(), &Peer::referenceAll);
+    };
+    auto old = [](const msgpack::object& obj, size_t) {
+        Msg::Any any = obj.convert();
+        switch (any.type) {
+            case Msg::Type::PEER_INFO: {Msg::PeerInfo m = any.data.convert(); return uint32_t(sizeof(m));}
+            case Msg::Type::DISCOVERY: {Msg::Discovery m = any.data.convert(); return uint32_t(m.mAddresses.size());}
+            case Msg::Type::DISCONNECT: {Msg::Disconnect m = any.data.convert(); return uint32_t(m.mText.size());}
+        }
+        return uint32_t(0);
+    };
+    auto now = [](const msgpack::object& obj, size_t size) {
+        uint32_t r = 0;
+        Msg::decode(obj, size, [&](const auto& m){ r += sizeof(m); });
+        return r;
+    };
+
+    fmt::print("{:>10} {:>6} | {:>10} {:>12}\n", "type", "path", "ns/msg", "allocs/msg");
+    for (auto& [type, buffer] : frames) {
+        auto run = [&](const char* path, auto&& decode) {
+            uint32_t sink = 0;
+            auto allocations = threadAllocations();
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < kDecodes; i++) {
+                auto handle = unpack(buffer);
+                sink += decode(handle.get(), buffer.size());
+            }
+            std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+            fmt::print("{:>10} {:>6} | {:>10.0f} {:>12.2f}\n", magic_enum::enum_name(type), path,
+                elapsed.count() / kDecodes, double(threadAllocations() - allocations) / kDecodes);
+            CHECK(sink > 0);
+        };
+        run("any", old);
+        run("direct", now);
+    }
+}
+
+// Time until a node that (re)starts is connected to all the others, only
+//  knowing a bootstrap node against also knowing the address file
+TEST_CASE("restart benchmark", "[.][P2P][Benchmark]") {
+    constexpr int kNodes = 8;
+    constexpr int kRounds = 9;
+    constexpr int kFirstPort = 12320;
+    auto path = std::filesystem::temp_directory_path() / "freedomdb_bench_addresses.bin";
+
+    Log::mStdout = false;
+    std::vector<std::unique_ptr<P2P>> nodes;
+    for (int i = 0; i < kNodes; i++) {
+        nodes.emplace_back(std::make_unique<P2P>());
+        nodes.back()->mListenPort = kFirstPort + i;
+        nodes.back()->mNumReactors = 1;
+        nodes.back()->mBootStrap = {fmt::format("127.0.0.1:{}", kFirstPort)};
+        REQUIRE(nodes.back()->start());
+    }
+    std::this_thread::sleep_for(2*kWaitTimeOut);
+
+    auto meshTime = [&]() {
+        P2P node;
+        node.mListenPort = kFirstPort + kNodes;
+        node.mNumReactors = 1;
+        node.mBootStrap = {fmt::format("127.0.0.1:{}", kFirstPort)};
+        node.mAddressFile = path;
+        auto start = std::chrono::steady_clock::now();
+        REQUIRE(node.start());
+        while (node.getNumClients() < kNodes && std::chrono::steady_clock::now() - start < 5s)
+            std::this_thread::yield();
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        // The others can connect to it as well
+        CHECK(node.getNumClients() >= kNodes);
+        node.stop();
+        // The others forget it before the next round
+        std::this_thread::sleep_for(kWaitTimeOut);
+        return elapsed.count();
+    };
+
+    std::vector<double> cold, warm;
+    for (int round = 0; round < kRounds; round++) {
+        std::filesystem::remove(path);
+        cold.push_back(meshTime());
+        warm.push_back(meshTime());
+    }
+    auto median = [](std::vector<double>& v) {
+        std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+        return v[v.size() / 2];
+    };
+    fmt::print("{:>6} | {:>12}\n", "start", "ms to mesh");
+    fmt::print("{:>6} | {:>12.2f}\n", "cold", median(cold));
+    fmt::print("{:>6} | {:>12.2f}\n", "warm", median(warm));
+    std::filesystem::remove(path);
+    Log::mStdout = true;
 }
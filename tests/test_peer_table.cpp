@@ -0,0 +1,62 @@
+#include <catch2/catch_all.hpp>
+
+#include "p2p/peer_table.h"
+
+TEST_CASE("peer table", "[P2P]") {
+    PeerTable table;
+    std::unique_lock<std::recursive_mutex> lock;
+
+    SECTION("empty") {
+        CHECK(table.size() == 0);
+        CHECK(table.lock(3, lock) == nullptr);
+        CHECK(table.lock(-1, lock) == nullptr);
+    }
+    SECTION("insert, find and erase") {
+        auto peer = table.insert(3, lock);
+        REQUIRE(peer != nullptr);
+        CHECK(lock.owns_lock());
+        CHECK(peer->mFd == 3);
+        peer->mConPort = 1234;
+        lock.unlock();
+        CHECK(table.size() == 1);
+
+        auto found = table.lock(3, lock);
+        REQUIRE(found == peer);
+        CHECK(found->mConPort == 1234);
+        table.erase(*found);
+        lock.unlock();
+        CHECK(table.size() == 0);
+        CHECK(table.lock(3, lock) == nullptr);
+    }
+    SECTION("reused slots are reset, old generations are not found") {
+        auto peer = table.insert(1000, lock);
+        REQUIRE(peer != nullptr);
+        auto generation = peer->mGeneration;
+        peer->mReady = true;
+        table.erase(*peer);
+        lock.unlock();
+
+        auto reused = table.insert(1000, lock);
+        lock.unlock();
+        CHECK(reused == peer);
+        CHECK(reused->mReady == false);
+        CHECK(table.lock(1000, lock, generation) == nullptr);
+        CHECK(table.lock(1000, lock, reused->mGeneration) == reused);
+    }
+    SECTION("for each peer in use") {
+        for (int fd : {5, 70, 9000}) {
+            table.insert(fd, lock);
+            lock.unlock();
+        }
+        table.erase(*table.lock(70, lock));
+        lock.unlock();
+
+        std::vector<int> fds;
+        table.forEach([&](Peer& peer){ fds.push_back(peer.mFd); });
+        CHECK(fds == std::vector<int>{5, 9000});
+    }
+    SECTION("fds out of the table") {
+        CHECK(table.insert(PeerTable::kChunkSize * PeerTable::kMaxChunks, lock) == nullptr);
+        CHECK(table.size() == 0);
+    }
+}
@@ -0,0 +1,49 @@
+#include <catch2/catch_all.hpp>
+
+#include "p2p/seen_set.h"
+
+namespace {
+    Msg::Hash hashOf(uint64_t n) {
+        // Spread like a real hash, the set only uses some of its bits
+        Msg::Hash hash = {};
+        for (size_t i = 0; i < hash.size(); i += sizeof(n)) {
+            n = (n ^ (n >> 31)) * 0x9e3779b97f4a7c15ull + i;
+            memcpy(hash.data() + i, &n, sizeof(n));
+        }
+        return hash;
+    }
+};
+
+TEST_CASE("seen set", "[P2P]") {
+    constexpr size_t kCapacity = 1000;
+    SeenSet seen(kCapacity, 16);
+
+    SECTION("inserted ones are seen once") {
+        CHECK(seen.contains(hashOf(1)) == false);
+        CHECK(seen.insert(hashOf(1)) == true);
+        CHECK(seen.contains(hashOf(1)) == true);
+        CHECK(seen.insert(hashOf(1)) == false);
+    }
+    SECTION("the latest capacity ones are never forgotten") {
+        for (uint64_t i = 0; i < 10 * kCapacity; i++) {
+            seen.insert(hashOf(i));
+            REQUIRE(seen.contains(hashOf(i - std::min<uint64_t>(i, kCapacity))));
+        }
+    }
+    SECTION("older ones are forgotten, few false positives") {
+        for (uint64_t i = 0; i < 3 * kCapacity; i++)
+            seen.insert(hashOf(i));
+        size_t old = 0, never = 0;
+        for (uint64_t i = 0; i < kCapacity; i++) {
+            old += seen.contains(hashOf(i));
+            never += seen.contains(hashOf(100 * kCapacity + i));
+        }
+        CHECK(old < kCapacity / 100);
+        CHECK(never < kCapacity / 100);
+    }
+    SECTION("clear") {
+        seen.insert(hashOf(1));
+        seen.clear();
+        CHECK(seen.contains(hashOf(1)) == false);
+    }
+}